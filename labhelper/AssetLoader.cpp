@@ -0,0 +1,165 @@
+#include "AssetLoader.h"
+#include <cstdint>
+#include <exception>
+#include <GL/glew.h>
+#include "labhelper.h"
+
+namespace labhelper
+{
+	AssetLoader::AssetLoader(int num_workers)
+	{
+		for (int i = 0; i < num_workers; i++) {
+			m_workers.push_back(std::thread(&AssetLoader::work, this));
+		}
+	}
+
+	AssetLoader::~AssetLoader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_work_available.notify_all();
+		for (auto & worker : m_workers) worker.join();
+
+		// Unfinished models stay empty
+		for (auto & job : m_finished) delete job.loaded;
+		for (auto & job : m_uploading) delete job.loaded;
+		if (m_pixel_buffer != 0) glDeleteBuffers(1, &m_pixel_buffer);
+	}
+
+	Model * AssetLoader::loadModelAsync(const std::string & filename, VertexFormat vertex_format)
+	{
+		Job job;
+		job.target = new Model;
+		job.target->m_filename = filename;
+		job.target->m_vertex_format = vertex_format;
+		job.filename = filename;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back(job);
+		}
+		m_work_available.notify_one();
+		m_pending += 1;
+		return job.target;
+	}
+
+	void AssetLoader::work()
+	{
+		while (true) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_work_available.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+				if (m_stopping) return;
+				job = m_queue.front();
+				m_queue.pop_front();
+			}
+
+			try {
+				job.loaded = readModelFromOBJ(job.filename);
+			}
+			catch (const std::exception &) {
+				job.loaded = nullptr;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_finished.push_back(job);
+			}
+			m_work_finished.notify_all();
+		}
+	}
+
+	size_t AssetLoader::uploadNext()
+	{
+		Job & job = m_uploading.front();
+		size_t uploaded = 0;
+		if (!job.buffers_uploaded) {
+			Model * target = job.target;
+			Model * loaded = job.loaded;
+			target->m_name = loaded->m_name;
+			target->m_materials = std::move(loaded->m_materials);
+			target->m_meshes = std::move(loaded->m_meshes);
+			target->m_positions = std::move(loaded->m_positions);
+			target->m_normals = std::move(loaded->m_normals);
+			target->m_texture_coordinates = std::move(loaded->m_texture_coordinates);
+			target->m_indices = std::move(loaded->m_indices);
+			delete loaded;
+			job.loaded = nullptr;
+
+			uploadModelBuffers(target);
+			uploaded = target->m_positions.size() * bytesPerVertex(target->m_vertex_format)
+			           + target->m_indices.size() * sizeof(uint32_t);
+			job.buffers_uploaded = true;
+			for (auto & material : target->m_materials) {
+				for (Texture * texture : { &material.m_color_texture, &material.m_reflectivity_texture,
+				                           &material.m_shininess_texture, &material.m_metalness_texture,
+				                           &material.m_fresnel_texture, &material.m_emission_texture }) {
+					// Textures that failed to decode have no data and stay invalid
+					if (!texture->data.empty()) job.textures.push_back(texture);
+				}
+			}
+		}
+		else {
+			Texture * texture = job.textures.back();
+			job.textures.pop_back();
+			if (m_pixel_buffer == 0) glGenBuffers(1, &m_pixel_buffer);
+			uploaded = texture->data.size();
+			texture->upload(m_pixel_buffer);
+		}
+
+		if (job.textures.empty()) {
+			m_uploading.pop_front();
+			m_pending -= 1;
+		}
+		return uploaded;
+	}
+
+	void AssetLoader::update(size_t upload_budget)
+	{
+		std::vector<Job> finished;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			finished.swap(m_finished);
+		}
+		// Failures are reported here, on the main thread
+		for (auto & job : finished) {
+			if (job.loaded != nullptr) {
+				m_uploading.push_back(job);
+				continue;
+			}
+			non_fatal_error("Could not load " + job.filename, "AssetLoader");
+			m_failed.insert(job.target);
+			m_pending -= 1;
+		}
+
+		size_t uploaded = 0;
+		bool first = true;
+		while (!m_uploading.empty() && (first || uploaded < upload_budget)) {
+			uploaded += uploadNext();
+			first = false;
+		}
+	}
+
+	void AssetLoader::finish()
+	{
+		while (m_pending > 0) {
+			if (m_uploading.empty()) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_work_finished.wait(lock, [this] { return !m_finished.empty(); });
+			}
+			update(SIZE_MAX);
+		}
+	}
+
+	size_t AssetLoader::pending() const
+	{
+		return m_pending;
+	}
+
+	bool AssetLoader::failed(const Model * model) const
+	{
+		return m_failed.count(model) != 0;
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Model.h"
+
+namespace labhelper
+{
+	// Loads models on worker threads and uploads them a little at a time on the main thread.
+	//
+	// loadModelAsync returns an empty Model straight away, which render skips until its
+	// buffers are uploaded during update. Its textures are uploaded after the buffers, one
+	// by one through a pixel buffer object, and are left out of rendering until then.
+	// Returned models belong to the caller as usual, but must outlive the loader. A model
+	// that fails to load is reported during update and stays empty.
+	class AssetLoader
+	{
+	public:
+		AssetLoader(int num_workers = 1);
+		~AssetLoader();
+
+		// Main thread only
+		Model * loadModelAsync(const std::string & filename, VertexFormat vertex_format = VertexFormat::separate);
+		// Upload finished work until upload_budget bytes have gone to the GPU. At least one
+		// buffer set or texture is uploaded if any is ready, so loading always progresses.
+		void update(size_t upload_budget);
+		// Upload everything requested, waiting for the workers as needed
+		void finish();
+
+		// Models requested but not completely uploaded
+		size_t pending() const;
+		// Whether model could not be read
+		bool failed(const Model * model) const;
+
+	private:
+		struct Job
+		{
+			Model * target;
+			std::string filename;
+			// Read by a worker, its contents are moved into target when uploaded. Stays
+			// nullptr if reading failed.
+			Model * loaded = nullptr;
+			// Textures of target left to upload, once its buffers are
+			std::vector<Texture *> textures;
+			bool buffers_uploaded = false;
+		};
+
+		// Main thread state
+		std::deque<Job> m_uploading;
+		std::set<const Model *> m_failed;
+		size_t m_pending = 0;
+		uint32_t m_pixel_buffer = 0;
+
+		// Shared with the workers
+		std::mutex m_mutex;
+		std::condition_variable m_work_available;
+		std::condition_variable m_work_finished;
+		std::deque<Job> m_queue;
+		std::vector<Job> m_finished;
+		bool m_stopping = false;
+		std::vector<std::thread> m_workers;
+
+		void work();
+		// Upload the next part of the oldest job, returns the bytes uploaded
+		size_t uploadNext();
+	};
+}
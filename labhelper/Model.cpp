@@ -1,45 +1,1118 @@
+#ifdef WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define VC_EXTRALEAN
+  #define NOMINMAX
+#include <windows.h>
+#undef near
+#undef far
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // WIN32
+#include <sys/stat.h>
+
 #include "Model.h"
 #include <iostream>
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include <tiny_obj_loader.h>
-//#include <experimental/tinyobj_loader_opt.h>
 #include <algorithm>
 #include <sstream>
 #include <iomanip> 
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <map>
+#include <thread>
+#include <functional>
+#include <mutex>
 #include <GL/glew.h>
+#include <glm/gtc/packing.hpp>
 #include <stb_image.h>
+#define STB_DXT_IMPLEMENTATION
+// The default of this stb_dxt version takes one argument and does not compile
+#define STBD_MEMSET memset
+#include <stb_dxt.h>
 
 namespace labhelper
 {
 	bool Texture::load(const std::string & _directory, const std::string & _filename, int _components)
+	{
+		if (!decode(_directory, _filename, _components)) {
+			exit(1);
+		}
+		upload();
+		return true; 
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Parallel OBJ parsing
+	//
+	// The file is read whole and split at line breaks into one chunk per
+	// thread. Each thread parses the attributes and faces of its chunk with
+	// tinyobj's own number and index parsing, and keeps the other lines for
+	// later. The chunks are then merged in order, which resolves relative
+	// indices, loads material libraries and groups faces into shapes exactly
+	// as tinyobj::LoadObj does with triangulation. Subdivision tags ('t') are
+	// not supported.
+	///////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// Chunks smaller than this are not worth a thread
+		const size_t min_obj_chunk_size = 256 * 1024;
+		// Relative indices are parsed against this plus the count in the chunk so far and
+		// resolved once the counts of the earlier chunks are known
+		const int relative_index_base = 1 << 30;
+
+		struct ObjChunk
+		{
+			std::vector<tinyobj::real_t> v, vn, vt;
+			// Corners of all faces, and the number of corners of each face
+			std::vector<tinyobj::vertex_index> corners;
+			std::vector<uint32_t> face_sizes;
+			// Lines other than attributes and faces, with the number of faces before each
+			std::vector<std::pair<size_t, const char *>> commands;
+		};
+
+		// Parse lines in [begin, end), which are terminated in place
+		void parseObjChunk(char * begin, char * end, ObjChunk & chunk)
+		{
+			for (char * line = begin; line < end;) {
+				char * line_end = (char *)memchr(line, '\n', end - line);
+				if (line_end == nullptr) line_end = end;
+				*line_end = '\0';
+				if (line_end > line && line_end[-1] == '\r') line_end[-1] = '\0';
+				const char * token = line;
+				line = line_end + 1;
+
+				token += strspn(token, " \t");
+				if (token[0] == '\0' || token[0] == '#') continue;
+
+				if (token[0] == 'v' && IS_SPACE((token[1]))) {
+					token += 2;
+					tinyobj::real_t x, y, z;
+					tinyobj::parseReal3(&x, &y, &z, &token);
+					chunk.v.push_back(x);
+					chunk.v.push_back(y);
+					chunk.v.push_back(z);
+				}
+				else if (token[0] == 'v' && token[1] == 'n' && IS_SPACE((token[2]))) {
+					token += 3;
+					tinyobj::real_t x, y, z;
+					tinyobj::parseReal3(&x, &y, &z, &token);
+					chunk.vn.push_back(x);
+					chunk.vn.push_back(y);
+					chunk.vn.push_back(z);
+				}
+				else if (token[0] == 'v' && token[1] == 't' && IS_SPACE((token[2]))) {
+					token += 3;
+					tinyobj::real_t x, y;
+					tinyobj::parseReal2(&x, &y, &token);
+					chunk.vt.push_back(x);
+					chunk.vt.push_back(y);
+				}
+				else if (token[0] == 'f' && IS_SPACE((token[1]))) {
+					token += 2;
+					token += strspn(token, " \t");
+					size_t first_corner = chunk.corners.size();
+					while (!IS_NEW_LINE(token[0])) {
+						chunk.corners.push_back(tinyobj::parseTriple(&token,
+							relative_index_base + int(chunk.v.size() / 3),
+							relative_index_base + int(chunk.vn.size() / 3),
+							relative_index_base + int(chunk.vt.size() / 2)));
+						token += strspn(token, " \t\r");
+					}
+					chunk.face_sizes.push_back(uint32_t(chunk.corners.size() - first_corner));
+				}
+				else {
+					chunk.commands.push_back(std::make_pair(chunk.face_sizes.size(), token));
+				}
+			}
+		}
+
+		int resolveIndex(int index, int chunk_base)
+		{
+			return index >= relative_index_base / 2 ? index - relative_index_base + chunk_base : index;
+		}
+
+		// Same results as tinyobj::LoadObj with triangulation, parsed on up to
+		// num_threads threads, or one per core if 0
+		bool loadObjParallel(tinyobj::attrib_t * attrib, std::vector<tinyobj::shape_t> * shapes,
+		                     std::vector<tinyobj::material_t> * materials, std::string * err,
+		                     const std::string & filename, const std::string & mtl_basedir, int num_threads = 0)
+		{
+			attrib->vertices.clear();
+			attrib->normals.clear();
+			attrib->texcoords.clear();
+			shapes->clear();
+
+			FILE * file = fopen(filename.c_str(), "rb");
+			if (file == nullptr) {
+				(*err) += "Cannot open file [" + filename + "]\n";
+				return false;
+			}
+			fseek(file, 0, SEEK_END);
+			size_t size = size_t(ftell(file));
+			fseek(file, 0, SEEK_SET);
+			std::vector<char> text(size + 1);
+			size = fread(text.data(), 1, size, file);
+			fclose(file);
+			text[size] = '\0';
+
+			///////////////////////////////////////////////////////////////////
+			// Parse chunks ending at line breaks in parallel
+			///////////////////////////////////////////////////////////////////
+			if (num_threads <= 0) num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+			num_threads = std::max(1, std::min(num_threads, int(size / min_obj_chunk_size)));
+			std::vector<char *> chunk_begins(1, text.data());
+			for (int i = 1; i < num_threads; i++) {
+				char * split = std::max(chunk_begins.back(), text.data() + size * i / num_threads);
+				char * line_break = (char *)memchr(split, '\n', text.data() + size - split);
+				if (line_break == nullptr) break;
+				chunk_begins.push_back(line_break + 1);
+			}
+			chunk_begins.push_back(text.data() + size);
+
+			std::vector<ObjChunk> chunks(chunk_begins.size() - 1);
+			std::vector<std::thread> threads;
+			for (size_t i = 1; i < chunks.size(); i++) {
+				threads.push_back(std::thread(parseObjChunk, chunk_begins[i], chunk_begins[i + 1], std::ref(chunks[i])));
+			}
+			parseObjChunk(chunk_begins[0], chunk_begins[1], chunks[0]);
+			for (auto & thread : threads) thread.join();
+
+			///////////////////////////////////////////////////////////////////
+			// Concatenate the attributes
+			///////////////////////////////////////////////////////////////////
+			size_t number_of_v = 0, number_of_vn = 0, number_of_vt = 0;
+			for (const auto & chunk : chunks) {
+				number_of_v += chunk.v.size();
+				number_of_vn += chunk.vn.size();
+				number_of_vt += chunk.vt.size();
+			}
+			attrib->vertices.reserve(number_of_v);
+			attrib->normals.reserve(number_of_vn);
+			attrib->texcoords.reserve(number_of_vt);
+
+			///////////////////////////////////////////////////////////////////
+			// Replay faces and commands in file order, grouping faces into
+			// shapes the way tinyobj::LoadObj does
+			///////////////////////////////////////////////////////////////////
+			std::map<std::string, int> material_map;
+			tinyobj::MaterialFileReader material_reader(mtl_basedir);
+			int material = -1;
+			std::string name;
+			tinyobj::shape_t shape;
+			// Whether faces were added since the shape was last named
+			bool group_has_faces = false;
+			auto exportGroup = [&]() {
+				if (group_has_faces) shape.name = name;
+				bool exported = group_has_faces;
+				group_has_faces = false;
+				return exported;
+			};
+
+			for (auto & chunk : chunks) {
+				int v_base = int(attrib->vertices.size() / 3);
+				int vn_base = int(attrib->normals.size() / 3);
+				int vt_base = int(attrib->texcoords.size() / 2);
+				attrib->vertices.insert(attrib->vertices.end(), chunk.v.begin(), chunk.v.end());
+				attrib->normals.insert(attrib->normals.end(), chunk.vn.begin(), chunk.vn.end());
+				attrib->texcoords.insert(attrib->texcoords.end(), chunk.vt.begin(), chunk.vt.end());
+
+				size_t face = 0, corner = 0;
+				auto addFaces = [&](size_t face_end) {
+					for (; face < face_end; corner += chunk.face_sizes[face], face++) {
+						tinyobj::index_t indices[2];
+						for (uint32_t k = 0; k < chunk.face_sizes[face]; k++) {
+							const tinyobj::vertex_index & parsed = chunk.corners[corner + k];
+							tinyobj::index_t index;
+							index.vertex_index = resolveIndex(parsed.v_idx, v_base);
+							index.normal_index = resolveIndex(parsed.vn_idx, vn_base);
+							index.texcoord_index = resolveIndex(parsed.vt_idx, vt_base);
+							// Polygon to triangle fan
+							if (k >= 2) {
+								shape.mesh.indices.push_back(indices[0]);
+								shape.mesh.indices.push_back(indices[1]);
+								shape.mesh.indices.push_back(index);
+								shape.mesh.num_face_vertices.push_back(3);
+								shape.mesh.material_ids.push_back(material);
+							}
+							indices[k == 0 ? 0 : 1] = index;
+						}
+						group_has_faces = true;
+					}
+				};
+
+				for (const auto & command : chunk.commands) {
+					addFaces(command.first);
+					const char * token = command.second;
+
+					if ((0 == strncmp(token, "usemtl", 6)) && IS_SPACE((token[6]))) {
+						char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
+						token += 7;
+#ifdef _MSC_VER
+						sscanf_s(token, "%s", namebuf, (unsigned)_countof(namebuf));
+#else
+						std::sscanf(token, "%s", namebuf);
+#endif
+						auto found = material_map.find(namebuf);
+						int new_material = found != material_map.end() ? found->second : -1;
+						if (new_material != material) {
+							exportGroup();
+							material = new_material;
+						}
+					}
+					else if ((0 == strncmp(token, "mtllib", 6)) && IS_SPACE((token[6]))) {
+						std::vector<std::string> filenames;
+						tinyobj::SplitString(std::string(token + 7), ' ', filenames);
+						bool found = false;
+						for (const auto & mtl_filename : filenames) {
+							std::string err_mtl;
+							bool ok = material_reader(mtl_filename, materials, &material_map, &err_mtl);
+							(*err) += err_mtl;
+							if (ok) {
+								found = true;
+								break;
+							}
+						}
+						if (!found) {
+							(*err) += filenames.empty() ? "WARN: Looks like empty filename for mtllib. Use default material. \n"
+							                            : "WARN: Failed to load material file(s). Use default material.\n";
+						}
+					}
+					else if (token[0] == 'g' && IS_SPACE((token[1]))) {
+						if (exportGroup()) shapes->push_back(shape);
+						shape = tinyobj::shape_t();
+						std::vector<std::string> names;
+						while (!IS_NEW_LINE(token[0])) {
+							names.push_back(tinyobj::parseString(&token));
+							token += strspn(token, " \t\r");
+						}
+						// names[0] is the 'g'
+						name = names.size() > 1 ? names[1] : "";
+					}
+					else if (token[0] == 'o' && IS_SPACE((token[1]))) {
+						if (exportGroup()) shapes->push_back(shape);
+						shape = tinyobj::shape_t();
+						char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
+						token += 2;
+#ifdef _MSC_VER
+						sscanf_s(token, "%s", namebuf, (unsigned)_countof(namebuf));
+#else
+						std::sscanf(token, "%s", namebuf);
+#endif
+						name = namebuf;
+					}
+				}
+				addFaces(chunk.face_sizes.size());
+			}
+			if (exportGroup() || shape.mesh.indices.size()) shapes->push_back(shape);
+			return true;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Indexing
+	//
+	// Face corners with the same position, normal and texture coordinate
+	// share one vertex. The triangles of each mesh are then reordered for the
+	// post-transform vertex cache with Tipsify (Sander et al., "Fast Triangle
+	// Reordering for Vertex Locality and Reduced Overdraw", 2007), and the
+	// vertices are stored in the order the triangles first use them.
+	///////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		struct Vertex
+		{
+			glm::vec3 position;
+			glm::vec3 normal;
+			glm::vec2 texture_coordinate;
+			bool operator==(const Vertex & other) const { return memcmp(this, &other, sizeof(Vertex)) == 0; }
+		};
+
+		struct VertexHash
+		{
+			size_t operator()(const Vertex & vertex) const
+			{
+				// FNV-1a over the attribute bits
+				const unsigned char * bytes = (const unsigned char *)&vertex;
+				uint64_t hash = 14695981039346656037ull;
+				for (size_t i = 0; i < sizeof(Vertex); i++) {
+					hash = (hash ^ bytes[i]) * 1099511628211ull;
+				}
+				return size_t(hash);
+			}
+		};
+
+		// Vertices the post-transform cache is assumed to hold
+		const int vertex_cache_size = 16;
+
+		std::vector<uint32_t> tipsify(const std::vector<uint32_t> & indices, size_t number_of_vertices, int cache_size)
+		{
+			if (indices.empty()) return indices;
+
+			// Triangles around each vertex
+			std::vector<uint32_t> adjacency_offsets(number_of_vertices + 1, 0);
+			for (uint32_t index : indices) adjacency_offsets[index + 1]++;
+			for (size_t v = 0; v < number_of_vertices; v++) adjacency_offsets[v + 1] += adjacency_offsets[v];
+			std::vector<uint32_t> adjacency(indices.size());
+			std::vector<uint32_t> adjacency_fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+			for (size_t i = 0; i < indices.size(); i++) {
+				adjacency[adjacency_fill[indices[i]]++] = uint32_t(i / 3);
+			}
+
+			std::vector<int> live_triangles(number_of_vertices);
+			for (size_t v = 0; v < number_of_vertices; v++) {
+				live_triangles[v] = int(adjacency_offsets[v + 1] - adjacency_offsets[v]);
+			}
+			std::vector<int> cache_time(number_of_vertices, 0);
+			std::vector<bool> emitted(indices.size() / 3, false);
+			std::vector<uint32_t> dead_end;
+			std::vector<uint32_t> candidates;
+			std::vector<uint32_t> result;
+			result.reserve(indices.size());
+
+			int time = cache_size + 1;
+			size_t cursor = 0;
+			int fanning = 0;
+			while (fanning >= 0) {
+				// Emit every remaining triangle around the fanning vertex
+				candidates.clear();
+				for (uint32_t a = adjacency_offsets[fanning]; a < adjacency_offsets[fanning + 1]; a++) {
+					uint32_t triangle = adjacency[a];
+					if (emitted[triangle]) continue;
+					for (int j = 0; j < 3; j++) {
+						uint32_t v = indices[triangle * 3 + j];
+						result.push_back(v);
+						dead_end.push_back(v);
+						candidates.push_back(v);
+						live_triangles[v]--;
+						if (time - cache_time[v] > cache_size) cache_time[v] = time++;
+					}
+					emitted[triangle] = true;
+				}
+
+				// Continue from the candidate that entered the cache earliest, among those
+				// whose remaining triangles can be emitted before it leaves the cache
+				fanning = -1;
+				int best_priority = 0;
+				for (uint32_t v : candidates) {
+					if (live_triangles[v] <= 0) continue;
+					int priority = 0;
+					if (time - cache_time[v] + 2 * live_triangles[v] <= cache_size) priority = time - cache_time[v];
+					if (priority > best_priority) {
+						best_priority = priority;
+						fanning = int(v);
+					}
+				}
+				// At a dead end, use the most recently emitted vertex left, or else the next one in order
+				while (fanning < 0 && !dead_end.empty()) {
+					uint32_t v = dead_end.back();
+					dead_end.pop_back();
+					if (live_triangles[v] > 0) fanning = int(v);
+				}
+				while (fanning < 0 && cursor < number_of_vertices) {
+					if (live_triangles[cursor] > 0) fanning = int(cursor);
+					cursor++;
+				}
+			}
+			return result;
+		}
+
+		// Append a mesh given as three corners per triangle to the model's vertex and index buffers
+		void appendIndexedMesh(Model * model, const std::vector<Vertex> & corners)
+		{
+			std::unordered_map<Vertex, uint32_t, VertexHash> unique_indices;
+			std::vector<Vertex> vertices;
+			std::vector<uint32_t> indices(corners.size());
+			for (size_t i = 0; i < corners.size(); i++) {
+				auto inserted = unique_indices.insert(std::make_pair(corners[i], uint32_t(vertices.size())));
+				if (inserted.second) vertices.push_back(corners[i]);
+				indices[i] = inserted.first->second;
+			}
+			indices = tipsify(indices, vertices.size(), vertex_cache_size);
+
+			std::vector<uint32_t> model_indices(vertices.size(), UINT32_MAX);
+			for (uint32_t index : indices) {
+				if (model_indices[index] == UINT32_MAX) {
+					model_indices[index] = uint32_t(model->m_positions.size());
+					model->m_positions.push_back(vertices[index].position);
+					model->m_normals.push_back(vertices[index].normal);
+					model->m_texture_coordinates.push_back(vertices[index].texture_coordinate);
+				}
+				model->m_indices.push_back(model_indices[index]);
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Binary model cache
+	//
+	// Parsed models are written next to their OBJ file as <name>.modelcache.
+	// The cache records the size and modification time of the OBJ and of its
+	// material libraries, and is only used while they all still match. The
+	// vertex and index streams are stored as they are uploaded, so a cached model is
+	// memory mapped and handed straight to glBufferData.
+	///////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const char model_cache_magic[8] = { 'L', 'H', 'M', 'O', 'D', 'E', 'L', '\0' };
+		const uint32_t model_cache_version = 2;
+		// Vertex streams start at a multiple of this
+		const size_t model_cache_alignment = 16;
+
+		struct SourceStamp
+		{
+			std::string filename; // Relative to the model's directory
+			uint64_t size;
+			int64_t mtime;
+		};
+
+		bool stampFile(const std::string & directory, const std::string & filename, SourceStamp & stamp)
+		{
+			std::string path = directory + filename;
+#ifdef WIN32
+			struct _stat64 info;
+			if (_stat64(path.c_str(), &info) != 0) return false;
+#else
+			struct stat info;
+			if (stat(path.c_str(), &info) != 0) return false;
+#endif
+			stamp.filename = filename;
+			stamp.size = uint64_t(info.st_size);
+			stamp.mtime = int64_t(info.st_mtime);
+			return true;
+		}
+
+		// The OBJ file followed by the material libraries it references
+		std::vector<SourceStamp> stampSources(const std::string & directory, const std::string & obj_filename)
+		{
+			std::vector<SourceStamp> stamps;
+			SourceStamp stamp;
+			if (!stampFile(directory, obj_filename, stamp)) return stamps;
+			stamps.push_back(stamp);
+
+			std::ifstream obj_file(directory + obj_filename);
+			std::string line;
+			while (std::getline(obj_file, line)) {
+				if (line.compare(0, 7, "mtllib ") != 0) continue;
+				std::istringstream names(line.substr(7));
+				std::string name;
+				while (names >> name) {
+					if (stampFile(directory, name, stamp)) stamps.push_back(stamp);
+				}
+			}
+			return stamps;
+		}
+
+		class MappedFile
+		{
+		public:
+			~MappedFile() { close(); }
+			bool open(const std::string & path)
+			{
+#ifdef WIN32
+				m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+				if (m_file == INVALID_HANDLE_VALUE) return false;
+				LARGE_INTEGER size;
+				if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return false;
+				m_size = size_t(size.QuadPart);
+				m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (m_mapping == nullptr) return false;
+				m_data = (const char *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+				m_fd = ::open(path.c_str(), O_RDONLY);
+				if (m_fd < 0) return false;
+				struct stat info;
+				if (fstat(m_fd, &info) != 0 || info.st_size == 0) return false;
+				m_size = size_t(info.st_size);
+				void * data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+				m_data = data == MAP_FAILED ? nullptr : (const char *)data;
+#endif
+				return m_data != nullptr;
+			}
+			void close()
+			{
+#ifdef WIN32
+				if (m_data != nullptr) UnmapViewOfFile(m_data);
+				if (m_mapping != nullptr) CloseHandle(m_mapping);
+				if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+				m_mapping = nullptr;
+				m_file = INVALID_HANDLE_VALUE;
+#else
+				if (m_data != nullptr) munmap((void *)m_data, m_size);
+				if (m_fd >= 0) ::close(m_fd);
+				m_fd = -1;
+#endif
+				m_data = nullptr;
+				m_size = 0;
+			}
+			const char * data() const { return m_data; }
+			size_t size() const { return m_size; }
+		private:
+#ifdef WIN32
+			HANDLE m_file = INVALID_HANDLE_VALUE;
+			HANDLE m_mapping = nullptr;
+#else
+			int m_fd = -1;
+#endif
+			const char * m_data = nullptr;
+			size_t m_size = 0;
+		};
+
+		class CacheWriter
+		{
+		public:
+			std::vector<char> buffer;
+			template <typename T> void write(const T & value)
+			{
+				const char * bytes = (const char *)&value;
+				buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+			}
+			void writeString(const std::string & value)
+			{
+				write(uint32_t(value.size()));
+				buffer.insert(buffer.end(), value.begin(), value.end());
+			}
+			void writeArray(const void * data, size_t bytes)
+			{
+				buffer.insert(buffer.end(), (const char *)data, (const char *)data + bytes);
+			}
+			void align()
+			{
+				buffer.resize((buffer.size() + model_cache_alignment - 1) / model_cache_alignment * model_cache_alignment, 0);
+			}
+		};
+
+		// Reads from a mapped cache, any read past the end leaves ok false
+		class CacheReader
+		{
+		public:
+			bool ok = true;
+			CacheReader(const char * data, size_t size) : m_data(data), m_size(size) {}
+			template <typename T> T read()
+			{
+				T value = T();
+				const char * bytes = readArray(sizeof(T));
+				if (bytes != nullptr) memcpy(&value, bytes, sizeof(T));
+				return value;
+			}
+			std::string readString()
+			{
+				uint32_t length = read<uint32_t>();
+				const char * chars = readArray(length);
+				return chars != nullptr ? std::string(chars, length) : std::string();
+			}
+			const char * readArray(size_t bytes)
+			{
+				if (!ok || bytes > m_size - m_offset) {
+					ok = false;
+					return nullptr;
+				}
+				const char * data = m_data + m_offset;
+				m_offset += bytes;
+				return data;
+			}
+			void align()
+			{
+				m_offset = std::min(m_size, (m_offset + model_cache_alignment - 1) / model_cache_alignment * model_cache_alignment);
+			}
+		private:
+			const char * m_data;
+			size_t m_size;
+			size_t m_offset = 0;
+		};
+
+		const size_t number_of_material_textures = 6;
+		Texture Material::* const material_textures[number_of_material_textures] = {
+			&Material::m_color_texture, &Material::m_reflectivity_texture, &Material::m_shininess_texture,
+			&Material::m_metalness_texture, &Material::m_fresnel_texture, &Material::m_emission_texture
+		};
+		// Components each texture above is loaded with
+		const int material_texture_components[number_of_material_textures] = { 4, 1, 1, 1, 1, 4 };
+
+		// Record which image a texture is loaded from, without loading it
+		void nameTexture(Texture & texture, const std::string & directory, const std::string & filename, int components)
+		{
+			texture.directory = directory;
+			texture.filename = filename;
+			texture.components = components;
+		}
+
+		// Written under another name and renamed, so that an interrupted write never leaves a broken cache
+		void writeCache(const CacheWriter & writer, const std::string & cache_path)
+		{
+			std::string temporary_path = cache_path + ".tmp";
+			FILE * file = fopen(temporary_path.c_str(), "wb");
+			if (file == nullptr) return;
+			bool written = fwrite(writer.buffer.data(), 1, writer.buffer.size(), file) == writer.buffer.size();
+			written &= fclose(file) == 0;
+			std::remove(cache_path.c_str());
+			if (!written || std::rename(temporary_path.c_str(), cache_path.c_str()) != 0) {
+				std::remove(temporary_path.c_str());
+			}
+		}
+
+		void writeModelCache(const Model * model, const std::vector<SourceStamp> & sources, const std::string & cache_path)
+		{
+			CacheWriter writer;
+			writer.writeArray(model_cache_magic, sizeof(model_cache_magic));
+			writer.write(model_cache_version);
+			writer.write(uint32_t(sources.size()));
+			for (const auto & source : sources) {
+				writer.writeString(source.filename);
+				writer.write(source.size);
+				writer.write(source.mtime);
+			}
+			writer.write(uint32_t(model->m_materials.size()));
+			for (const auto & material : model->m_materials) {
+				writer.writeString(material.m_name);
+				writer.write(material.m_color);
+				writer.write(material.m_reflectivity);
+				writer.write(material.m_shininess);
+				writer.write(material.m_metalness);
+				writer.write(material.m_fresnel);
+				writer.write(material.m_emission);
+				writer.write(material.m_transparency);
+				for (auto texture : material_textures) {
+					writer.writeString((material.*texture).filename);
+				}
+			}
+			writer.write(uint32_t(model->m_meshes.size()));
+			for (const auto & mesh : model->m_meshes) {
+				writer.writeString(mesh.m_name);
+				writer.write(mesh.m_material_idx);
+				writer.write(mesh.m_start_index);
+				writer.write(mesh.m_number_of_vertices);
+			}
+			writer.write(uint32_t(model->m_positions.size()));
+			writer.align();
+			writer.writeArray(model->m_positions.data(), model->m_positions.size() * sizeof(glm::vec3));
+			writer.align();
+			writer.writeArray(model->m_normals.data(), model->m_normals.size() * sizeof(glm::vec3));
+			writer.align();
+			writer.writeArray(model->m_texture_coordinates.data(), model->m_texture_coordinates.size() * sizeof(glm::vec2));
+			writer.write(uint32_t(model->m_indices.size()));
+			writer.align();
+			writer.writeArray(model->m_indices.data(), model->m_indices.size() * sizeof(uint32_t));
+
+			writeCache(writer, cache_path);
+		}
+
+		// Vertices of the interleaved formats
+		struct InterleavedVertex {
+			glm::vec3 position;
+			glm::vec3 normal;
+			glm::vec2 texture_coordinate;
+		};
+		struct CompactVertex {
+			glm::vec3 position;
+			uint32_t normal;
+			uint32_t texture_coordinate;
+		};
+
+		uint32_t packNormal(const glm::vec3 & normal)
+		{
+			// Averaged normals may be shorter than one, and would lose precision when packed
+			float length = glm::length(normal);
+			return glm::packSnorm3x10_1x2(glm::vec4(length > 0.0f ? normal / length : normal, 0.0f));
+		}
+
+		void uploadBuffers(Model * model, const glm::vec3 * positions, const glm::vec3 * normals, const glm::vec2 * texture_coordinates,
+		                 const uint32_t * indices)
+		{
+			size_t number_of_vertices = model->m_positions.size();
+			glGenVertexArrays(1, &model->m_vaob);
+			glBindVertexArray(model->m_vaob);
+			if (model->m_vertex_format == VertexFormat::separate) {
+				glGenBuffers(1, &model->m_positions_bo);
+				glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+				glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec3), positions, GL_STATIC_DRAW);
+				glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+				glGenBuffers(1, &model->m_normals_bo);
+				glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
+				glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec3), normals, GL_STATIC_DRAW);
+				glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+				glGenBuffers(1, &model->m_texture_coordinates_bo);
+				glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+				glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec2), texture_coordinates, GL_STATIC_DRAW);
+				glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+			}
+			else if (model->m_vertex_format == VertexFormat::interleaved) {
+				std::vector<InterleavedVertex> vertices(number_of_vertices);
+				for (size_t i = 0; i < number_of_vertices; i++) {
+					vertices[i] = { positions[i], normals[i], texture_coordinates[i] };
+				}
+				glGenBuffers(1, &model->m_vertices_bo);
+				glBindBuffer(GL_ARRAY_BUFFER, model->m_vertices_bo);
+				glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(InterleavedVertex), vertices.data(), GL_STATIC_DRAW);
+				glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(InterleavedVertex), (const void *)offsetof(InterleavedVertex, position));
+				glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(InterleavedVertex), (const void *)offsetof(InterleavedVertex, normal));
+				glVertexAttribPointer(2, 2, GL_FLOAT, false, sizeof(InterleavedVertex),
+				                      (const void *)offsetof(InterleavedVertex, texture_coordinate));
+			}
+			else {
+				std::vector<CompactVertex> vertices(number_of_vertices);
+				for (size_t i = 0; i < number_of_vertices; i++) {
+					vertices[i] = { positions[i], packNormal(normals[i]), glm::packHalf2x16(texture_coordinates[i]) };
+				}
+				glGenBuffers(1, &model->m_vertices_bo);
+				glBindBuffer(GL_ARRAY_BUFFER, model->m_vertices_bo);
+				glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(CompactVertex), vertices.data(), GL_STATIC_DRAW);
+				glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(CompactVertex), (const void *)offsetof(CompactVertex, position));
+				// Read as a normalized vec4 whose w the shaders' vec3 inputs drop
+				glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, true, sizeof(CompactVertex), (const void *)offsetof(CompactVertex, normal));
+				glVertexAttribPointer(2, 2, GL_HALF_FLOAT, false, sizeof(CompactVertex),
+				                      (const void *)offsetof(CompactVertex, texture_coordinate));
+			}
+			glEnableVertexAttribArray(0);
+			glEnableVertexAttribArray(1);
+			glEnableVertexAttribArray(2);
+			glGenBuffers(1, &model->m_indices_bo);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->m_indices.size() * sizeof(uint32_t), indices, GL_STATIC_DRAW);
+		}
+
+		// Returns nullptr if there is no cache or it is out of date. The textures are only named.
+		Model * loadModelCache(const std::string & cache_path, const std::string & directory, bool upload,
+		                       VertexFormat vertex_format)
+		{
+			MappedFile cache;
+			if (!cache.open(cache_path)) return nullptr;
+			CacheReader reader(cache.data(), cache.size());
+
+			const char * magic = reader.readArray(sizeof(model_cache_magic));
+			if (magic == nullptr || memcmp(magic, model_cache_magic, sizeof(model_cache_magic)) != 0) return nullptr;
+			if (reader.read<uint32_t>() != model_cache_version) return nullptr;
+			uint32_t number_of_sources = reader.read<uint32_t>();
+			for (uint32_t i = 0; i < number_of_sources && reader.ok; i++) {
+				SourceStamp cached, current;
+				cached.filename = reader.readString();
+				cached.size = reader.read<uint64_t>();
+				cached.mtime = reader.read<int64_t>();
+				if (!stampFile(directory, cached.filename, current)) return nullptr;
+				if (current.size != cached.size || current.mtime != cached.mtime) return nullptr;
+			}
+
+			std::vector<Material> materials(reader.read<uint32_t>());
+			std::vector<std::string> texture_filenames;
+			for (auto & material : materials) {
+				material.m_name = reader.readString();
+				material.m_color = reader.read<glm::vec3>();
+				material.m_reflectivity = reader.read<float>();
+				material.m_shininess = reader.read<float>();
+				material.m_metalness = reader.read<float>();
+				material.m_fresnel = reader.read<float>();
+				material.m_emission = reader.read<float>();
+				material.m_transparency = reader.read<float>();
+				for (size_t t = 0; t < number_of_material_textures; t++) {
+					texture_filenames.push_back(reader.readString());
+				}
+			}
+			std::vector<Mesh> meshes(reader.read<uint32_t>());
+			for (auto & mesh : meshes) {
+				mesh.m_name = reader.readString();
+				mesh.m_material_idx = reader.read<uint32_t>();
+				mesh.m_start_index = reader.read<uint32_t>();
+				mesh.m_number_of_vertices = reader.read<uint32_t>();
+			}
+			uint32_t number_of_vertices = reader.read<uint32_t>();
+			reader.align();
+			const glm::vec3 * positions = (const glm::vec3 *)reader.readArray(number_of_vertices * sizeof(glm::vec3));
+			reader.align();
+			const glm::vec3 * normals = (const glm::vec3 *)reader.readArray(number_of_vertices * sizeof(glm::vec3));
+			reader.align();
+			const glm::vec2 * texture_coordinates = (const glm::vec2 *)reader.readArray(number_of_vertices * sizeof(glm::vec2));
+			uint32_t number_of_indices = reader.read<uint32_t>();
+			reader.align();
+			const uint32_t * indices = (const uint32_t *)reader.readArray(number_of_indices * sizeof(uint32_t));
+			if (!reader.ok) return nullptr;
+
+			Model * model = new Model;
+			model->m_meshes = meshes;
+			model->m_positions.assign(positions, positions + number_of_vertices);
+			model->m_normals.assign(normals, normals + number_of_vertices);
+			model->m_texture_coordinates.assign(texture_coordinates, texture_coordinates + number_of_vertices);
+			model->m_indices.assign(indices, indices + number_of_indices);
+			model->m_vertex_format = vertex_format;
+			if (upload) uploadBuffers(model, positions, normals, texture_coordinates, indices);
+
+			for (size_t m = 0; m < materials.size(); m++) {
+				for (size_t t = 0; t < number_of_material_textures; t++) {
+					nameTexture(materials[m].*material_textures[t], directory, texture_filenames[m * number_of_material_textures + t],
+					            material_texture_components[t]);
+				}
+			}
+			model->m_materials = materials;
+			return model;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Compressed textures
+	//
+	// Material textures are block compressed along with their whole mip
+	// chain the first time they are loaded, and cached next to the image as
+	// <image>.texturecache. The cache is used while the image keeps its size
+	// and modification time and the cached levels add up, and its levels are
+	// uploaded as they are, without glGenerateMipmap. Four component images
+	// become BC3, or BC1 if they are opaque, three component images BC1, two
+	// component images BC5 and one component images BC4.
+	///////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const char texture_cache_magic[8] = { 'L', 'H', 'T', 'E', 'X', 'T', 'R', '\0' };
+		const uint32_t texture_cache_version = 1;
+
+		size_t levelSize(uint32_t format, int width, int height)
+		{
+			size_t block_size = format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_RED_RGTC1 ? 8 : 16;
+			return size_t((width + 3) / 4) * size_t((height + 3) / 4) * block_size;
+		}
+
+		// Levels of a full mip chain down to 1x1
+		int mipLevels(int width, int height)
+		{
+			int levels = 1;
+			while (width > 1 || height > 1) {
+				width = std::max(1, width / 2);
+				height = std::max(1, height / 2);
+				levels++;
+			}
+			return levels;
+		}
+
+		size_t mipChainSize(uint32_t format, int width, int height, int levels)
+		{
+			size_t size = 0;
+			for (int level = 0; level < levels; level++) {
+				size += levelSize(format, std::max(1, width >> level), std::max(1, height >> level));
+			}
+			return size;
+		}
+
+		bool isS3tc(uint32_t format)
+		{
+			return format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		}
+
+		uint32_t compressedFormat(const uint8_t * pixels, int width, int height, int components)
+		{
+			if (components == 1) return GL_COMPRESSED_RED_RGTC1;
+			if (components == 2) return GL_COMPRESSED_RG_RGTC2;
+			if (components == 4) {
+				for (size_t i = 3; i < size_t(width) * height * 4; i += 4) {
+					if (pixels[i] != 255) return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+				}
+			}
+			return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		}
+
+		// Compress one level and append it, blocks over the edge repeat the last texels
+		void compressLevel(const uint8_t * pixels, int width, int height, int components, uint32_t format, std::vector<uint8_t> & out)
+		{
+			// stb_dxt builds its tables on first use, which must not race between loader threads
+			static std::once_flag tables_built;
+			std::call_once(tables_built, [] {
+				uint8_t block[8], texels[16 * 4] = {};
+				stb_compress_dxt_block(block, texels, 0, STB_DXT_NORMAL);
+			});
+
+			size_t offset = out.size();
+			out.resize(offset + levelSize(format, width, height));
+			for (int block_y = 0; block_y < height; block_y += 4) {
+				for (int block_x = 0; block_x < width; block_x += 4) {
+					uint8_t texels[16 * 4];
+					for (int y = 0; y < 4; y++) {
+						for (int x = 0; x < 4; x++) {
+							const uint8_t * texel = pixels + (size_t(std::min(block_y + y, height - 1)) * width + std::min(block_x + x, width - 1)) * components;
+							uint8_t * block_texel = texels + (y * 4 + x) * (format == GL_COMPRESSED_RED_RGTC1 || format == GL_COMPRESSED_RG_RGTC2 ? components : 4);
+							for (int c = 0; c < components; c++) block_texel[c] = texel[c];
+							if (components == 3) block_texel[3] = 255;
+						}
+					}
+					uint8_t * block = out.data() + offset;
+					if (format == GL_COMPRESSED_RED_RGTC1) stb_compress_bc4_block(block, texels);
+					else if (format == GL_COMPRESSED_RG_RGTC2) stb_compress_bc5_block(block, texels);
+					else stb_compress_dxt_block(block, texels, format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, STB_DXT_HIGHQUAL);
+					offset += levelSize(format, 4, 4);
+				}
+			}
+		}
+
+		// Half the size with a box filter, as glGenerateMipmap would. An odd last row or column is dropped.
+		std::vector<uint8_t> downsample(const std::vector<uint8_t> & pixels, int width, int height, int components)
+		{
+			int half_width = std::max(1, width / 2), half_height = std::max(1, height / 2);
+			std::vector<uint8_t> half(size_t(half_width) * half_height * components);
+			for (int y = 0; y < half_height; y++) {
+				int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+				for (int x = 0; x < half_width; x++) {
+					int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+					for (int c = 0; c < components; c++) {
+						int sum = pixels[(size_t(y0) * width + x0) * components + c] + pixels[(size_t(y0) * width + x1) * components + c]
+						        + pixels[(size_t(y1) * width + x0) * components + c] + pixels[(size_t(y1) * width + x1) * components + c];
+						half[(size_t(y) * half_width + x) * components + c] = uint8_t((sum + 2) / 4);
+					}
+				}
+			}
+			return half;
+		}
+
+		void compressTexture(Texture & texture, const uint8_t * pixels)
+		{
+			texture.compressed_format = compressedFormat(pixels, texture.width, texture.height, texture.components);
+			texture.levels = 0;
+			texture.data.clear();
+			std::vector<uint8_t> level(pixels, pixels + size_t(texture.width) * texture.height * texture.components);
+			int width = texture.width, height = texture.height;
+			while (true) {
+				compressLevel(level.data(), width, height, texture.components, texture.compressed_format, texture.data);
+				texture.levels++;
+				if (width == 1 && height == 1) break;
+				level = downsample(level, width, height, texture.components);
+				width = std::max(1, width / 2);
+				height = std::max(1, height / 2);
+			}
+		}
+
+		bool readTextureCache(const std::string & cache_path, const SourceStamp & stamp, Texture & texture)
+		{
+			MappedFile cache;
+			if (!cache.open(cache_path)) return false;
+			CacheReader reader(cache.data(), cache.size());
+			const char * magic = reader.readArray(sizeof(texture_cache_magic));
+			if (magic == nullptr || memcmp(magic, texture_cache_magic, sizeof(texture_cache_magic)) != 0) return false;
+			if (reader.read<uint32_t>() != texture_cache_version) return false;
+			if (reader.read<uint64_t>() != stamp.size || reader.read<int64_t>() != stamp.mtime) return false;
+			// The same image may be loaded with another number of components elsewhere
+			if (reader.read<int32_t>() != texture.components) return false;
+			uint32_t format = reader.read<uint32_t>();
+			int width = reader.read<int32_t>();
+			int height = reader.read<int32_t>();
+			int levels = reader.read<int32_t>();
+			uint64_t size = reader.read<uint64_t>();
+			if (!reader.ok) return false;
+			// A stale or corrupt cache would have upload read past the end of the data, it is rebuilt instead
+			bool format_ok = texture.components == 1 ? format == GL_COMPRESSED_RED_RGTC1
+			               : texture.components == 2 ? format == GL_COMPRESSED_RG_RGTC2
+			               : texture.components == 3 ? format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+			               : isS3tc(format);
+			if (!format_ok || width < 1 || height < 1 || width > 65536 || height > 65536) return false;
+			if (levels != mipLevels(width, height) || size != mipChainSize(format, width, height, levels)) return false;
+			const char * data = reader.readArray(size_t(size));
+			if (!reader.ok) return false;
+			texture.compressed_format = format;
+			texture.width = width;
+			texture.height = height;
+			texture.levels = levels;
+			texture.data.assign(data, data + size);
+			return true;
+		}
+
+		void writeTextureCache(const std::string & cache_path, const SourceStamp & stamp, const Texture & texture)
+		{
+			CacheWriter writer;
+			writer.writeArray(texture_cache_magic, sizeof(texture_cache_magic));
+			writer.write(texture_cache_version);
+			writer.write(stamp.size);
+			writer.write(stamp.mtime);
+			writer.write(int32_t(texture.components));
+			writer.write(texture.compressed_format);
+			writer.write(int32_t(texture.width));
+			writer.write(int32_t(texture.height));
+			writer.write(int32_t(texture.levels));
+			writer.write(uint64_t(texture.data.size()));
+			writer.writeArray(texture.data.data(), texture.data.size());
+			writeCache(writer, cache_path);
+		}
+
+		// BC1 and BC3 are an extension to the 4.1 core profile. Without it the image is
+		// read again and uploaded as it is, with mipmaps generated by the driver.
+		void uploadUncompressed(Texture & texture)
+		{
+			int width, height, file_components;
+			uint8_t * pixels = stbi_load((texture.directory + texture.filename).c_str(), &width, &height, &file_components, texture.components);
+			if (pixels == nullptr) {
+				std::cout << "ERROR: Texture::upload(): Failed to load texture: " << texture.filename << " in " << texture.directory << "\n";
+				return;
+			}
+			const GLenum formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+			const GLenum internal_formats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexImage2D(GL_TEXTURE_2D, 0, internal_formats[texture.components - 1], width, height, 0,
+			             formats[texture.components - 1], GL_UNSIGNED_BYTE, pixels);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			stbi_image_free(pixels);
+		}
+	}
+
+	bool Texture::decode(const std::string & _directory, const std::string & _filename, int _components)
 	{
 		filename = _filename;
 		directory = _directory;
-		valid = true; 
-		int components; 
-		data = stbi_load((directory + filename).c_str(), &width, &height, &components, _components);
-		if (data == nullptr) {
-			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in "<< _directory << "\n";
+		components = _components;
+		if (components < 1 || components > 4) {
+			std::cout << "Texture loading not implemented for this number of compenents.\n";
 			exit(1);
 		}
+		std::string cache_path = directory + filename + ".texturecache";
+		SourceStamp stamp;
+		bool stamped = stampFile(directory, filename, stamp);
+		if (stamped && readTextureCache(cache_path, stamp, *this)) return true;
+
+		int file_components; 
+		uint8_t * pixels = stbi_load((directory + filename).c_str(), &width, &height, &file_components, components);
+		if (pixels == nullptr) {
+			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in "<< _directory << "\n";
+			return false;
+		}
+		compressTexture(*this, pixels);
+		stbi_image_free(pixels);
+		if (stamped) writeTextureCache(cache_path, stamp, *this);
+		return true;
+	}
+
+	void Texture::upload(uint32_t pixel_buffer)
+	{
+		valid = true; 
 		glGenTextures(1, &gl_id);
 		glBindTexture(GL_TEXTURE_2D, gl_id);
-		GLenum format, internal_format;
-		if (_components == 1) { format = GL_R;  internal_format = GL_R8; }
-		else if (_components == 3) { format = GL_RGB; internal_format = GL_RGB; }
-		else if (_components == 4) { format = GL_RGBA;  internal_format = GL_RGBA; }
+		if (isS3tc(compressed_format) && !GLEW_EXT_texture_compression_s3tc) {
+			uploadUncompressed(*this);
+		}
 		else {
-			std::cout << "Texture loading not implemented for this number of compenents.\n";
-			exit(1);
+			if (pixel_buffer != 0) {
+				// Stage the levels in the buffer, the driver copies them from there without blocking on the draw calls in flight
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer);
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, data.size(), nullptr, GL_STREAM_DRAW);
+				void * staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, data.size(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+				memcpy(staging, data.data(), data.size());
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			size_t offset = 0;
+			for (int level = 0; level < levels; level++) {
+				int level_width = std::max(1, width >> level), level_height = std::max(1, height >> level);
+				size_t size = levelSize(compressed_format, level_width, level_height);
+				const void * level_data = pixel_buffer != 0 ? (const void *)offset : (const void *)(data.data() + offset);
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, compressed_format, level_width, level_height, 0, GLsizei(size), level_data);
+				offset += size;
+			}
+			if (pixel_buffer != 0) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 		}
-		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
-		return true; 
+		// The texture has its own copy now
+		std::vector<uint8_t>().swap(data);
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -58,49 +1131,71 @@ namespace labhelper
 		glDeleteBuffers(1, &m_positions_bo);
 		glDeleteBuffers(1, &m_normals_bo);
 		glDeleteBuffers(1, &m_texture_coordinates_bo);
+		glDeleteBuffers(1, &m_indices_bo);
+		glDeleteBuffers(1, &m_vertices_bo);
 	}
 
-	Model * loadModelFromOBJ(std::string path)
+	namespace
 	{
 		///////////////////////////////////////////////////////////////////////
 		// Separate filename into directory, base filename and extension
 		// NOTE: This can be made a LOT simpler as soon as compilers properly 
 		//		 support std::filesystem (C++17)
 		///////////////////////////////////////////////////////////////////////
-		size_t separator = path.find_last_of("\\/");
-		std::string filename, extension, directory; 
-		if (separator != std::string::npos) {
-			filename = path.substr(separator + 1, path.size() - separator - 1); 
-			directory = path.substr(0, separator + 1); 
-		}
-		else {
-			filename = path; 
-			directory = "./";
+		bool splitPath(const std::string & path, std::string & directory, std::string & filename, std::string & extension)
+		{
+			size_t separator = path.find_last_of("\\/");
+			if (separator != std::string::npos) {
+				filename = path.substr(separator + 1, path.size() - separator - 1); 
+				directory = path.substr(0, separator + 1); 
+			}
+			else {
+				filename = path; 
+				directory = "./";
+			}
+			separator = filename.find_last_of(".");
+			if (separator == std::string::npos) {
+				std::cout << "loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
+				return false;
+			}
+			extension = filename.substr(separator, filename.size() - separator);
+			filename = filename.substr(0, separator); 
+			return true;
 		}
-		separator = filename.find_last_of(".");
-		if (separator == std::string::npos) {
-			std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
-			exit(1);
+
+		// Named textures of all materials
+		void forEachTexture(Model * model, const std::function<void(Texture &)> & function)
+		{
+			for (auto & material : model->m_materials) {
+				for (size_t t = 0; t < number_of_material_textures; t++) {
+					Texture & texture = material.*material_textures[t];
+					if (texture.filename != "") function(texture);
+				}
+			}
 		}
-		extension = filename.substr(separator, filename.size() - separator);
-		filename = filename.substr(0, separator); 
-	
+	}
+
+	// Everything loadModelFromOBJ does on the CPU, the textures are only named. Returns
+	// nullptr if the OBJ file can not be parsed.
+	static Model * parseModel(const std::string & path, const std::string & directory, const std::string & filename,
+	                          const std::string & extension)
+	{
 		///////////////////////////////////////////////////////////////////////
-		// Parse the OBJ file using tinyobj
+		// Parse the OBJ file, in parallel (see Parallel OBJ parsing above)
 		///////////////////////////////////////////////////////////////////////
-		std::cout << "Loading " << path << "..." << std::flush; 
+		std::string cache_path = directory + filename + ".modelcache";
+		std::vector<SourceStamp> sources = stampSources(directory, filename + extension);
 		tinyobj::attrib_t attrib;
 		std::vector<tinyobj::shape_t> shapes;
 		std::vector<tinyobj::material_t> materials;
 		std::string err;
 		// Expect '.mtl' file in the same directory and triangulate meshes 
-		bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, 
-			(directory + filename + extension).c_str(), directory.c_str(), 
-			true);
+		bool ret = loadObjParallel(&attrib, &shapes, &materials, &err, 
+			directory + filename + extension, directory);
 		if (!err.empty()) { // `err` may contain warning message.
 			std::cerr << err << std::endl;
 		}
-		if (!ret) { exit(1); }
+		if (!ret) { return nullptr; }
 		Model * model = new Model;
 		model->m_name = filename;
 		model->m_filename = path; 
@@ -112,45 +1207,31 @@ namespace labhelper
 			Material material; 
 			material.m_name = m.name;
 			material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
-			if (m.diffuse_texname != "") { 
-				material.m_color_texture.load(directory, m.diffuse_texname, 4);
-			}
+			nameTexture(material.m_color_texture, directory, m.diffuse_texname, 4);
 			material.m_reflectivity = m.specular[0];
-			if (m.specular_texname != "") {
-				material.m_reflectivity_texture.load(directory, m.specular_texname, 1);
-			}
+			nameTexture(material.m_reflectivity_texture, directory, m.specular_texname, 1);
 			material.m_metalness = m.metallic;
-			if (m.metallic_texname != "") {
-				material.m_metalness_texture.load(directory, m.metallic_texname, 1);
-			}
+			nameTexture(material.m_metalness_texture, directory, m.metallic_texname, 1);
 			material.m_fresnel = m.sheen; 
-			if (m.sheen_texname != "") {
-				material.m_fresnel_texture.load(directory, m.sheen_texname, 1);
-			}
+			nameTexture(material.m_fresnel_texture, directory, m.sheen_texname, 1);
 			material.m_shininess = m.roughness;
-			if (m.roughness_texname != "") {
-				material.m_shininess_texture.load(directory, m.roughness_texname, 1);
-			}
+			nameTexture(material.m_shininess_texture, directory, m.roughness_texname, 1);
 			material.m_emission = m.emission[0];
-			if (m.emissive_texname != "") {
-				material.m_emission_texture.load(directory, m.emissive_texname, 4);
-			}
+			nameTexture(material.m_emission_texture, directory, m.emissive_texname, 4);
 			material.m_transparency = m.transmittance[0]; 
 			model->m_materials.push_back(material);
 		}
 
 		///////////////////////////////////////////////////////////////////////
 		// A vertex in the OBJ file may have different indices for position, 
-		// normal and texture coordinate. We will not even attempt to use 
-		// indexed lookups, but will store a simple vertex stream per mesh. 
+		// normal and texture coordinate. Each mesh is first gathered as a
+		// stream of face corners, which are then indexed (see Indexing above).
 		///////////////////////////////////////////////////////////////////////
-		int number_of_vertices = 0; 
+		size_t number_of_corners = 0; 
 		for (const auto & shape : shapes) {
-			number_of_vertices += shape.mesh.indices.size(); 
+			number_of_corners += shape.mesh.indices.size(); 
 		}
-		model->m_positions.resize(number_of_vertices);
-		model->m_normals.resize(number_of_vertices);
-		model->m_texture_coordinates.resize(number_of_vertices);
+		model->m_indices.reserve(number_of_corners);
 
 		///////////////////////////////////////////////////////////////////////
 		// For each vertex _position_ auto generate a normal that will be used
@@ -193,7 +1274,7 @@ namespace labhelper
 		// Now we will turn all shapes into Meshes. A shape that has several 
 		// materials will be split into several meshes with unique names
 		///////////////////////////////////////////////////////////////////////
-		int vertices_so_far = 0; 
+		std::vector<Vertex> corners;
 		for (const auto & shape : shapes)
 		{
 			///////////////////////////////////////////////////////////////////
@@ -214,7 +1295,8 @@ namespace labhelper
 				Mesh mesh;
 				mesh.m_name = shape.name + "_" + materials[current_material_index].name; 
 				mesh.m_material_idx = current_material_index;
-				mesh.m_start_index = vertices_so_far;
+				mesh.m_start_index = uint32_t(model->m_indices.size());
+				corners.clear();
 				number_of_materials_in_shape += 1; 
 
 				int number_of_faces = shape.mesh.indices.size() / 3;
@@ -233,38 +1315,40 @@ namespace labhelper
 						// Now we generate the vertices
 						///////////////////////////////////////////////////////
 						for (int j = 0; j < 3; j++) {
-							int v = shape.mesh.indices[i * 3 + j].vertex_index;
-							model->m_positions[vertices_so_far + j] = glm::vec3(
-								attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 0],
-								attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 1],
-								attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 2]);
-							if (shape.mesh.indices[i * 3 + j].normal_index == -1) {
+							const tinyobj::index_t & index = shape.mesh.indices[i * 3 + j];
+							Vertex corner;
+							corner.position = glm::vec3(
+								attrib.vertices[index.vertex_index * 3 + 0],
+								attrib.vertices[index.vertex_index * 3 + 1],
+								attrib.vertices[index.vertex_index * 3 + 2]);
+							if (index.normal_index == -1) {
 								// No normal, use the autogenerated
-								model->m_normals[vertices_so_far + j] = glm::vec3(auto_normals[shape.mesh.indices[i * 3 + j].vertex_index]);
+								corner.normal = glm::vec3(auto_normals[index.vertex_index]);
 							}
 							else {
-								model->m_normals[vertices_so_far + j] = glm::vec3(
-									attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 0],
-									attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 1],
-									attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 2]);
+								corner.normal = glm::vec3(
+									attrib.normals[index.normal_index * 3 + 0],
+									attrib.normals[index.normal_index * 3 + 1],
+									attrib.normals[index.normal_index * 3 + 2]);
 							}
-							if (shape.mesh.indices[i * 3 + j].texcoord_index == -1) {
+							if (index.texcoord_index == -1) {
 								// No UV coordinates. Use null. 
-								model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(0.0f);
+								corner.texture_coordinate = glm::vec2(0.0f);
 							}
 							else {
-								model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(
-									attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 0],
-									attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 1]);
+								corner.texture_coordinate = glm::vec2(
+									attrib.texcoords[index.texcoord_index * 2 + 0],
+									attrib.texcoords[index.texcoord_index * 2 + 1]);
 							}
+							corners.push_back(corner);
 						}
-						vertices_so_far += 3;
 					}
 				}
 				///////////////////////////////////////////////////////////////
 				// Finalize and push this mesh to the list
 				///////////////////////////////////////////////////////////////
-				mesh.m_number_of_vertices =	vertices_so_far - mesh.m_start_index;
+				appendIndexedMesh(model, corners);
+				mesh.m_number_of_vertices = uint32_t(corners.size());
 				model->m_meshes.push_back(mesh);
 				finished_materials[current_material_index] = true; 
 			}
@@ -274,33 +1358,66 @@ namespace labhelper
 		}
 
 		///////////////////////////////////////////////////////////////////////
-		// Upload to GPU
+		// Cache the parsed model
 		///////////////////////////////////////////////////////////////////////
-		glGenVertexArrays(1, &model->m_vaob);
-		glBindVertexArray(model->m_vaob);
-		glGenBuffers(1, &model->m_positions_bo);
-		glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
-		glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3),
-			&model->m_positions[0].x, GL_STATIC_DRAW);
-		glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
-		glEnableVertexAttribArray(0);
-		glGenBuffers(1, &model->m_normals_bo);
-		glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
-		glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3),
-			&model->m_normals[0].x, GL_STATIC_DRAW);
-		glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
-		glEnableVertexAttribArray(1);
-		glGenBuffers(1, &model->m_texture_coordinates_bo);
-		glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
-		glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
-			&model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
-		glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
-		glEnableVertexAttribArray(2);
-
-		std::cout << "done.\n";
+		if (!sources.empty()) writeModelCache(model, sources, cache_path);
+		return model; 
+	}
+
+	size_t bytesPerVertex(VertexFormat format)
+	{
+		return format == VertexFormat::compact ? sizeof(CompactVertex) : sizeof(InterleavedVertex);
+	}
+
+	Model * loadModelFromOBJ(std::string path, VertexFormat vertex_format)
+	{
+		std::string directory, filename, extension;
+		if (!splitPath(path, directory, filename, extension)) { exit(1); }
+		std::cout << "Loading " << path << "..." << std::flush; 
+		Model * model = loadModelCache(directory + filename + ".modelcache", directory, true, vertex_format);
+		bool cached = model != nullptr;
+		if (cached) {
+			model->m_name = filename;
+			model->m_filename = path;
+		}
+		else {
+			model = parseModel(path, directory, filename, extension);
+			if (model == nullptr) { exit(1); }
+			model->m_vertex_format = vertex_format;
+			uploadModelBuffers(model);
+		}
+		forEachTexture(model, [](Texture & texture) {
+			texture.load(texture.directory, texture.filename, texture.components);
+		});
+		std::cout << (cached ? "done (cached).\n" : "done.\n");
 		return model; 
 	}
 
+	Model * readModelFromOBJ(std::string path)
+	{
+		std::string directory, filename, extension;
+		if (!splitPath(path, directory, filename, extension)) { return nullptr; }
+		Model * model = loadModelCache(directory + filename + ".modelcache", directory, false, VertexFormat::separate);
+		if (model != nullptr) {
+			model->m_name = filename;
+			model->m_filename = path;
+		}
+		else {
+			model = parseModel(path, directory, filename, extension);
+			if (model == nullptr) { return nullptr; }
+		}
+		// A texture that fails to decode is left out, as loadModelFromOBJ would exit
+		forEachTexture(model, [](Texture & texture) {
+			texture.decode(texture.directory, texture.filename, texture.components);
+		});
+		return model; 
+	}
+
+	void uploadModelBuffers(Model * model)
+	{
+		uploadBuffers(model, model->m_positions.data(), model->m_normals.data(), model->m_texture_coordinates.data(), model->m_indices.data());
+	}
+
 	void saveModelToOBJ(Model * model, std::string path)
 	{
 		///////////////////////////////////////////////////////////////////////
@@ -370,37 +1487,29 @@ namespace labhelper
 		}
 		obj_file << "# Exported by Chalmers Graphics Group\n";
 		obj_file << "mtllib " << filename << ".mtl\n";
-		int vertex_counter = 1; 
+		for (const auto & position : model->m_positions) {
+			obj_file << "v " << position.x << " " << position.y << " " << position.z << "\n";
+		}
+		for (const auto & normal : model->m_normals) {
+			obj_file << "vn " << normal.x << " " << normal.y << " " << normal.z << "\n";
+		}
+		for (const auto & texture_coordinate : model->m_texture_coordinates) {
+			obj_file << "vt " << texture_coordinate.x << " " << texture_coordinate.y << "\n";
+		}
 		for (auto mesh : model->m_meshes)
 		{
 			obj_file << "o " << mesh.m_name << "\n";
 			obj_file << "g " << mesh.m_name << "\n";
 			obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
-			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i += 3)
 			{
-				obj_file << "v " << model->m_positions[i].x << " "
-					<< model->m_positions[i].y << " "
-					<< model->m_positions[i].z << "\n";
-			}
-			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
-			{
-				obj_file << "vn " << model->m_normals[i].x << " "
-					<< model->m_normals[i].y << " "
-					<< model->m_normals[i].z << "\n";
-			}
-			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
-			{
-				obj_file << "vt " << model->m_texture_coordinates[i].x << " "
-					<< model->m_texture_coordinates[i].y << "\n";
-			}
-			int number_of_faces = mesh.m_number_of_vertices / 3; 
-			for (int i = 0; i < number_of_faces; i++)
-			{
-				obj_file << "f " 
-					<< vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-					<< vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-					<< vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-				vertex_counter += 3; 
+				// OBJ indices start at 1
+				obj_file << "f";
+				for (uint32_t j = 0; j < 3; j++) {
+					uint32_t index = model->m_indices[i + j] + 1;
+					obj_file << " " << index << "/" << index << "/" << index;
+				}
+				obj_file << "\n";
 			}
 		}
 	}
@@ -417,6 +1526,7 @@ namespace labhelper
 	///////////////////////////////////////////////////////////////////////
 	void render(const Model * model, const bool submitMaterials)
 	{
+		if (model == nullptr || model->m_vaob == 0) return;
 		glBindVertexArray(model->m_vaob);
 		for (auto & mesh : model->m_meshes)
 		{
@@ -454,7 +1564,8 @@ namespace labhelper
 				glUniform1fv(glGetUniformLocation(current_program, "material_shininess"), 1, &material.m_shininess);
 				glUniform1fv(glGetUniformLocation(current_program, "material_emission"), 1, &material.m_emission);
 			}
-			glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+			glDrawElements(GL_TRIANGLES, (GLsizei)mesh.m_number_of_vertices, GL_UNSIGNED_INT,
+				(const void *)(mesh.m_start_index * sizeof(uint32_t)));
 		}
 	}
 }
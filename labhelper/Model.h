@@ -11,8 +11,17 @@ namespace labhelper
 		std::string filename;
 		std::string directory;
 		int width, height;
-		uint8_t * data = nullptr;
+		int components = 0;
+		// Block compressed mip chain from decode, level after level, released once uploaded
+		uint32_t compressed_format = 0;
+		int levels = 0;
+		std::vector<uint8_t> data;
 		bool load(const std::string & directory, const std::string & filename, int nof_components);
+		// The two halves of load. decode reads the compressed image cached next to the image,
+		// compressing and caching it first if needed, and makes no GL calls. upload creates
+		// the texture, from data or through pixel_buffer if it is not 0.
+		bool decode(const std::string & directory, const std::string & filename, int nof_components);
+		void upload(uint32_t pixel_buffer = 0);
 	};
 	//////////////////////////////////////////////////////////////////////////////
 	// This material class implements a subset of the suggested PBR extension
@@ -40,12 +49,21 @@ namespace labhelper
 		Texture	m_emission_texture;
 	};
 
+	// How the vertices of a Model are laid out on the GPU. separate has a float buffer per
+	// attribute. interleaved has all attributes in one buffer, and compact interleaves them
+	// with normals packed as 10:10:10:2 and texture coordinates as half floats, in 20 instead
+	// of 32 bytes per vertex. Half floats lose precision on texture coordinates far from
+	// [-2, 2], so heavily tiled models are better off interleaved.
+	enum class VertexFormat { separate, interleaved, compact };
+	size_t bytesPerVertex(VertexFormat format);
+
 	struct Mesh
 	{
 		std::string m_name;
 		uint32_t m_material_idx; 
-		// Where this Mesh's vertices start
+		// Where this Mesh's indices start in the model's index buffer
 		uint32_t m_start_index; 
+		// Number of indices, three per triangle
 		uint32_t m_number_of_vertices;
 	};
 
@@ -65,16 +83,31 @@ namespace labhelper
 		std::vector<glm::vec3> m_positions;
 		std::vector<glm::vec3> m_normals;
 		std::vector<glm::vec2> m_texture_coordinates; 
-		// Buffers on GPU
-		uint32_t m_positions_bo;
-		uint32_t m_normals_bo;
-		uint32_t m_texture_coordinates_bo;
-		// Vertex Array Object
-		uint32_t m_vaob;
+		// Three indices into the vertex buffers per triangle, each Mesh a range of them
+		std::vector<uint32_t> m_indices;
+		// Buffers on GPU, set m_vertex_format before they are uploaded
+		VertexFormat m_vertex_format = VertexFormat::separate;
+		uint32_t m_positions_bo = 0;
+		uint32_t m_normals_bo = 0;
+		uint32_t m_texture_coordinates_bo = 0;
+		uint32_t m_indices_bo = 0;
+		// All attributes, in the interleaved formats
+		uint32_t m_vertices_bo = 0;
+		// Vertex Array Object, 0 until the buffers are uploaded
+		uint32_t m_vaob = 0;
 	};
 
-	Model * loadModelFromOBJ(std::string filename);
+	// Parsed models are cached next to the OBJ file as <name>.modelcache, which is
+	// loaded instead for as long as the OBJ and its materials are unchanged
+	Model * loadModelFromOBJ(std::string filename, VertexFormat vertex_format = VertexFormat::separate);
+	// loadModelFromOBJ in steps, for loading on other threads. readModelFromOBJ makes no GL
+	// calls and decodes the textures, uploadModelBuffers creates the buffers of the result
+	// and each texture is then uploaded on its own. Where loadModelFromOBJ exits on a file
+	// that can not be parsed, readModelFromOBJ returns nullptr.
+	Model * readModelFromOBJ(std::string filename);
+	void uploadModelBuffers(Model * model);
 	void saveModelToOBJ(Model * model, std::string filename);
 	void freeModel(Model * model);
+	// Models that are null or not uploaded yet are skipped
 	void render(const Model * model, const bool submitMaterials = true); 
 }
\ No newline at end of file
@@ -11,6 +11,11 @@
 
 #include <GL/glew.h>
 
+#ifdef LABHELPER_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 // STB_IMAGE for loading images of many filetypes
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -113,6 +118,78 @@ namespace labhelper {
 		return window;
 	}
 
+#ifdef LABHELPER_EGL
+	static EGLDisplay offscreenDisplay = EGL_NO_DISPLAY;
+#endif
+
+	bool init_offscreen_EGL(int width, int height)
+	{
+#ifdef LABHELPER_EGL
+		// Prefer the surfaceless platform, which works without any display server
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+		auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay != nullptr)
+		{
+			offscreenDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+		}
+#endif
+		if (offscreenDisplay == EGL_NO_DISPLAY || !eglInitialize(offscreenDisplay, nullptr, nullptr))
+		{
+			offscreenDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+			if (offscreenDisplay == EGL_NO_DISPLAY || !eglInitialize(offscreenDisplay, nullptr, nullptr))
+			{
+				fprintf(stderr, "Couldn't initialize EGL: 0x%x\n", eglGetError());
+				return false;
+			}
+		}
+		eglBindAPI(EGL_OPENGL_API);
+
+		// A pbuffer stands in for the window, so the default framebuffer exists
+		EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		                              EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24,
+		                              EGL_NONE };
+		EGLConfig config;
+		EGLint numConfigs = 0;
+		if (!eglChooseConfig(offscreenDisplay, configAttributes, &config, 1, &numConfigs) || numConfigs == 0)
+		{
+			fprintf(stderr, "No EGL config for offscreen OpenGL rendering\n");
+			return false;
+		}
+		EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+		EGLSurface surface = eglCreatePbufferSurface(offscreenDisplay, config, surfaceAttributes);
+
+		// Same version as the window's context
+		EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 1,
+		                               EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		                               EGL_NONE };
+		EGLContext context = eglCreateContext(offscreenDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+		if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT
+		    || !eglMakeCurrent(offscreenDisplay, surface, surface, context))
+		{
+			fprintf(stderr, "Failed to create an offscreen OpenGL context: 0x%x\n", eglGetError());
+			return false;
+		}
+
+		glewInit();
+
+		labhelper::startupGLDiagnostics();
+		labhelper::setupGLDebugMessages();
+		stbi_set_flip_vertically_on_load(true);
+		return true;
+#else
+		fprintf(stderr, "Built without EGL, offscreen rendering is not available\n");
+		return false;
+#endif
+	}
+
+	void shutDownOffscreen()
+	{
+#ifdef LABHELPER_EGL
+		eglTerminate(offscreenDisplay);
+		offscreenDisplay = EGL_NO_DISPLAY;
+#endif
+	}
+
 	void shutDown(SDL_Window *window) {
 		// If newframe is not ever run before shut down we crash
 		ImGui_ImplSdlGL3_NewFrame(window);
@@ -561,6 +638,42 @@ namespace labhelper {
 		return shaderProgram;
 	}
 
+	GLuint loadComputeShaderProgram(const std::string& computeShader, bool allow_errors)
+	{
+		GLuint cShader = glCreateShader(GL_COMPUTE_SHADER);
+
+		std::ifstream cs_file(computeShader);
+		std::string cs_src((std::istreambuf_iterator<char>(cs_file)), std::istreambuf_iterator<char>());
+
+		const char* cs = cs_src.c_str();
+		glShaderSource(cShader, 1, &cs, nullptr);
+		// text data is not needed beyond this point
+
+		glCompileShader(cShader);
+		int compileOk = 0;
+		glGetShaderiv(cShader, GL_COMPILE_STATUS, &compileOk);
+		if (!compileOk)
+		{
+			std::string err = GetShaderInfoLog(cShader);
+			if (allow_errors) {
+				non_fatal_error(err, "Compute Shader");
+			}
+			else {
+				fatal_error(err, "Compute Shader");
+			}
+			return 0;
+		}
+
+		GLuint shaderProgram = glCreateProgram();
+		glAttachShader(shaderProgram, cShader);
+		glDeleteShader(cShader);
+		if (!allow_errors) CHECK_GL_ERROR();
+
+		if (!linkShaderProgram(shaderProgram, allow_errors)) return 0;
+
+		return shaderProgram;
+	}
+
 
 	bool linkShaderProgram(GLuint shaderProgram, bool allow_errors)
 	{
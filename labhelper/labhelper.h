@@ -84,6 +84,18 @@ namespace labhelper {
 	*/
 	void shutDown(SDL_Window *window);
 
+	/**
+	* Initialize an OpenGL context without a window, rendering to a width x height
+	* offscreen default framebuffer. Works without a display server, for benchmarks
+	* on machines with software OpenGL. Needs a build with EGL.
+	*/
+	bool init_offscreen_EGL(int width = 1280, int height = 720);
+
+	/**
+	* Destroys the offscreen context.
+	*/
+	void shutDownOffscreen();
+
 	/**
 	 * Helper function: creates a cube map using the files specified for each face.
 	 */
@@ -102,6 +114,10 @@ namespace labhelper {
 	 */
 	GLuint loadShaderProgram(const std::string &vertexShader, const std::string &fragmentShader, bool allow_errors = false);
 	GLuint loadMultiShaderProgram(const std::string& vertexShader, std::vector<std::string> fragmentShaders, bool allow_errors);
+	/**
+	 * Loads, compiles and links a compute shader program. Needs OpenGL 4.3 or ARB_compute_shader.
+	 */
+	GLuint loadComputeShaderProgram(const std::string& computeShader, bool allow_errors = false);
 	/**
 	 * Call to link a shader program prevoiusly loaded using loadShaderProgram.
 	 */
@@ -10,6 +10,7 @@ FboInfo::FboInfo(int numberOfColorBuffers, GLint colorBufferFormat)
 {
 	colorTextureTargets.resize(numberOfColorBuffers, UINT32_MAX);
 	colorTextureTargetFormats = std::vector<GLint>(numberOfColorBuffers, colorBufferFormat);
+	colorTextureEnabled.resize(numberOfColorBuffers, true);
 };
 
 FboInfo::FboInfo(int numberOfColorBuffers, GLint colorBufferFormats[])
@@ -17,6 +18,7 @@ FboInfo::FboInfo(int numberOfColorBuffers, GLint colorBufferFormats[])
 {
 	colorTextureTargets.resize(numberOfColorBuffers, UINT32_MAX);
 	colorTextureTargetFormats = std::vector<GLint>(colorBufferFormats, colorBufferFormats + numberOfColorBuffers);
+	colorTextureEnabled.resize(numberOfColorBuffers, true);
 }
 
 void FboInfo::resize(int w, int h)
@@ -53,15 +55,7 @@ void FboInfo::resize(int w, int h)
 	///////////////////////////////////////////////////////////////////////
 	for (auto i : indices(colorTextureTargets))
 	{
-		glBindTexture(GL_TEXTURE_2D, colorTextureTargets[i]);
-		if (colorTextureTargetFormats[i] == GL_R32UI)
-		{
-			glTexImage2D(GL_TEXTURE_2D, 0, colorTextureTargetFormats[i], width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
-		}
-		else
-		{
-			glTexImage2D(GL_TEXTURE_2D, 0, colorTextureTargetFormats[i], width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-		}
+		if (colorTextureEnabled[i]) allocateColorTexture(i, width, height);
 	}
 
 	glBindTexture(GL_TEXTURE_2D, depthBuffer);
@@ -83,7 +77,7 @@ void FboInfo::resize(int w, int h)
 		for(size_t i = 0; i < colorTextureTargets.size(); i++)
 		{
 			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D,
-			                       colorTextureTargets[i], 0);
+			                       colorTextureEnabled[i] ? colorTextureTargets[i] : 0, 0);
 		}
 		GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2,
 			                     GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5,
@@ -101,6 +95,33 @@ void FboInfo::resize(int w, int h)
 	}
 }
 
+void FboInfo::setColorTextureEnabled(size_t index, bool enabled)
+{
+	if (colorTextureEnabled[index] == enabled) return;
+	colorTextureEnabled[index] = enabled;
+	if (!isComplete) return;
+
+	// A zero sized image releases the storage but keeps the texture name
+	allocateColorTexture(index, enabled ? width : 0, enabled ? height : 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebufferId);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + index, GL_TEXTURE_2D,
+	                       enabled ? colorTextureTargets[index] : 0, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void FboInfo::allocateColorTexture(size_t index, int w, int h)
+{
+	glBindTexture(GL_TEXTURE_2D, colorTextureTargets[index]);
+	if (colorTextureTargetFormats[index] == GL_R32UI)
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, colorTextureTargetFormats[index], w, h, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	}
+	else
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, colorTextureTargetFormats[index], w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	}
+}
+
 bool FboInfo::checkFramebufferComplete(void)
 {
 	// Check that our FBO is correctly set up, this can fail if we have
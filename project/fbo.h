@@ -7,6 +7,8 @@ public:
 	GLuint framebufferId;
 	std::vector<GLuint> colorTextureTargets;
 	std::vector<GLint> colorTextureTargetFormats;
+	// Disabled color textures have no storage and are detached
+	std::vector<bool> colorTextureEnabled;
 	GLuint depthBuffer;
 	int width;
 	int height;
@@ -16,5 +18,10 @@ public:
 	FboInfo(int numberOfColorBuffers, GLint colorBufferFormats[]);
 
 	void resize(int w, int h);
+	// Free and detach a color texture that is not drawn to, or allocate and attach it again
+	void setColorTextureEnabled(size_t index, bool enabled);
 	bool checkFramebufferComplete(void);
+
+private:
+	void allocateColorTexture(size_t index, int w, int h);
 };
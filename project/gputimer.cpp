@@ -0,0 +1,67 @@
+#include "gputimer.h"
+
+void GpuTimer::begin(uint64_t frame)
+{
+	if (queries[0] == 0) glGenQueries(2 * numQueries, queries);
+
+	collect(false);
+	// Every query is in flight, wait for the oldest rather than drop a measurement
+	if (pending == numQueries) collect(true);
+
+	frames[(oldest + pending) % numQueries] = frame;
+	glQueryCounter(queries[2 * ((oldest + pending) % numQueries)], GL_TIMESTAMP);
+}
+
+void GpuTimer::end()
+{
+	glQueryCounter(queries[2 * ((oldest + pending) % numQueries) + 1], GL_TIMESTAMP);
+	++pending;
+}
+
+void GpuTimer::finish()
+{
+	while (pending > 0)
+	{
+		collect(true);
+	}
+}
+
+void GpuTimer::takeFinished(std::vector<Measurement>& measurements)
+{
+	collect(false);
+	measurements.insert(measurements.end(), finished.begin(), finished.end());
+	finished.clear();
+}
+
+void GpuTimer::destroy()
+{
+	if (queries[0] != 0) glDeleteQueries(2 * numQueries, queries);
+	for (GLuint& query : queries)
+	{
+		query = 0;
+	}
+	pending = 0;
+	finished.clear();
+}
+
+void GpuTimer::collect(bool wait)
+{
+	while (pending > 0)
+	{
+		// The end timestamp is written last
+		GLuint available = GL_FALSE;
+		if (!wait) glGetQueryObjectuiv(queries[2 * oldest + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!wait && !available) return;
+
+		GLuint64 start = 0, end = 0;
+		glGetQueryObjectui64v(queries[2 * oldest], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(queries[2 * oldest + 1], GL_QUERY_RESULT, &end);
+		lastMilliseconds = (end - start) * 1e-6f;
+		if (finished.size() == size_t(numQueries)) finished.erase(finished.begin());
+		Measurement measurement = { frames[oldest], lastMilliseconds };
+		finished.push_back(measurement);
+		oldest = (oldest + 1) % numQueries;
+		--pending;
+		wait = false;
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Measures the GPU time of the commands between begin and end with timestamp queries.
+// Results are read once available, a few frames late, so measuring never stalls.
+// Timers may run inside each other.
+class GpuTimer
+{
+public:
+	struct Measurement
+	{
+		uint64_t frame;
+		float milliseconds;
+	};
+
+	// The measurement is tagged with frame, so that its result can be matched to it once read
+	void begin(uint64_t frame = 0);
+	void end();
+	// Wait for every measurement in flight
+	void finish();
+	void destroy();
+
+	// Latest finished measurement, 0 before the first one
+	float milliseconds() const { return lastMilliseconds; }
+	// Append the measurements finished since the last call, oldest first, collecting any
+	// that are available. Only the latest few are kept between calls.
+	void takeFinished(std::vector<Measurement>& measurements);
+
+private:
+	static const int numQueries = 4;
+	// Start and end timestamp of each measurement
+	GLuint queries[2 * numQueries] = {};
+	uint64_t frames[numQueries] = {};
+	int oldest = 0;
+	int pending = 0;
+	float lastMilliseconds = 0;
+	std::vector<Measurement> finished;
+
+	void collect(bool wait);
+};
@@ -8,6 +8,7 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 #include <cstdlib>
 #include <algorithm>
 #include <chrono>
+#include <thread>
 #include <unordered_map>
 
 #include <labhelper.h>
@@ -19,11 +20,18 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 using namespace glm;
 
 #include <Model.h>
+#include <AssetLoader.h>
 #include "hdr.h"
 #include "fbo.h"
+#include "gputimer.h"
+#include "profiler.h"
 
 #include <castle.h>
+#include <streaming.h>
+#include <regeneration.h>
+#include <rng.h>
 #include <picking.h>
+#include <bvh.h>
 
 using std::min;
 using std::max;
@@ -37,12 +45,15 @@ float previousTime = 0.0f;
 float deltaTime = 0.0f;
 bool showUI = false;
 int windowWidth, windowHeight;
+// CPU and GPU time of the passes of each frame, written to profile.csv on exit
+Profiler profiler;
 
 // Mouse input
 ivec2 g_prevMouseCoords = { -1, -1 };
 bool g_isMouseDragging = false;
 bool g_isMouseDraggingLeft = false;
 bool g_isMouseDraggingRight = false;
+bool g_isMarqueeSelecting = false;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Shader programs
@@ -50,9 +61,12 @@ bool g_isMouseDraggingRight = false;
 GLuint shaderProgram;       // Shader for rendering the final image
 GLuint simpleShaderProgram; // Shader used to draw the shadow map
 GLuint backgroundProgram;
-GLuint ssaoInputProgram; // Shader that calculates normals as color
 GLuint ssaoOutputProgram; // Shader that calculates the screen space ambient occlusion
 GLuint ssaoBlurProgram; // Shader that blurs the screen space ambient occlusion
+GLuint ssaoUpsampleProgram; // Shader that brings reduced resolution ambient occlusion back to full resolution
+GLuint ssaoCompositeProgram; // Shader that applies the ambient occlusion to the final image
+GLuint ssaoTemporalProgram; // Shader that accumulates ambient occlusion over frames
+GLuint ssaoComputeProgram = 0; // Compute shader that calculates the ambient occlusion from depth tiles in shared memory
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
@@ -87,6 +101,10 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 labhelper::Model* fighterModel = nullptr;
 labhelper::Model* landingpadModel = nullptr;
 labhelper::Model* sphereModel = nullptr;
+// Loads the scene models in the background, a sphere stands in for each until it is uploaded
+labhelper::AssetLoader* assetLoader = nullptr;
+int modelUploadBudgetKB = 4096;
+const float placeholderRadius = 5.0f;
 
 mat4 roomModelMatrix;
 mat4 landingPadModelMatrix;
@@ -95,26 +113,57 @@ mat4 fighterModelMatrix;
 ///////////////////////////////////////////////////////////////////////////////
 // SSAO parameters.
 ///////////////////////////////////////////////////////////////////////////////
-FboInfo ssaoInputFB;
 FboInfo ssaoOutputFB;
 FboInfo ssaoBlurFB;
+FboInfo ssaoBlurTempFB; // Between the horizontal and vertical blur passes
+FboInfo ssaoUpsampleFB;
 std::vector<vec3> ssaoHemisphereSamples;
 GLuint ssaoRotationTexture;
 
-int numberOfSsaoSamples = 32;
+int numberOfSsaoSamples = 8;
 const int ssaoRotationTextureSize = 4;
 bool useSsaoRotation = true;
 bool useSsaoBlur = true;
+int ssaoBlurRadius = ssaoRotationTextureSize / 2;
 
 bool drawSsao = false;
 bool useSsao = true;
 float ssaoRadius = 3.0f;
+// Ambient occlusion is computed and blurred at 1/divisor of the window size, then upsampled
+int ssaoResolutionDivisor = 1;
+// Time of the ambient occlusion passes at full, half and quarter resolution
+GpuTimer ssaoTimers[3];
+// Calculate the ambient occlusion with the compute shader, needs OpenGL 4.3
+bool useSsaoCompute = false;
+// Time of the ambient occlusion output pass with the fragment and the compute shader
+GpuTimer ssaoOutputTimers[2];
+// Average ambient occlusion over frames, reprojected into the current view, so few samples per frame do
+bool useSsaoTemporal = true;
+int ssaoTemporalFrames = 16;
+FboInfo ssaoHistoryFB[2];
+int ssaoHistoryIndex = 0;
+bool ssaoHistoryValid = false;
+unsigned ssaoFrame = 0;
+mat4 previousViewProjMatrix;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Procedural generation
 ///////////////////////////////////////////////////////////////////////////////
 std::unordered_map<uint, architecture::CastlePart*> proceduralObjects;
 uint proceduralFreeId = 1;
+architecture::Grammar* castleGrammar = nullptr;
+int castleSeed = 1;
+
+// Rebuilds edited parts off the render thread
+architecture::Regenerator castleRegenerator;
+bool useBackgroundRegeneration = true;
+
+// Tiled world, streamed around the camera in place of the fixed castle
+architecture::CastleStreamer* castleStreamer = nullptr;
+bool useTiledWorld = false;
+const float worldTileSize = 600.0f;
+int worldLoadRadius = 2;
+int worldMemoryBudgetMB = 256;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Mouse picking
@@ -122,13 +171,41 @@ uint proceduralFreeId = 1;
 bool drawIds = false;
 int hoverID = 0;
 float hoverDepth = 0;
+// Window coordinates, origin at the bottom left, that hoverID and hoverDepth were found at
+vec2 hoverScreenCoords(0);
+mousepicking::PickReadback pickReadback;
+// Ray cast against a BVH of the castle instead of reading back the id buffer
+bool useRayPicking = true;
+mousepicking::Bvh pickingBvh;
+mousepicking::BvhBuilder pickingBvhBuilder;
+unsigned pickingBvhVersion = 0;
+bool pickingBvhDirty = true;
+// Triangles of each part as of its version, reused while the part is unchanged
+struct PickingTriangles
+{
+	unsigned version;
+	std::vector<vec3> triangles;
+};
+std::unordered_map<uint, PickingTriangles> pickingTriangles;
+float pickingQueryMicroseconds = 0;
+// Shift + left drag selects every object within a rectangle
+mousepicking::MarqueeSelection marqueeSelection;
+GLuint marqueeProgram;
+ivec2 marqueeStart;
+std::vector<uint> selectedIDs;
 int pickedID = 0;
 float pickedDepth = 0;
 vec3 pickedModelCoord;
 int mouseX, mouseY = 0;
 FboInfo finalFB;
 
+// Dragging the picked object drags the whole selection if it is part of it, all by pickedMovement
 vec3 pickedMovement(0);
+std::vector<uint> draggedIDs;
+vec3 dragReference;
+mousepicking::Snapping dragSnapping;
+float dragGridSize = 0;
+bool snapToTowers = false;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Boolean operations
@@ -150,18 +227,40 @@ void loadShaders(bool is_reload)
 	if(shader != 0) simpleShaderProgram = shader;
 	shader = labhelper::loadShaderProgram("../project/background.vert", "../project/background.frag", is_reload);
 	if(shader != 0) backgroundProgram = shader;
-	shader = labhelper::loadShaderProgram("../project/ssaoInput.vert", "../project/ssaoInput.frag", is_reload);
-	if (shader != 0) ssaoInputProgram = shader;
 	shader = labhelper::loadShaderProgram("../project/ssaoOutput.vert", "../project/ssaoOutput.frag", is_reload);
 	if (shader != 0) ssaoOutputProgram = shader;
 	shader = labhelper::loadShaderProgram("../project/ssaoOutput.vert", "../project/ssaoBlur.frag", is_reload);
 	if (shader != 0) ssaoBlurProgram = shader;
+	shader = labhelper::loadShaderProgram("../project/ssaoOutput.vert", "../project/ssaoUpsample.frag", is_reload);
+	if (shader != 0) ssaoUpsampleProgram = shader;
+	shader = labhelper::loadShaderProgram("../project/ssaoOutput.vert", "../project/ssaoComposite.frag", is_reload);
+	if (shader != 0) ssaoCompositeProgram = shader;
+	shader = labhelper::loadShaderProgram("../project/ssaoOutput.vert", "../project/ssaoTemporal.frag", is_reload);
+	if (shader != 0) ssaoTemporalProgram = shader;
+	if (GLEW_VERSION_4_3 || GLEW_ARB_compute_shader)
+	{
+		shader = labhelper::loadComputeShaderProgram("../project/ssaoOutput.comp", is_reload);
+		if (shader != 0) ssaoComputeProgram = shader;
+	}
 
 	std::vector<std::string> mainFragmentShaders;
 	mainFragmentShaders.push_back("../project/shading.frag");
 	mainFragmentShaders.push_back("../src/mousepicking/picking.frag");
 	shader = labhelper::loadMultiShaderProgram("../project/shading.vert", mainFragmentShaders, is_reload);
 	if (shader != 0) shaderProgram = shader;
+	shader = labhelper::loadShaderProgram("../src/mousepicking/marquee.vert", "../src/mousepicking/marquee.frag", is_reload);
+	if (shader != 0) marqueeProgram = shader;
+}
+
+void resizeSsaoBuffers()
+{
+	ssaoOutputFB.resize(std::max(1, windowWidth / ssaoResolutionDivisor), std::max(1, windowHeight / ssaoResolutionDivisor));
+	ssaoBlurFB.resize(ssaoOutputFB.width, ssaoOutputFB.height);
+	ssaoBlurTempFB.resize(ssaoOutputFB.width, ssaoOutputFB.height);
+	ssaoUpsampleFB.resize(windowWidth, windowHeight);
+	ssaoHistoryFB[0].resize(ssaoOutputFB.width, ssaoOutputFB.height);
+	ssaoHistoryFB[1].resize(ssaoOutputFB.width, ssaoOutputFB.height);
+	ssaoHistoryValid = false;
 }
 
 void initSsaoSamples()
@@ -173,8 +272,28 @@ void initSsaoSamples()
 	}
 }
 
+// Compile the castle grammar and make its rules replace the built-in ones, keeps the old rules on errors
+bool loadGrammar()
+{
+	try
+	{
+		architecture::Grammar* grammar = new architecture::Grammar(architecture::Grammar::loadFromFile("../src/architecture/castle.grammar"));
+		architecture::setGrammar(grammar);
+		delete castleGrammar;
+		castleGrammar = grammar;
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		labhelper::non_fatal_error(e.what(), "Grammar");
+		return false;
+	}
+}
+
 void generateGeometry()
 {
+	loadGrammar();
+
 	// Main castle walls
 	vec3 wallNodes[] = { vec3(-80,0,0), vec3(130,0,30), vec3(200,0,70), vec3(240,0,0), vec3(350,0,-60), vec3(480,0,60), vec3(555,0,0), vec3(670,0,-30), vec3(790,0,150), vec3(800,0,250), vec3(790,0,365) };
 	for (auto& object : architecture::makeWalls(wallNodes, 11))
@@ -191,6 +310,7 @@ void generateGeometry()
 	// Init geometry
 	for (auto& object : proceduralObjects)
 	{
+		object.second->seed = architecture::rng::combine(castleSeed, object.first);
 		object.second->init();
 	}
 
@@ -227,6 +347,17 @@ void generateGeometry()
 	booleanTestId = proceduralFreeId++;
 }
 
+// The size of the window, or of the offscreen framebuffer when there is no window
+void getWindowSize(int& width, int& height)
+{
+	if (g_window != nullptr) SDL_GetWindowSize(g_window, &width, &height);
+	else
+	{
+		width = windowWidth;
+		height = windowHeight;
+	}
+}
+
 void initGL()
 {
 	///////////////////////////////////////////////////////////////////////
@@ -254,24 +385,27 @@ void initGL()
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, ssaoRotationTextureSize, ssaoRotationTextureSize, 0, GL_RGB, GL_FLOAT, rotations);
 
 	// Set up ssao framebuffers
-	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
-	ssaoInputFB.resize(windowWidth, windowHeight);
-	ssaoOutputFB.resize(windowWidth, windowHeight);
-	ssaoBlurFB.resize(windowWidth, windowHeight);
-	GLint finalTextureFormats[] = { GL_RGBA16F, GL_R32UI };
-	finalFB = FboInfo(2, finalTextureFormats);
+	getWindowSize(windowWidth, windowHeight);
+	resizeSsaoBuffers();
+	// Color, object id, view space normal and the part of the color ambient occlusion scales
+	GLint finalTextureFormats[] = { GL_RGBA16F, GL_R32UI, GL_RGBA16F, GL_RGBA16F };
+	finalFB = FboInfo(4, finalTextureFormats);
 	finalFB.resize(windowWidth, windowHeight);
+	pickReadback.init();
+	marqueeSelection.init();
 
 	///////////////////////////////////////////////////////////////////////
 	// Load models and set up model matrices
 	///////////////////////////////////////////////////////////////////////
-	//fighterModel = labhelper::loadModelFromOBJ("../scenes/NewShip.obj");
-	//landingpadModel = labhelper::loadModelFromOBJ("../scenes/landingpad.obj");
-	//sphereModel = labhelper::loadModelFromOBJ("../scenes/sphere.obj");
-	//
-	//roomModelMatrix = mat4(1.0f);
-	//fighterModelMatrix = translate(15.0f * worldUp);
-	//landingPadModelMatrix = mat4(1.0f);
+	// The sphere is small and loaded up front to stand in for the others
+	sphereModel = labhelper::loadModelFromOBJ("../scenes/sphere.obj");
+	assetLoader = new labhelper::AssetLoader(2);
+	fighterModel = assetLoader->loadModelAsync("../scenes/NewShip.obj");
+	landingpadModel = assetLoader->loadModelAsync("../scenes/landingpad.obj");
+
+	roomModelMatrix = mat4(1.0f);
+	fighterModelMatrix = translate(15.0f * worldUp);
+	landingPadModelMatrix = mat4(1.0f);
 
 	///////////////////////////////////////////////////////////////////////
 	// Load environment map
@@ -318,6 +452,29 @@ void drawBackground(const mat4& viewMatrix, const mat4& projectionMatrix)
 	labhelper::drawFullScreenQuad();
 }
 
+vec3 dragMovement(uint id)
+{
+	if (std::find(draggedIDs.begin(), draggedIDs.end(), id) != draggedIDs.end()) return pickedMovement;
+	return vec3(0);
+}
+
+// Draw a model loaded by assetLoader, or the placeholder sphere until it has been uploaded
+void drawModel(GLuint currentShaderProgram, const labhelper::Model* model, mat4 modelMatrix, const mat4& viewMatrix, const mat4& projectionMatrix)
+{
+	if (model->m_vaob == 0 && !assetLoader->failed(model))
+	{
+		model = sphereModel;
+		modelMatrix *= scale(vec3(placeholderRadius));
+	}
+	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
+	                          projectionMatrix * viewMatrix * modelMatrix);
+	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * modelMatrix);
+	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
+	                          inverse(transpose(viewMatrix * modelMatrix)));
+
+	labhelper::render(model);
+}
+
 void drawScene(GLuint currentShaderProgram,
                const mat4& viewMatrix,
                const mat4& projectionMatrix,
@@ -342,41 +499,44 @@ void drawScene(GLuint currentShaderProgram,
 	// camera
 	labhelper::setUniformSlow(currentShaderProgram, "viewInverse", inverse(viewMatrix));
 
-	/*
-	// landing pad
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-	                          projectionMatrix * viewMatrix * landingPadModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * landingPadModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-	                          inverse(transpose(viewMatrix * landingPadModelMatrix)));
+	// The models are not pickable
+	labhelper::setUniformSlow(currentShaderProgram, "objectId", 0u);
 
-	labhelper::render(landingpadModel);
+	// landing pad
+	drawModel(currentShaderProgram, landingpadModel, landingPadModelMatrix, viewMatrix, projectionMatrix);
 
 	// Fighter
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-	                          projectionMatrix * viewMatrix * fighterModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * fighterModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-	                          inverse(transpose(viewMatrix * fighterModelMatrix)));
-
-	labhelper::render(fighterModel);
-	*/
+	drawModel(currentShaderProgram, fighterModel, fighterModelMatrix, viewMatrix, projectionMatrix);
 
 	// Castle
-
-	for (auto& object : proceduralObjects)
+	if (castleStreamer != nullptr)
 	{
-		labhelper::setUniformSlow(currentShaderProgram, "objectId", object.first);
-
-		mat4 modelMatrix = object.first == pickedID && g_isMouseDraggingLeft ? translate(pickedMovement) : mat4(1.0f);
-		labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-			projectionMatrix * viewMatrix * modelMatrix);
-		labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix",
-			viewMatrix * modelMatrix);
-		labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-			inverse(transpose(viewMatrix * modelMatrix)));
-
-		object.second->render();
+		labhelper::setUniformSlow(currentShaderProgram, "objectId", 0u);
+		// Parts are only translated, which leaves the normal matrix alone
+		labhelper::setUniformSlow(currentShaderProgram, "normalMatrix", inverse(transpose(viewMatrix)));
+		castleStreamer->render([&](const mat4& modelMatrix)
+		{
+			labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix", projectionMatrix * viewMatrix * modelMatrix);
+			labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * modelMatrix);
+		});
+	}
+	else
+	{
+		for (auto& object : proceduralObjects)
+		{
+			labhelper::setUniformSlow(currentShaderProgram, "objectId", object.first);
+
+			mat4 modelMatrix = object.second->modelMatrix();
+			if (g_isMouseDraggingLeft) modelMatrix = translate(dragMovement(object.first)) * modelMatrix;
+			labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
+				projectionMatrix * viewMatrix * modelMatrix);
+			labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix",
+				viewMatrix * modelMatrix);
+			labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
+				inverse(transpose(viewMatrix * modelMatrix)));
+
+			object.second->render();
+		}
 	}
 
 	// Booleantest
@@ -384,7 +544,7 @@ void drawScene(GLuint currentShaderProgram,
 	//isectRect1->render();
 	//isectRect2->render();
 	labhelper::setUniformSlow(currentShaderProgram, "objectId", booleanTestId);
-	mat4 tempModelMatrix = booleanTestId == pickedID && g_isMouseDraggingLeft ? translate(pickedMovement) : mat4(1.0f);
+	mat4 tempModelMatrix = g_isMouseDraggingLeft ? translate(dragMovement(booleanTestId)) : mat4(1.0f);
 	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
 		projectionMatrix * viewMatrix * booleanTestModelMatrix * tempModelMatrix);
 	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix",
@@ -395,6 +555,24 @@ void drawScene(GLuint currentShaderProgram,
 }
 
 
+// Outline the selection rectangle on the default framebuffer
+void drawMarquee(ivec2 a, ivec2 b)
+{
+	ivec2 low = min(a, b);
+	ivec2 high = max(a, b);
+	glEnable(GL_SCISSOR_TEST);
+	glClearColor(1.0, 1.0, 1.0, 1.0);
+	glScissor(low.x, low.y, high.x - low.x + 1, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glScissor(low.x, high.y, high.x - low.x + 1, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glScissor(low.x, low.y, 1, high.y - low.y + 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glScissor(high.x, low.y, 1, high.y - low.y + 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+}
+
 void display(void)
 {
 	///////////////////////////////////////////////////////////////////////////
@@ -402,14 +580,12 @@ void display(void)
 	///////////////////////////////////////////////////////////////////////////
 	{
 		int w, h;
-		SDL_GetWindowSize(g_window, &w, &h);
+		getWindowSize(w, h);
 		if(w != windowWidth || h != windowHeight)
 		{
 			windowWidth = w;
 			windowHeight = h;
-			ssaoInputFB.resize(windowWidth, windowHeight);
-			ssaoOutputFB.resize(windowWidth, windowHeight);
-			ssaoBlurFB.resize(windowWidth, windowHeight);
+			resizeSsaoBuffers();
 			finalFB.resize(windowWidth, windowHeight);
 		}
 	}
@@ -437,103 +613,339 @@ void display(void)
 	glBindTexture(GL_TEXTURE_2D, reflectionMap);
 	glActiveTexture(GL_TEXTURE0);
 
-	if (useSsao | drawSsao)
+	///////////////////////////////////////////////////////////////////////////
+	// Draw from camera
+	///////////////////////////////////////////////////////////////////////////
+	bool ssaoPasses = useSsao | drawSsao;
+
+	glUseProgram(shaderProgram);
+	glUniform1i(glGetUniformLocation(shaderProgram, "useSsao"), ssaoPasses);
+	glUniform1i(glGetUniformLocation(shaderProgram, "drawId"), drawIds);
+	glUniform1ui(glGetUniformLocation(shaderProgram, "hoverId"), hoverID);
+	glUniform1ui(glGetUniformLocation(shaderProgram, "pickedId"), pickedID);
+
+	profiler.begin("Main draw");
+	// The id attachment is only needed when picking or selection reads it back, and has no
+	// storage otherwise. Normals and the occludable part of the shading are only needed when
+	// ambient occlusion is applied.
+	finalFB.setColorTextureEnabled(1, !useRayPicking || g_isMarqueeSelecting);
+	glBindFramebuffer(GL_FRAMEBUFFER, finalFB.framebufferId);
+	GLenum finalDrawBuffers[] = { GL_COLOR_ATTACHMENT0,
+	                              finalFB.colorTextureEnabled[1] ? GL_COLOR_ATTACHMENT1 : GL_NONE,
+	                              ssaoPasses ? GL_COLOR_ATTACHMENT2 : GL_NONE,
+	                              ssaoPasses ? GL_COLOR_ATTACHMENT3 : GL_NONE };
+	glDrawBuffers(4, finalDrawBuffers);
+	glViewport(0, 0, windowWidth, windowHeight);
+	glClearColor(0.2, 0.2, 0.8, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// The background has neither a normal nor ambient light to occlude
+	const float zero[] = { 0, 0, 0, 0 };
+	glClearBufferfv(GL_COLOR, 2, zero);
+	glClearBufferfv(GL_COLOR, 3, zero);
+
+	glDepthRangef(0, 1);
+
+	//drawBackground(viewMatrix, projMatrix);
+	drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+	//debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
+	profiler.end();
+
+	if (ssaoPasses)
 	{
 		///////////////////////////////////////////////////////////////////////////
-		// First SSAO render
+		// SSAO from the normals and depth of the final framebuffer
 		///////////////////////////////////////////////////////////////////////////
-		glBindFramebuffer(GL_FRAMEBUFFER, ssaoInputFB.framebufferId);
-		glViewport(0, 0, windowWidth, windowHeight);
-		glClearColor(0.0, 0.0, 0.0, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		GpuTimer& ssaoTimer = ssaoTimers[ssaoResolutionDivisor == 1 ? 0 : ssaoResolutionDivisor == 2 ? 1 : 2];
+		ssaoTimer.begin();
+		profiler.begin("SSAO");
 
-		glDepthRangef(0, 1);
+		profiler.begin("SSAO output");
 
-		// Draw scene to the pre-process framebuffer
-		drawScene(ssaoInputProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+		// Both shaders take the same inputs and uniforms
+		bool ssaoCompute = useSsaoCompute && ssaoComputeProgram != 0;
+		GLuint ssaoProgram = ssaoCompute ? ssaoComputeProgram : ssaoOutputProgram;
+		ssaoOutputTimers[ssaoCompute ? 1 : 0].begin();
 
-		///////////////////////////////////////////////////////////////////////////
-		// Second SSAO render
-		///////////////////////////////////////////////////////////////////////////
-		glBindFramebuffer(GL_FRAMEBUFFER, ssaoOutputFB.framebufferId);
-		glViewport(0, 0, windowWidth, windowHeight);
-		glClearColor(0.0, 0.0, 0.0, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (!ssaoCompute)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, ssaoOutputFB.framebufferId);
+			glViewport(0, 0, ssaoOutputFB.width, ssaoOutputFB.height);
+			glClearColor(0.0, 0.0, 0.0, 1.0);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		}
 
-		glUseProgram(ssaoOutputProgram);
+		glUseProgram(ssaoProgram);
 
 		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, ssaoInputFB.colorTextureTargets[0]);
+		glBindTexture(GL_TEXTURE_2D, finalFB.colorTextureTargets[2]);
 
 		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, ssaoInputFB.depthBuffer);
+		glBindTexture(GL_TEXTURE_2D, finalFB.depthBuffer);
 
 		glActiveTexture(GL_TEXTURE2);
 		glBindTexture(GL_TEXTURE_2D, ssaoRotationTexture);
 
-		glUniform3fv(glGetUniformLocation(ssaoOutputProgram, "hemisphereSamples"), numberOfSsaoSamples, &ssaoHemisphereSamples[0].x);
-		glUniform1i(glGetUniformLocation(ssaoOutputProgram, "numberOfSamples"), numberOfSsaoSamples); //Removed as Shader Storage Buffer Object is needed
-		glUniform1f(glGetUniformLocation(ssaoOutputProgram, "ssaoRadius"), ssaoRadius);
-		glUniform1i(glGetUniformLocation(ssaoOutputProgram, "useRotation"), useSsaoRotation);
+		glUniform3fv(glGetUniformLocation(ssaoProgram, "hemisphereSamples"), numberOfSsaoSamples, &ssaoHemisphereSamples[0].x);
+		glUniform1i(glGetUniformLocation(ssaoProgram, "numberOfSamples"), numberOfSsaoSamples); //Removed as Shader Storage Buffer Object is needed
+		glUniform1f(glGetUniformLocation(ssaoProgram, "ssaoRadius"), ssaoRadius);
+		glUniform1i(glGetUniformLocation(ssaoProgram, "useRotation"), useSsaoRotation);
+		glUniform1i(glGetUniformLocation(ssaoProgram, "resolutionDivisor"), ssaoResolutionDivisor);
+		// Turn the samples by the golden angle every frame so accumulated frames do not repeat them
+		glUniform1f(glGetUniformLocation(ssaoProgram, "rotationOffset"), useSsaoTemporal ? 2.39996f * (ssaoFrame++ % 1024) : 0.0f);
 
-		glUniformMatrix4fv(glGetUniformLocation(ssaoOutputProgram, "projectionMatrix"), 1, false, &projMatrix[0].x);
-		glUniformMatrix4fv(glGetUniformLocation(ssaoOutputProgram, "inverseProjectionMatrix"), 1, false, &inverseProjMatrix[0].x);
+		glUniformMatrix4fv(glGetUniformLocation(ssaoProgram, "projectionMatrix"), 1, false, &projMatrix[0].x);
+		glUniformMatrix4fv(glGetUniformLocation(ssaoProgram, "inverseProjectionMatrix"), 1, false, &inverseProjMatrix[0].x);
 
-		labhelper::drawFullScreenQuad();
+		if (ssaoCompute)
+		{
+			// 8 x 8 pixels per work group, see ssaoOutput.comp
+			glBindImageTexture(0, ssaoOutputFB.colorTextureTargets[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+			glDispatchCompute((ssaoOutputFB.width + 7) / 8, (ssaoOutputFB.height + 7) / 8, 1);
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		}
+		else
+		{
+			labhelper::drawFullScreenQuad();
+		}
+		ssaoOutputTimers[ssaoCompute ? 1 : 0].end();
+		profiler.end();
+		GLuint ssaoResult = ssaoOutputFB.colorTextureTargets[0];
+
+		///////////////////////////////////////////////////////////////////////////
+		// SSAO temporal accumulation
+		///////////////////////////////////////////////////////////////////////////
+		if (useSsaoTemporal)
+		{
+			ProfileScope scope(profiler, "SSAO temporal");
+			FboInfo& history = ssaoHistoryFB[ssaoHistoryIndex];
+			FboInfo& accumulated = ssaoHistoryFB[1 - ssaoHistoryIndex];
+			glBindFramebuffer(GL_FRAMEBUFFER, accumulated.framebufferId);
+			glViewport(0, 0, accumulated.width, accumulated.height);
+
+			glUseProgram(ssaoTemporalProgram);
+
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, ssaoResult);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, history.colorTextureTargets[0]);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, finalFB.depthBuffer);
+
+			mat4 reprojectionMatrix = previousViewProjMatrix * inverse(viewMatrix);
+			glUniformMatrix4fv(glGetUniformLocation(ssaoTemporalProgram, "inverseProjectionMatrix"), 1, false, &inverseProjMatrix[0].x);
+			glUniformMatrix4fv(glGetUniformLocation(ssaoTemporalProgram, "reprojectionMatrix"), 1, false, &reprojectionMatrix[0].x);
+			glUniform1i(glGetUniformLocation(ssaoTemporalProgram, "resolutionDivisor"), ssaoResolutionDivisor);
+			glUniform1i(glGetUniformLocation(ssaoTemporalProgram, "historyValid"), ssaoHistoryValid);
+			glUniform1f(glGetUniformLocation(ssaoTemporalProgram, "maxFrames"), float(ssaoTemporalFrames));
+
+			labhelper::drawFullScreenQuad();
+
+			ssaoHistoryIndex = 1 - ssaoHistoryIndex;
+			ssaoHistoryValid = true;
+			ssaoResult = accumulated.colorTextureTargets[0];
+		}
+		else
+		{
+			ssaoHistoryValid = false;
+		}
+		previousViewProjMatrix = projMatrix * viewMatrix;
 
 		///////////////////////////////////////////////////////////////////////////
 		// SSAO blur
 		///////////////////////////////////////////////////////////////////////////
 		if (useSsaoBlur)
 		{
+			ProfileScope scope(profiler, "SSAO blur");
+			glUseProgram(ssaoBlurProgram);
+
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, finalFB.colorTextureTargets[2]);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, finalFB.depthBuffer);
+
+			glUniform1i(glGetUniformLocation(ssaoBlurProgram, "blurRadius"), ssaoBlurRadius);
+			glUniform1i(glGetUniformLocation(ssaoBlurProgram, "resolutionDivisor"), ssaoResolutionDivisor);
+			glUniformMatrix4fv(glGetUniformLocation(ssaoBlurProgram, "inverseProjectionMatrix"), 1, false, &inverseProjMatrix[0].x);
+
+			// Separable, horizontally into the temporary buffer and then vertically
+			glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurTempFB.framebufferId);
+			glViewport(0, 0, ssaoBlurTempFB.width, ssaoBlurTempFB.height);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, ssaoResult);
+			glUniform2i(glGetUniformLocation(ssaoBlurProgram, "direction"), 1, 0);
+			labhelper::drawFullScreenQuad();
+
 			glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFB.framebufferId);
+			glViewport(0, 0, ssaoBlurFB.width, ssaoBlurFB.height);
+			glBindTexture(GL_TEXTURE_2D, ssaoBlurTempFB.colorTextureTargets[0]);
+			glUniform2i(glGetUniformLocation(ssaoBlurProgram, "direction"), 0, 1);
+			labhelper::drawFullScreenQuad();
+			ssaoResult = ssaoBlurFB.colorTextureTargets[0];
+		}
+
+		///////////////////////////////////////////////////////////////////////////
+		// SSAO upsample
+		///////////////////////////////////////////////////////////////////////////
+		if (ssaoResolutionDivisor > 1)
+		{
+			ProfileScope scope(profiler, "SSAO upsample");
+			glBindFramebuffer(GL_FRAMEBUFFER, ssaoUpsampleFB.framebufferId);
 			glViewport(0, 0, windowWidth, windowHeight);
-			glClearColor(0.0, 0.0, 0.0, 1.0);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-			glUseProgram(ssaoBlurProgram);
+			glUseProgram(ssaoUpsampleProgram);
 
 			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, ssaoOutputFB.colorTextureTargets[0]);
+			glBindTexture(GL_TEXTURE_2D, ssaoResult);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, finalFB.depthBuffer);
 
-			glUniform1i(glGetUniformLocation(ssaoBlurProgram, "rotationTextureSize"), ssaoRotationTextureSize);
+			glUniform1i(glGetUniformLocation(ssaoUpsampleProgram, "resolutionDivisor"), ssaoResolutionDivisor);
+			glUniformMatrix4fv(glGetUniformLocation(ssaoUpsampleProgram, "inverseProjectionMatrix"), 1, false, &inverseProjMatrix[0].x);
 
 			labhelper::drawFullScreenQuad();
+			ssaoResult = ssaoUpsampleFB.colorTextureTargets[0];
 		}
+
+		ssaoTimer.end();
+		profiler.end();
+
+		///////////////////////////////////////////////////////////////////////////
+		// SSAO composite, applies ambient occlusion while bringing the final image
+		// to the default framebuffer
+		///////////////////////////////////////////////////////////////////////////
+		profiler.begin("SSAO composite");
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, windowWidth, windowHeight);
+
+		glUseProgram(ssaoCompositeProgram);
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, finalFB.colorTextureTargets[0]);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, finalFB.colorTextureTargets[3]);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, ssaoResult);
+		glActiveTexture(GL_TEXTURE0);
+
+		glUniform1i(glGetUniformLocation(ssaoCompositeProgram, "drawSsao"), drawSsao);
+
+		labhelper::drawFullScreenQuad();
+		profiler.end();
 	}
+	else
+	{
+		ssaoHistoryValid = false;
 
-	///////////////////////////////////////////////////////////////////////////
-	// Draw from camera
-	///////////////////////////////////////////////////////////////////////////
+		// Blit final screen to default frame buffer
+		ProfileScope scope(profiler, "Blit");
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, finalFB.framebufferId);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
 
-	if (useSsao | drawSsao)
+	if (g_isMarqueeSelecting)
 	{
-		// Bind the ssao buffer
-		glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, useSsaoBlur ? ssaoBlurFB.colorTextureTargets[0] : ssaoOutputFB.colorTextureTargets[0]);
+		ProfileScope scope(profiler, "Marquee");
+		drawMarquee(marqueeStart, ivec2(mouseX, windowHeight - 1 - mouseY));
 	}
+}
 
-	glUseProgram(shaderProgram);
-	glUniform1i(glGetUniformLocation(shaderProgram, "drawSsao"), drawSsao);
-	glUniform1i(glGetUniformLocation(shaderProgram, "useSsao"), useSsao);
-	glUniform1i(glGetUniformLocation(shaderProgram, "drawId"), drawIds);
-	glUniform1ui(glGetUniformLocation(shaderProgram, "hoverId"), hoverID);
-	glUniform1ui(glGetUniformLocation(shaderProgram, "pickedId"), pickedID);
+void startDrag()
+{
+	draggedIDs.clear();
+	if (std::find(selectedIDs.begin(), selectedIDs.end(), (uint)pickedID) != selectedIDs.end()) draggedIDs = selectedIDs;
+	else draggedIDs.push_back(pickedID);
+
+	// Only the grabbed object snaps, a tower by its origin and anything else by the grabbed point
+	auto tower = dynamic_cast<architecture::CastleTower*>(proceduralObjects.count(pickedID) != 0 ? proceduralObjects[pickedID] : nullptr);
+	dragReference = tower != nullptr ? tower->origin : pickedModelCoord;
+	pickedMovement = vec3(0);
+
+	dragSnapping.gridSize = dragGridSize;
+	dragSnapping.targets.clear();
+	dragSnapping.targetRadius = snapToTowers ? 10.0f : 0.0f;
+	for (auto& object : proceduralObjects)
+	{
+		auto tower = dynamic_cast<architecture::CastleTower*>(object.second);
+		if (tower != nullptr && std::find(draggedIDs.begin(), draggedIDs.end(), object.first) == draggedIDs.end())
+		{
+			dragSnapping.targets.push_back(tower->origin);
+		}
+	}
+}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, finalFB.framebufferId);
-	glViewport(0, 0, windowWidth, windowHeight);
-	glClearColor(0.2, 0.2, 0.8, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void finishDrag()
+{
+	std::vector<architecture::CastlePart*> parts;
+	std::vector<vec3> movements;
+	for (size_t i = 0; i < draggedIDs.size(); ++i)
+	{
+		auto object = proceduralObjects.find(draggedIDs[i]);
+		if (object != proceduralObjects.end())
+		{
+			parts.push_back(object->second);
+			movements.push_back(pickedMovement);
+		}
+		else if (draggedIDs[i] == booleanTestId)
+		{
+			booleanTestModelMatrix *= translate(pickedMovement);
+			pickingBvhDirty = true;
+		}
+	}
+	architecture::moveParts(parts, movements);
 
-	//drawBackground(viewMatrix, projMatrix);
-	drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
-	//debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
+	// Reset to avoid weird movement previews
+	draggedIDs.clear();
+	pickedMovement = vec3(0);
+}
+
+// Rebuild the picking BVH if any part has new geometry
+void updatePickingBvh()
+{
+	mousepicking::Bvh built;
+	if (pickingBvhBuilder.poll(built)) pickingBvh = std::move(built);
+
+	unsigned version = proceduralObjects.size();
+	for (auto& object : proceduralObjects)
+	{
+		version += object.second->version();
+	}
+	if (!pickingBvhDirty && version == pickingBvhVersion) return;
+
+	// Only parts with new geometry are collected again, and the hierarchy is built on a worker.
+	// The old one answers queries until the new one is swapped in.
+	std::unordered_map<uint, PickingTriangles> collected;
+	mousepicking::Bvh bvh;
+	// The fixed castle is hidden while the tiled world is shown
+	for (auto& object : proceduralObjects)
+	{
+		if (castleStreamer != nullptr) break;
+		PickingTriangles& part = collected[object.first];
+		auto cached = pickingTriangles.find(object.first);
+		if (cached != pickingTriangles.end() && cached->second.version == object.second->version())
+		{
+			part = std::move(cached->second);
+		}
+		else
+		{
+			part.version = object.second->version();
+			object.second->collectTriangles(part.triangles);
+		}
+		bvh.addTriangles(part.triangles, object.first);
+	}
+	pickingTriangles.swap(collected);
+	std::vector<vec3> triangles;
+	isectRects->collectTriangles(triangles);
+	for (vec3& position : triangles)
+	{
+		position = vec3(booleanTestModelMatrix * vec4(position, 1.0f));
+	}
+	bvh.addTriangles(triangles, booleanTestId);
+	pickingBvhBuilder.request(std::move(bvh));
 
-	// Blit final screen to default frame buffer
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-	glReadBuffer(GL_COLOR_ATTACHMENT0);
-	glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	pickingBvhVersion = version;
+	pickingBvhDirty = false;
 }
 
 void rotateCamera(int deltaX, int deltaY)
@@ -574,13 +986,19 @@ bool handleEvents(void)
 			g_prevMouseCoords.y = mouseY;
 
 			if (event.button.button == SDL_BUTTON_RIGHT) g_isMouseDraggingRight = true;
-			if (event.button.button == SDL_BUTTON_LEFT)
+			if (event.button.button == SDL_BUTTON_LEFT && (SDL_GetModState() & KMOD_SHIFT))
+			{
+				g_isMarqueeSelecting = true;
+				marqueeStart = ivec2(mouseX, windowHeight - 1 - mouseY);
+			}
+			else if (event.button.button == SDL_BUTTON_LEFT)
 			{
 				pickedID = hoverID;
 				pickedDepth = hoverDepth;
-				vec2 pickedScreenCoords = vec2(g_prevMouseCoords.x, windowHeight - 1.0f - g_prevMouseCoords.y);
-				pickedModelCoord = glm::unProject(vec3(pickedScreenCoords, pickedDepth), viewMatrix, projMatrix, viewport);
+				// The depth may lag the mouse, so it is unprojected where it was read
+				pickedModelCoord = glm::unProject(vec3(hoverScreenCoords, pickedDepth), viewMatrix, projMatrix, viewport);
 				g_isMouseDraggingLeft = true;
+				startDrag();
 
 				// Handle variables for gui
 
@@ -605,19 +1023,12 @@ bool handleEvents(void)
 		if (!(SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) && g_isMouseDraggingLeft)
 		{
 			g_isMouseDraggingLeft = false;
-
-			auto& pickedObject = proceduralObjects.find(pickedID);
-			if (pickedObject != proceduralObjects.end())
-			{
-				pickedObject->second->move(pickedMovement);
-			}
-			else if (pickedID == booleanTestId)
-			{
-				booleanTestModelMatrix *= translate(pickedMovement);
-			}
-
-			// Reset to avoid weird movement previews
-			pickedMovement = vec3(0);
+			finishDrag();
+		}
+		if (!(SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) && g_isMarqueeSelecting)
+		{
+			g_isMarqueeSelecting = false;
+			marqueeSelection.request(marqueeProgram, finalFB.colorTextureTargets[1], marqueeStart, ivec2(mouseX, windowHeight - 1 - mouseY));
 		}
 		if (!(g_isMouseDraggingRight || g_isMouseDraggingLeft))
 		{
@@ -634,8 +1045,8 @@ bool handleEvents(void)
 			{
 				vec2 newScreenCoords = vec2(event.motion.x, windowHeight - 1.0f - event.motion.y);
 
-				vec3 modelSpaceMovement = mousepicking::moveAlongPlane(pickedModelCoord, newScreenCoords, viewMatrix, projMatrix, viewport, worldUp);
-				pickedMovement =  modelSpaceMovement;
+				mousepicking::PlaneDrag drag(viewMatrix, projMatrix, viewport);
+				pickedMovement = drag.move(pickedModelCoord, newScreenCoords, worldUp, dragReference, dragSnapping);
 			}
 			g_prevMouseCoords.x = event.motion.x;
 			g_prevMouseCoords.y = event.motion.y;
@@ -682,24 +1093,56 @@ bool handleEvents(void)
 	}*/
 
 	// Update picking data
+	if (useRayPicking)
 	{
-		glBindFramebuffer(GL_READ_FRAMEBUFFER, finalFB.framebufferId);
+		ProfileScope scope(profiler, "Picking ray");
+		updatePickingBvh();
+
+		auto start = std::chrono::high_resolution_clock::now();
+		vec3 rayOrigin, rayDirection;
+		hoverScreenCoords = vec2(mouseX, windowHeight - 1 - mouseY);
+		mousepicking::windowRay(hoverScreenCoords, viewMatrix, projMatrix, viewport, rayOrigin, rayDirection);
+		mousepicking::RayHit hit;
+		// The ray spans near to far plane for distances in [0, 1]
+		if (pickingBvh.intersect(rayOrigin, rayDirection, hit, 1.0f))
 		{
-			glReadBuffer(GL_COLOR_ATTACHMENT1);
-
-			uint id;
-			glReadPixels(mouseX, windowHeight - mouseY, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &id);
-
-			hoverID = id;
-
-			float depth;
-			glReadPixels(mouseX, windowHeight - mouseY, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &depth);
+			hoverID = hit.objectId;
+			hoverDepth = glm::project(hit.position, viewMatrix, projMatrix, viewport).z;
+		}
+		else
+		{
+			hoverID = 0;
+			hoverDepth = 1.0f;
+		}
+		pickingQueryMicroseconds = std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+	else
+	{
+		// Read back asynchronously so the values lag a frame or two
+		ProfileScope scope(profiler, "Picking readback");
+		mousepicking::PickReadback::Sample sample;
+		if (pickReadback.poll(sample))
+		{
+			hoverID = sample.id;
+			hoverDepth = sample.depth;
+			hoverScreenCoords = vec2(sample.x, sample.y);
+		}
+		// The id attachment gets its storage at the next frame after switching from ray picking
+		if (finalFB.colorTextureEnabled[1])
+		{
+			pickReadback.request(finalFB.framebufferId, GL_COLOR_ATTACHMENT1, mouseX, windowHeight - 1 - mouseY);
+		}
+	}
 
-			hoverDepth = depth;
+	// Selected castle parts, a frame after the selection was made
+	std::vector<uint32_t> ids;
+	if (marqueeSelection.poll(ids))
+	{
+		selectedIDs.clear();
+		for (uint32_t id : ids)
+		{
+			if (proceduralObjects.count(id) != 0) selectedIDs.push_back(id);
 		}
-		// Reset stuff
-		glReadBuffer(GL_COLOR_ATTACHMENT0);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
 	return quitEvent;
@@ -720,6 +1163,31 @@ void gui()
 			initSsaoSamples();
 		ImGui::Checkbox("Use rotation texture", &useSsaoRotation);
 		ImGui::Checkbox("Use blur pass", &useSsaoBlur);
+		ImGui::SliderInt("Blur radius", &ssaoBlurRadius, 1, 8);
+		ImGui::Checkbox("Accumulate over frames", &useSsaoTemporal);
+		if (useSsaoTemporal)
+		{
+			ImGui::SliderInt("Frames", &ssaoTemporalFrames, 2, 64);
+		}
+		const char* resolutions[] = { "Full", "Half", "Quarter" };
+		int resolution = ssaoResolutionDivisor == 1 ? 0 : ssaoResolutionDivisor == 2 ? 1 : 2;
+		if (ImGui::Combo("Resolution", &resolution, resolutions, 3))
+		{
+			ssaoResolutionDivisor = 1 << resolution;
+			resizeSsaoBuffers();
+		}
+		ImGui::Text("GPU time: full %.2f ms, half %.2f ms, quarter %.2f ms",
+		            ssaoTimers[0].milliseconds(), ssaoTimers[1].milliseconds(), ssaoTimers[2].milliseconds());
+		if (ssaoComputeProgram != 0)
+		{
+			ImGui::Checkbox("Use compute shader", &useSsaoCompute);
+		}
+		else
+		{
+			ImGui::Text("Compute shader needs OpenGL 4.3");
+		}
+		ImGui::Text("Output pass GPU time: fragment %.2f ms, compute %.2f ms",
+		            ssaoOutputTimers[0].milliseconds(), ssaoOutputTimers[1].milliseconds());
 	}
 
 	// Picking options
@@ -729,6 +1197,15 @@ void gui()
 		ImGui::Text("Hover position X: %i, Y: %i", mouseX, mouseY);
 		ImGui::Text("Hover id: %i", hoverID);
 		ImGui::Text("Hover depth: %f", hoverDepth);
+		ImGui::Checkbox("Ray cast picking", &useRayPicking);
+		if (useRayPicking)
+		{
+			ImGui::Text("Ray query: %.1f us, %d triangles", pickingQueryMicroseconds, (int)pickingBvh.numTriangles());
+		}
+		else
+		{
+			ImGui::Text("Hover latency: %.2f ms (%d frames)", pickReadback.latencyMs(), pickReadback.latencyFrames());
+		}
 		ImGui::Text("Picked position: (%f, %f, %f)", pickedModelCoord.x, pickedModelCoord.y, pickedModelCoord.z);
 		ImGui::Text("Picked id: %i", pickedID);
 		ImGui::Text("Picked depth: %f", pickedDepth);
@@ -747,6 +1224,19 @@ void gui()
 
 	if (ImGui::CollapsingHeader("Live editing", ImGuiTreeNodeFlags_Framed + ImGuiTreeNodeFlags_DefaultOpen))
 	{
+		if (ImGui::Checkbox("Background regeneration", &useBackgroundRegeneration))
+		{
+			// Finish the edits made so far in the old mode
+			architecture::flushDirtyParts();
+			castleRegenerator.drain();
+			architecture::setRegenerator(useBackgroundRegeneration ? &castleRegenerator : nullptr);
+		}
+		if (castleRegenerator.pendingParts() > 0)
+		{
+			ImGui::Text("Regenerating %d parts", (int)castleRegenerator.pendingParts());
+		}
+		ImGui::SliderFloat("Drag grid", &dragGridSize, 0, 50);
+		ImGui::Checkbox("Line up with towers", &snapToTowers);
 		if (pickedObjectHeightable)
 		{
 			float height = pickedObjectHeightable->height();
@@ -763,6 +1253,40 @@ void gui()
 				pickedObjectRadiusable->set_radius(radius);
 			}
 		}
+
+		// Bulk edits on the marquee selection
+		if (!selectedIDs.empty())
+		{
+			ImGui::Text("%d parts selected", (int)selectedIDs.size());
+			float height = 0, radius = 0;
+			for (uint id : selectedIDs)
+			{
+				auto heightable = dynamic_cast<architecture::CastleHeightMixin*>(proceduralObjects[id]);
+				auto radiusable = dynamic_cast<architecture::CastleRadiusMixin*>(proceduralObjects[id]);
+				if (heightable) height = std::max(height, heightable->height());
+				if (radiusable) radius = std::max(radius, radiusable->radius());
+			}
+			if (ImGui::SliderFloat("Selection height", &height, 20, 100))
+			{
+				for (uint id : selectedIDs)
+				{
+					auto heightable = dynamic_cast<architecture::CastleHeightMixin*>(proceduralObjects[id]);
+					if (heightable) heightable->set_height(height);
+				}
+			}
+			if (radius > 0 && ImGui::SliderFloat("Selection radius", &radius, 20, 70))
+			{
+				for (uint id : selectedIDs)
+				{
+					auto radiusable = dynamic_cast<architecture::CastleRadiusMixin*>(proceduralObjects[id]);
+					if (radiusable) radiusable->set_radius(radius);
+				}
+			}
+			if (ImGui::Button("Clear selection"))
+			{
+				selectedIDs.clear();
+			}
+		}
 	}
 
 	// Reload shaders
@@ -770,21 +1294,214 @@ void gui()
 		loadShaders(true);
 	}
 
+	if (ImGui::CollapsingHeader("Tiled world", ImGuiTreeNodeFlags_Framed))
+	{
+		if (ImGui::Checkbox("Use tiled world", &useTiledWorld))
+		{
+			delete castleStreamer;
+			castleStreamer = useTiledWorld ? new architecture::CastleStreamer(architecture::fortLayout, worldTileSize, castleSeed) : nullptr;
+			pickingBvhDirty = true;
+		}
+		ImGui::SliderInt("Load radius (tiles)", &worldLoadRadius, 1, 6);
+		ImGui::SliderInt("Memory budget (MB)", &worldMemoryBudgetMB, 16, 2048);
+		if (castleStreamer != nullptr)
+		{
+			architecture::CastleStreamer::Stats stats = castleStreamer->stats();
+			ImGui::Text("%d tiles resident, %d pending, %.1f MB", (int)stats.residentTiles, (int)stats.pendingTiles, stats.memoryUsage / (1024.0f * 1024.0f));
+		}
+	}
+
+	// Reseed and regenerate the castle
+	if (ImGui::InputInt("Castle seed", &castleSeed)) {
+		for (auto& object : proceduralObjects)
+		{
+			object.second->seed = architecture::rng::combine(castleSeed, object.first);
+			object.second->init();
+		}
+		if (castleStreamer != nullptr)
+		{
+			delete castleStreamer;
+			castleStreamer = new architecture::CastleStreamer(architecture::fortLayout, worldTileSize, castleSeed);
+		}
+	}
+
+	// Reload grammar and regenerate the castle with it, the streamer and regenerator must be idle while the grammar changes.
+	// Pending edits are finished with the old grammar, so they are kept if the new one fails to load.
+	if (ImGui::Button("Reload Grammar")) {
+		if (castleStreamer != nullptr) castleStreamer->clear();
+		architecture::flushDirtyParts();
+		castleRegenerator.drain();
+		if (loadGrammar())
+		{
+			for (auto& object : proceduralObjects)
+			{
+				object.second->init();
+			}
+		}
+	}
+
 	// ----------------- Set variables --------------------------
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 		ImGui::GetIO().Framerate);
+	// Bytes of model buffers and textures uploaded per frame while models load
+	ImGui::SliderInt("Model upload budget (KB)", &modelUploadBudgetKB, 256, 65536);
+	if (assetLoader->pending() > 0)
+	{
+		ImGui::Text("Loading %d models", (int)assetLoader->pending());
+	}
+	if (ImGui::CollapsingHeader("Profiler", ImGuiTreeNodeFlags_Framed))
+	{
+		profiler.gui();
+	}
 	// ----------------------------------------------------------
 
 	// Render the GUI.
 	ImGui::Render();
 }
 
+void updateCastle()
+{
+	// Rebuild parts edited last frame and swap in regenerated ones
+	architecture::flushDirtyParts();
+	castleRegenerator.update();
+
+	// Stream tiles around the camera
+	if (castleStreamer != nullptr)
+	{
+		castleStreamer->loadRadius = worldLoadRadius;
+		castleStreamer->unloadRadius = worldLoadRadius + 1;
+		castleStreamer->memoryBudget = size_t(worldMemoryBudgetMB) * 1024 * 1024;
+		castleStreamer->update(cameraPosition);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Headless benchmark
+///////////////////////////////////////////////////////////////////////////////
+struct CameraKey
+{
+	vec3 position;
+	vec3 target;
+};
+
+// Along the castle walls and up to an overview
+const CameraKey benchmarkPath[] = {
+	{ vec3(-70, 50, 70), vec3(0, 0, 0) },
+	{ vec3(150, 60, -80), vec3(200, 0, 50) },
+	{ vec3(450, 80, -120), vec3(480, 0, 60) },
+	{ vec3(700, 60, 100), vec3(790, 0, 150) },
+	{ vec3(950, 200, 450), vec3(400, 0, 100) },
+};
+const int benchmarkWarmupFrames = 10;
+
+// Release what initGL created, before the context goes away
+void destroyGL()
+{
+	// Free Models, after the loader is done with them
+	delete assetLoader;
+	labhelper::freeModel(fighterModel);
+	labhelper::freeModel(landingpadModel);
+	labhelper::freeModel(sphereModel);
+	pickReadback.destroy();
+	for (GpuTimer& timer : ssaoTimers)
+	{
+		timer.destroy();
+	}
+	for (GpuTimer& timer : ssaoOutputTimers)
+	{
+		timer.destroy();
+	}
+	profiler.destroy();
+	marqueeSelection.destroy();
+	delete castleStreamer;
+	castleRegenerator.clear();
+	architecture::setRegenerator(nullptr);
+	delete castleGrammar;
+}
+
+// Renders frames through display along benchmarkPath without a window, then prints
+// frame time percentiles and writes the profiled passes to benchmark.csv. Each frame
+// waits for the GPU so its time covers the rendering, not just the submission.
+int runBenchmark(int frames)
+{
+	windowWidth = 1280;
+	windowHeight = 720;
+	if (!labhelper::init_offscreen_EGL(windowWidth, windowHeight)) return 1;
+
+	initGL();
+	assetLoader->finish();
+	architecture::setRegenerator(&castleRegenerator);
+	while (castleRegenerator.pendingParts() > 0)
+	{
+		updateCastle();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	const int numSegments = sizeof(benchmarkPath) / sizeof(benchmarkPath[0]) - 1;
+	std::vector<float> frameMilliseconds;
+	for (int frame = -benchmarkWarmupFrames; frame < frames; ++frame)
+	{
+		float t = float(std::max(frame, 0)) / std::max(frames - 1, 1) * numSegments;
+		int segment = std::min(int(t), numSegments - 1);
+		float blend = smoothstep(0.0f, 1.0f, t - segment);
+		cameraPosition = mix(benchmarkPath[segment].position, benchmarkPath[segment + 1].position, blend);
+		cameraDirection = normalize(mix(benchmarkPath[segment].target, benchmarkPath[segment + 1].target, blend) - cameraPosition);
+		// Fixed steps keep the animated light the same between runs
+		previousTime = currentTime;
+		currentTime = std::max(frame, 0) / 60.0f;
+		deltaTime = currentTime - previousTime;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		profiler.beginFrame();
+		profiler.begin("Castle update");
+		updateCastle();
+		profiler.end();
+		profiler.begin("Display");
+		display();
+		glFinish();
+		profiler.end();
+		profiler.endFrame();
+		if (frame >= 0)
+		{
+			frameMilliseconds.push_back(std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+		}
+	}
+
+	std::vector<float> sorted = frameMilliseconds;
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&](float p) { return sorted.empty() ? 0.0f : sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))]; };
+	float total = 0.0f;
+	for (float milliseconds : sorted)
+	{
+		total += milliseconds;
+	}
+	printf("Benchmark: %d frames at %dx%d on %s\n", frames, windowWidth, windowHeight, glGetString(GL_RENDERER));
+	printf("Frame time ms: mean %.2f, p50 %.2f, p90 %.2f, p95 %.2f, p99 %.2f, max %.2f\n", total / std::max<size_t>(sorted.size(), 1),
+	       percentile(0.5f), percentile(0.9f), percentile(0.95f), percentile(0.99f), sorted.empty() ? 0.0f : sorted.back());
+	profiler.finish();
+	profiler.writeCsv("benchmark.csv");
+
+	destroyGL();
+	labhelper::shutDownOffscreen();
+	return 0;
+}
+
 int main(int argc, char* argv[])
 
 {
+	// --benchmark [frames] renders a fixed camera path offscreen and exits
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::string(argv[i]) == "--benchmark")
+		{
+			return runBenchmark(i + 1 < argc ? std::max(1, atoi(argv[i + 1])) : 300);
+		}
+	}
+
 	g_window = labhelper::init_window_SDL("OpenGL Project");
 
 	initGL();
+	architecture::setRegenerator(&castleRegenerator);
 
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
@@ -796,25 +1513,41 @@ int main(int argc, char* argv[])
 		previousTime = currentTime;
 		currentTime = timeSinceStart.count();
 		deltaTime = currentTime - previousTime;
+		profiler.beginFrame();
+
+		profiler.begin("Castle update");
+		updateCastle();
+		profiler.end();
+		profiler.begin("Model upload");
+		assetLoader->update(size_t(modelUploadBudgetKB) * 1024);
+		profiler.end();
+
 		// render to window
+		profiler.begin("Display");
 		display();
+		profiler.end();
 
 		// Render overlay GUI.
 		if(showUI)
 		{
+			ProfileScope scope(profiler, "GUI");
 			gui();
 		}
 
 		// Swap front and back buffer. This frame will now been displayed.
+		profiler.begin("Swap");
 		SDL_GL_SwapWindow(g_window);
+		profiler.end();
 
 		// check events (keyboard among other)
+		profiler.begin("Events");
 		stopRendering = handleEvents();
+		profiler.end();
+		profiler.endFrame();
 	}
-	// Free Models
-	labhelper::freeModel(fighterModel);
-	labhelper::freeModel(landingpadModel);
-	labhelper::freeModel(sphereModel);
+	profiler.finish();
+	profiler.writeCsv("profile.csv");
+	destroyGL();
 
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
@@ -0,0 +1,191 @@
+#include "profiler.h"
+
+#include <cstdio>
+#include <cfloat>
+
+#include <imgui.h>
+
+namespace
+{
+	float millisecondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Frames averaged for the table
+	const int averageFrames = 60;
+}
+
+void Profiler::beginFrame()
+{
+	++frame;
+	int slot = frame % historySize;
+	for (Pass& pass : passes)
+	{
+		pass.cpuMilliseconds[slot] = -1.0f;
+		pass.gpuMilliseconds[slot] = -1.0f;
+	}
+	running.clear();
+	frameStart = std::chrono::high_resolution_clock::now();
+}
+
+void Profiler::endFrame()
+{
+	// Passes left running by an early return end with the frame
+	while (!running.empty())
+	{
+		end();
+	}
+	frameMilliseconds[frame % historySize] = millisecondsSince(frameStart);
+	collectGpuTimes();
+}
+
+void Profiler::finish()
+{
+	for (Pass& pass : passes)
+	{
+		pass.gpuTimer.finish();
+	}
+	collectGpuTimes();
+}
+
+// Store finished GPU times in the slot of the frame they were measured in, passes that
+// did not run this frame included
+void Profiler::collectGpuTimes()
+{
+	for (Pass& pass : passes)
+	{
+		measurements.clear();
+		pass.gpuTimer.takeFinished(measurements);
+		for (const GpuTimer::Measurement& measurement : measurements)
+		{
+			// Older frames have left the history
+			if (measurement.frame + historySize <= frame) continue;
+			pass.gpuMilliseconds[measurement.frame % historySize] = measurement.milliseconds;
+		}
+	}
+}
+
+void Profiler::begin(const std::string& name)
+{
+	int parent = running.empty() ? -1 : running.back();
+	auto key = std::make_pair(parent, name);
+	auto found = passIndices.find(key);
+	int index;
+	if (found != passIndices.end())
+	{
+		index = found->second;
+	}
+	else
+	{
+		index = int(passes.size());
+		passIndices[key] = index;
+		Pass pass;
+		pass.name = name;
+		pass.parent = parent;
+		pass.depth = parent < 0 ? 0 : passes[parent].depth + 1;
+		pass.cpuMilliseconds.assign(historySize, -1.0f);
+		pass.gpuMilliseconds.assign(historySize, -1.0f);
+		passes.push_back(pass);
+	}
+
+	Pass& pass = passes[index];
+	pass.gpuTimer.begin(frame);
+	pass.start = std::chrono::high_resolution_clock::now();
+	running.push_back(index);
+}
+
+void Profiler::end()
+{
+	Pass& pass = passes[running.back()];
+	running.pop_back();
+	int slot = frame % historySize;
+	pass.cpuMilliseconds[slot] = millisecondsSince(pass.start);
+	pass.gpuTimer.end();
+}
+
+float Profiler::average(const std::vector<float>& milliseconds) const
+{
+	float sum = 0.0f;
+	int count = 0;
+	for (int i = 0; i < averageFrames && uint64_t(i) < frame; ++i)
+	{
+		float value = milliseconds[(frame - i) % historySize];
+		if (value < 0.0f) continue;
+		sum += value;
+		++count;
+	}
+	return count > 0 ? sum / count : 0.0f;
+}
+
+void Profiler::passGui(int parent)
+{
+	for (int i = 0; i < int(passes.size()); ++i)
+	{
+		const Pass& pass = passes[i];
+		if (pass.parent != parent) continue;
+
+		ImGui::Text("%*s%s", 2 * pass.depth, "", pass.name.c_str());
+		ImGui::NextColumn();
+		ImGui::Text("%.3f", average(pass.cpuMilliseconds));
+		ImGui::NextColumn();
+		ImGui::Text("%.3f", average(pass.gpuMilliseconds));
+		ImGui::NextColumn();
+		passGui(i);
+	}
+}
+
+void Profiler::gui()
+{
+	int newest = frame % historySize;
+	char overlay[32];
+	snprintf(overlay, sizeof(overlay), "%.2f ms", frameMilliseconds[newest]);
+	ImGui::PlotLines("Frame", frameMilliseconds.data(), historySize, (newest + 1) % historySize, overlay, 0.0f, FLT_MAX, ImVec2(0, 60));
+
+	ImGui::Columns(3, "profiler");
+	ImGui::Text("Pass");
+	ImGui::NextColumn();
+	ImGui::Text("CPU ms");
+	ImGui::NextColumn();
+	ImGui::Text("GPU ms");
+	ImGui::NextColumn();
+	ImGui::Separator();
+	passGui(-1);
+	ImGui::Columns(1);
+}
+
+std::string Profiler::path(int pass) const
+{
+	if (passes[pass].parent < 0) return passes[pass].name;
+	return path(passes[pass].parent) + "/" + passes[pass].name;
+}
+
+bool Profiler::writeCsv(const std::string& filename) const
+{
+	FILE* file = fopen(filename.c_str(), "w");
+	if (file == nullptr) return false;
+
+	fprintf(file, "frame,pass,cpu_ms,gpu_ms\n");
+	uint64_t first = frame >= uint64_t(historySize) ? frame - historySize + 1 : 1;
+	for (uint64_t f = first; f <= frame; ++f)
+	{
+		int slot = f % historySize;
+		for (int i = 0; i < int(passes.size()); ++i)
+		{
+			const Pass& pass = passes[i];
+			if (pass.cpuMilliseconds[slot] < 0.0f) continue;
+			fprintf(file, "%llu,\"%s\",%.4f,%.4f\n", (unsigned long long)f, path(i).c_str(), pass.cpuMilliseconds[slot],
+			        pass.gpuMilliseconds[slot]);
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+void Profiler::destroy()
+{
+	for (Pass& pass : passes)
+	{
+		pass.gpuTimer.destroy();
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdint>
+
+#include "gputimer.h"
+
+// Times named passes of each frame on the CPU, and on the GPU with a GpuTimer per pass.
+// Passes begun inside another pass nest under it. A pass should run at most once per
+// frame. GPU times are filled in a few frames late, once their queries have finished, and
+// are negative until then.
+class Profiler
+{
+public:
+	// Frames kept for the graph, the averages and the CSV
+	static const int historySize = 600;
+
+	void beginFrame();
+	void endFrame();
+	void begin(const std::string& name);
+	void end();
+	// Wait for the GPU times of every frame so far, before writing them
+	void finish();
+
+	// Table of per pass times, averaged over recent frames, and a graph of frame times
+	void gui();
+	// One row per pass and kept frame it ran in
+	bool writeCsv(const std::string& filename) const;
+	void destroy();
+
+private:
+	struct Pass
+	{
+		std::string name;
+		int parent; // -1 for top level passes
+		int depth;
+		GpuTimer gpuTimer;
+		std::chrono::high_resolution_clock::time_point start;
+		// Indexed by frame % historySize, negative where the pass did not run
+		std::vector<float> cpuMilliseconds;
+		std::vector<float> gpuMilliseconds;
+	};
+
+	// In the order the passes first ran
+	std::vector<Pass> passes;
+	// Index of each pass by its parent and name
+	std::map<std::pair<int, std::string>, int> passIndices;
+	std::vector<int> running;
+
+	uint64_t frame = 0;
+	std::chrono::high_resolution_clock::time_point frameStart;
+	std::vector<float> frameMilliseconds = std::vector<float>(historySize, 0.0f);
+	std::vector<GpuTimer::Measurement> measurements;
+
+	void collectGpuTimes();
+	float average(const std::vector<float>& milliseconds) const;
+	void passGui(int parent);
+	std::string path(int pass) const;
+};
+
+// Profiles a pass until the end of the enclosing scope
+class ProfileScope
+{
+public:
+	ProfileScope(Profiler& profiler, const std::string& name) : profiler(profiler) { profiler.begin(name); }
+	~ProfileScope() { profiler.end(); }
+
+private:
+	Profiler& profiler;
+};
@@ -51,9 +51,9 @@ uniform vec3 viewSpaceLightPosition;
 ///////////////////////////////////////////////////////////////////////////////
 // SSAO
 ///////////////////////////////////////////////////////////////////////////////
-uniform bool drawSsao;
+// Ambient occlusion is applied after shading from the normals and depth written here,
+// the composite adds ambientOcclusion * fragmentOccludable to fragmentColor
 uniform bool useSsao;
-layout(binding = 3) uniform sampler2D ambientOcclusionMap;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Mouse picking
@@ -64,6 +64,9 @@ uniform bool drawId;
 // Output color
 ///////////////////////////////////////////////////////////////////////////////
 layout(location = 0) out vec4 fragmentColor;
+// Location 1 is the object id, see picking.frag
+layout(location = 2) out vec3 fragmentNormal;
+layout(location = 3) out vec3 fragmentOccludable;
 
 ///////////////////////////////////////////////////////////////////////////////
 // External functions
@@ -119,7 +122,8 @@ vec3 calculateDirectIllumiunation(vec3 wo, vec3 n, vec3 base_color)
 	return material_reflectivity * microfacet_term + (1 - material_reflectivity) * diffuse_term;
 }
 
-vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color)
+// The result is unoccluded + ambientOcclusion * occludable, only the diffuse part is occluded
+void calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color, out vec3 unoccluded, out vec3 occludable)
 {
 	vec3 indirect_illum = vec3(0.f);
 	///////////////////////////////////////////////////////////////////////////
@@ -136,20 +140,8 @@ vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color)
 	vec2 lookup = vec2(phi / (2.0 * PI), theta / PI);
 	vec4 irradiance = environment_multiplier * texture(irradianceMap, lookup);
 
-	// Optionally add ambient occlusion
-	float ambientOcclusion;
-
-	if(useSsao) {
-		// Use ambient occlusion to get shadow values
-		vec2 screenCoord = gl_FragCoord.xy / textureSize(ambientOcclusionMap, 0);
-		ambientOcclusion = texture(ambientOcclusionMap, screenCoord).x;
-	}
-	else {
-		ambientOcclusion = 1.0;
-	}
-
 	// Calculate the diffuse reflection
-	vec3 diffuse_term = material_color * (1.0 / PI) * vec3(irradiance) * ambientOcclusion;
+	vec3 diffuse_term = material_color * (1.0 / PI) * vec3(irradiance);
 
 	///////////////////////////////////////////////////////////////////////////
 	// Task 6 - Look up in the reflection map from the perfect specular
@@ -170,11 +162,13 @@ vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color)
 	vec3 Li = environment_multiplier * textureLod(reflectionMap, lookup, roughness * 7.0).xyz;
 
 	float F = material_fresnel + (1 - material_fresnel) * pow(1 - dot(wh, wi), 5);
-	vec3 dielectric_term = F * Li + (1 - F) * diffuse_term;
+	vec3 dielectric_term = F * Li;
 	vec3 metal_term = F * material_color * Li;
 	vec3 microfacet_term = material_metalness * metal_term + (1 - material_metalness) * dielectric_term;
 
-	return material_reflectivity * microfacet_term + (1 - material_reflectivity) * diffuse_term;
+	// The diffuse term enters through the dielectric term and on its own
+	unoccluded = material_reflectivity * microfacet_term;
+	occludable = (material_reflectivity * (1 - material_metalness) * (1 - F) + (1 - material_reflectivity)) * diffuse_term;
 }
 
 
@@ -185,6 +179,8 @@ void main()
 	if(drawId)
 	{
 		fragmentColor.xyz = id_debug().xyz;
+		fragmentNormal = normalize(viewSpaceNormal) * 0.5 + 0.5;
+		fragmentOccludable = vec3(0.0);
 		return;
 	}
 	///////////////////////////////////////////////////////////////////////////
@@ -206,17 +202,19 @@ void main()
 	}
 
 	vec3 indirect_illumination_term = vec3(0.0);
+	vec3 occludable_term = vec3(0.0);
 	{ // Indirect illumination
-		indirect_illumination_term = calculateIndirectIllumination(wo, n, base_color);
+		calculateIndirectIllumination(wo, n, base_color, indirect_illumination_term, occludable_term);
 	}
 
-	// Debug SSAO
-	if(drawSsao) {
-		// Use ambient occlusion to get shadow values
-		vec2 screenCoord = gl_FragCoord.xy / textureSize(ambientOcclusionMap, 0);
-		float ambientOcclusion = texture(ambientOcclusionMap, screenCoord).x;
-		fragmentColor = vec4(vec3(ambientOcclusion), 1.0);
-		return;
+	// For the ambient occlusion passes, left oriented like the other view space vectors
+	fragmentNormal = n * 0.5 + 0.5;
+	if(useSsao) {
+		fragmentOccludable = occludable_term;
+	}
+	else {
+		fragmentOccludable = vec3(0.0);
+		indirect_illumination_term += occludable_term;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
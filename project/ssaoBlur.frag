@@ -4,26 +4,51 @@
 precision highp float;
 
 layout(binding = 0) uniform sampler2D ssaoTexture;
-
-uniform int rotationTextureSize;
+// Full resolution normals and depth, to keep the blur from crossing edges
+layout(binding = 1) uniform sampler2D viewSpaceNormalTexture;
+layout(binding = 2) uniform sampler2D depthTexture;
+
+uniform mat4 inverseProjectionMatrix;
+// One pass blurs along (1, 0), the other along (0, 1)
+uniform ivec2 direction;
+uniform int blurRadius;
+uniform int resolutionDivisor = 1;
+// Relative view space depth difference at which a sample stops counting
+uniform float depthTolerance = 0.05;
 
 layout(location = 0) out float fragmentColor;
 
+float viewSpaceDepth(float depth)
+{
+	vec4 position = inverseProjectionMatrix * vec4(0.0, 0.0, depth * 2.0 - 1.0, 1.0);
+	return -position.z / position.w;
+}
+
 void main() {
-	vec2 texCoord = gl_FragCoord.xy / textureSize(ssaoTexture, 0);
-    vec2 texelSize = 1.0 / vec2(textureSize(ssaoTexture, 0));
-
-	int blurRadius = rotationTextureSize / 2;
-
-    float result = 0.0;
-    for (int x = -blurRadius; x <= blurRadius; ++x) 
-    {
-        for (int y = -blurRadius; y <= blurRadius; ++y) 
-        {
-            vec2 offset = vec2(float(x), float(y)) * texelSize;
-            result += texture(ssaoTexture, texCoord + offset).r;
-        }
-    }
-
-    fragmentColor = result / float((2 * blurRadius + 1) * (2 * blurRadius + 1));
-}  
\ No newline at end of file
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(ssaoTexture, 0);
+
+	// ssaoOutput.frag takes normal and depth from the first full resolution pixel of each block
+	float depth = viewSpaceDepth(texelFetch(depthTexture, pixel * resolutionDivisor, 0).r);
+	vec3 normal = texelFetch(viewSpaceNormalTexture, pixel * resolutionDivisor, 0).xyz * 2.0 - 1.0;
+
+	float result = 0.0;
+	float totalWeight = 0.0;
+	for (int i = -blurRadius; i <= blurRadius; ++i)
+	{
+		ivec2 samplePixel = clamp(pixel + i * direction, ivec2(0), size - 1);
+		float sampleDepth = viewSpaceDepth(texelFetch(depthTexture, samplePixel * resolutionDivisor, 0).r);
+		vec3 sampleNormal = texelFetch(viewSpaceNormalTexture, samplePixel * resolutionDivisor, 0).xyz * 2.0 - 1.0;
+
+		// A box over the rotation pattern, cut off at depth and orientation changes
+		float depthWeight = max(0.0, 1.0 - abs(sampleDepth - depth) / (depthTolerance * depth));
+		float normalWeight = max(0.0, dot(normal, sampleNormal));
+		float weight = depthWeight * normalWeight;
+
+		result += weight * texelFetch(ssaoTexture, samplePixel, 0).r;
+		totalWeight += weight;
+	}
+
+	// The center always counts unless its normal is degenerate
+	fragmentColor = totalWeight > 0.0 ? result / totalWeight : texelFetch(ssaoTexture, pixel, 0).r;
+}
@@ -0,0 +1,28 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+// Shading without the diffuse ambient part, and that part, from shading.frag
+layout(binding = 0) uniform sampler2D colorTexture;
+layout(binding = 1) uniform sampler2D occludableTexture;
+// Full resolution ambient occlusion
+layout(binding = 3) uniform sampler2D ambientOcclusionMap;
+
+uniform bool drawSsao;
+
+layout(location = 0) out vec4 fragmentColor;
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float ambientOcclusion = texelFetch(ambientOcclusionMap, pixel, 0).r;
+
+	if(drawSsao) {
+		fragmentColor = vec4(vec3(ambientOcclusion), 1.0);
+		return;
+	}
+
+	vec4 color = texelFetch(colorTexture, pixel, 0);
+	fragmentColor = vec4(color.rgb + ambientOcclusion * texelFetch(occludableTexture, pixel, 0).rgb, color.a);
+}
@@ -1,24 +0,0 @@
-#version 420
-
-///////////////////////////////////////////////////////////////////////////////
-// Input vertex attributes
-///////////////////////////////////////////////////////////////////////////////
-layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normalIn;
-
-///////////////////////////////////////////////////////////////////////////////
-// Input uniform variables
-///////////////////////////////////////////////////////////////////////////////
-uniform mat4 modelViewProjectionMatrix; 
-uniform mat4 normalMatrix;
-
-///////////////////////////////////////////////////////////////////////////////
-// Output to fragment shader
-///////////////////////////////////////////////////////////////////////////////
-out vec3 viewSpaceNormal;
-
-void main() 
-{
-	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
-	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
-}
\ No newline at end of file
@@ -14,6 +14,8 @@ uniform int numberOfSamples;
 const int maxNumSamples = 64;
 uniform vec3 hemisphereSamples[maxNumSamples];
 uniform bool useRotation;
+uniform int resolutionDivisor = 1;
+uniform float rotationOffset = 0.0;
 
 layout(location = 0) out float hemisphericalVisibility;
 
@@ -38,9 +40,11 @@ mat3 rotationMatrix(vec3 axis, float angle)
 
 void main() 
 {
-	vec2 texCoord = gl_FragCoord.xy / textureSize(depthTexture, 0);
+	// At reduced resolution, each output pixel stands for the first full resolution pixel of its block
+	ivec2 inputPixel = ivec2(gl_FragCoord.xy) * resolutionDivisor;
+	vec2 texCoord = (vec2(inputPixel) + 0.5) / textureSize(depthTexture, 0);
 
-	float fragmentDepth = texture(depthTexture, texCoord).r;
+	float fragmentDepth = texelFetch(depthTexture, inputPixel, 0).r;
 
 	vec4 originNormalizedDeviceCoordinates = vec4(texCoord.x * 2.0 - 1.0, texCoord.y * 2.0 - 1.0, 
 					fragmentDepth * 2.0 - 1.0, 1.0);
@@ -49,7 +53,7 @@ void main()
 	vec3 viewSpaceOriginPosition = homogenize(inverseProjectionMatrix * originNormalizedDeviceCoordinates);
 
 	// Read and save the view space normal from texture (left hand oriented)
-	vec3 viewSpaceNormal = normalize(texture(viewSpaceNormalTexture, texCoord).xyz * 2.0 - 1.0);
+	vec3 viewSpaceNormal = normalize(texelFetch(viewSpaceNormalTexture, inputPixel, 0).xyz * 2.0 - 1.0);
 	// Calculate a tangent and bitangent to the normal
 	vec3 viewSpaceTangent = normalize(vec3(0.0, -viewSpaceNormal.z, viewSpaceNormal.y));
 	vec3 viewSpaceBitangent = cross(viewSpaceNormal, viewSpaceTangent);
@@ -59,15 +63,16 @@ void main()
 	// Offset point from surface along normal
 	viewSpaceOriginPosition += viewSpaceNormal * 0.1;
 
-	mat3 randomRotationMatrix;
-	// Calculate a rotation for the samples based on a noise texture
+	// Calculate a rotation for the samples based on a noise texture, turned further every frame
+	// when ambient occlusion is accumulated over frames
+	float angle = rotationOffset;
 	if(useRotation)
 	{
-		float rotation = texture(rotationTexture, texCoord * textureSize(depthTexture, 0) / textureSize(rotationTexture, 0)).r;
-		randomRotationMatrix = rotationMatrix(vec3(0, 0, 1), rotation * 360);
+		// Tiled over output pixels, which the blur pass averages over
+		float rotation = texture(rotationTexture, gl_FragCoord.xy / textureSize(rotationTexture, 0)).r;
+		angle += rotation * 360;
 	}
-	else
-		randomRotationMatrix = mat3(1.0f);
+	mat3 randomRotationMatrix = rotationMatrix(vec3(0, 0, 1), angle);
 
 	int numberOfVisibleSamples = 0; 
 	int numberOfValidSamples = 0;
@@ -0,0 +1,62 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+// This frame's ambient occlusion, from few samples
+layout(binding = 0) uniform sampler2D ssaoTexture;
+// Accumulated so far: r is ambient occlusion, g the view space depth it was found at and b the frames it averages
+layout(binding = 1) uniform sampler2D historyTexture;
+layout(binding = 2) uniform sampler2D depthTexture;
+
+uniform mat4 inverseProjectionMatrix;
+// From this frame's view space to last frame's clip space
+uniform mat4 reprojectionMatrix;
+uniform int resolutionDivisor = 1;
+uniform bool historyValid;
+// Frames averaged at most, the weight of a new frame never drops below 1 / maxFrames
+uniform float maxFrames;
+// Relative view space depth difference at which the history counts as disoccluded
+uniform float depthTolerance = 0.05;
+
+layout(location = 0) out vec4 accumulated;
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	// Same full resolution pixel as ssaoOutput.frag
+	ivec2 inputPixel = pixel * resolutionDivisor;
+	vec2 texCoord = (vec2(inputPixel) + 0.5) / textureSize(depthTexture, 0);
+	float depth = texelFetch(depthTexture, inputPixel, 0).r;
+
+	vec4 viewSpacePosition = inverseProjectionMatrix * vec4(texCoord * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	viewSpacePosition /= viewSpacePosition.w;
+
+	float current = texelFetch(ssaoTexture, pixel, 0).r;
+
+	// Where this point was last frame, w is its view space depth then
+	vec4 previousClip = reprojectionMatrix * viewSpacePosition;
+	vec2 previousCoord = previousClip.xy / previousClip.w * 0.5 + 0.5;
+	vec4 history = texture(historyTexture, previousCoord);
+
+	bool onScreen = all(greaterThanEqual(previousCoord, vec2(0.0))) && all(lessThanEqual(previousCoord, vec2(1.0)));
+	bool sameSurface = abs(history.g - previousClip.w) < depthTolerance * previousClip.w;
+	bool valid = historyValid && depth < 1.0 && onScreen && sameSurface;
+
+	// Keep the history within what this frame's neighbourhood found, which bounds the lag while moving
+	float neighbourhoodMin = current;
+	float neighbourhoodMax = current;
+	for(int y = -1; y <= 1; y++)
+	{
+		for(int x = -1; x <= 1; x++)
+		{
+			float neighbour = texelFetch(ssaoTexture, pixel + ivec2(x, y), 0).r;
+			neighbourhoodMin = min(neighbourhoodMin, neighbour);
+			neighbourhoodMax = max(neighbourhoodMax, neighbour);
+		}
+	}
+	history.r = clamp(history.r, neighbourhoodMin, neighbourhoodMax);
+
+	float frames = valid ? min(history.b + 1.0, maxFrames) : 1.0;
+	accumulated = vec4(mix(history.r, current, 1.0 / frames), -viewSpacePosition.z, frames, 1.0);
+}
@@ -0,0 +1,65 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+// Ambient occlusion computed at a fraction of the resolution
+layout(binding = 0) uniform sampler2D ssaoTexture;
+// Full resolution depth
+layout(binding = 1) uniform sampler2D depthTexture;
+
+uniform mat4 inverseProjectionMatrix;
+uniform int resolutionDivisor;
+// Relative view space depth difference at which a low resolution sample stops counting
+uniform float depthTolerance = 0.05;
+
+layout(location = 0) out float fragmentColor;
+
+float viewSpaceDepth(float depth)
+{
+	vec4 position = inverseProjectionMatrix * vec4(0.0, 0.0, depth * 2.0 - 1.0, 1.0);
+	return -position.z / position.w;
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = viewSpaceDepth(texelFetch(depthTexture, pixel, 0).r);
+
+	// The four low resolution samples around this pixel, weighted bilinearly and by how well
+	// the depth each was computed at matches ours, so AO does not bleed over silhouettes
+	vec2 lowResCoord = gl_FragCoord.xy / float(resolutionDivisor) - 0.5;
+	ivec2 base = ivec2(floor(lowResCoord));
+	vec2 fraction = lowResCoord - vec2(base);
+	ivec2 lowResSize = textureSize(ssaoTexture, 0);
+
+	float result = 0.0;
+	float totalWeight = 0.0;
+	float closestDifference = 1e30;
+	float closestOcclusion = 1.0;
+	for (int y = 0; y <= 1; ++y)
+	{
+		for (int x = 0; x <= 1; ++x)
+		{
+			ivec2 lowResPixel = clamp(base + ivec2(x, y), ivec2(0), lowResSize - 1);
+			float occlusion = texelFetch(ssaoTexture, lowResPixel, 0).r;
+			// ssaoOutput.frag takes the depth of the first pixel of each block
+			float sampleDepth = viewSpaceDepth(texelFetch(depthTexture, lowResPixel * resolutionDivisor, 0).r);
+
+			float difference = abs(sampleDepth - depth);
+			vec2 bilinear = mix(1.0 - fraction, fraction, vec2(x, y));
+			float weight = bilinear.x * bilinear.y / (1e-4 + difference / (depthTolerance * depth));
+			result += weight * occlusion;
+			totalWeight += weight;
+
+			if (difference < closestDifference)
+			{
+				closestDifference = difference;
+				closestOcclusion = occlusion;
+			}
+		}
+	}
+
+	// Nothing at a similar depth, take the nearest in depth
+	fragmentColor = closestDifference > depthTolerance * depth ? closestOcclusion : result / totalWeight;
+}
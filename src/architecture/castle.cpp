@@ -1,6 +1,10 @@
 #include "castle.h"
+#include "regeneration.h"
 
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <stdexcept>
 
 #include <range.hpp>
@@ -9,16 +13,116 @@
 #include <glm/gtc/constants.hpp>
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtx/vector_angle.hpp>
+#include <glm/gtx/transform.hpp>
 
 using util::lang::indices;
 
 namespace architecture
 {
-	Shape* makeTower(glm::vec3 origin, float height /*= 40*/, float radius /*= 20*/)
+	namespace
 	{
-		float wallThickness = 3;
-		float baseHeight = 5;
-		float ceilingThickness = 3;
+		const Grammar* activeGrammar = nullptr;
+		Regenerator* activeRegenerator = nullptr;
+		// Parts edited since the last flush, in the order they were first marked
+		std::vector<CastlePart*> dirtyParts;
+
+		// Run rule from the active grammar if it has one with that name
+		bool applyGrammarRule(const std::string& rule, Shape* shape)
+		{
+			if (activeGrammar == nullptr || !activeGrammar->hasRule(rule)) return false;
+
+			activeGrammar->apply(rule, shape);
+			return true;
+		}
+
+		float grammarParam(const std::string& param, float defaultValue)
+		{
+			if (activeGrammar == nullptr || !activeGrammar->hasParam(param)) return defaultValue;
+
+			return activeGrammar->param(param);
+		}
+	}
+
+	void setGrammar(const Grammar* grammar)
+	{
+		activeGrammar = grammar;
+	}
+
+	void setRegenerator(Regenerator* regenerator)
+	{
+		activeRegenerator = regenerator;
+	}
+
+	void flushDirtyParts()
+	{
+		// Builds only read part parameters, which the setters have already settled, so the order does not matter
+		std::vector<CastlePart*> parts;
+		parts.swap(dirtyParts);
+		for (CastlePart* part : parts)
+		{
+			part->dirty = false;
+			part->regenerate();
+		}
+	}
+
+	void moveParts(const std::vector<CastlePart*>& parts, const std::vector<glm::vec3>& movements)
+	{
+		std::map<CastleTower*, glm::vec3> moved;
+		for (int i : indices(parts))
+		{
+			// Walls follow their towers
+			CastleTower* tower = dynamic_cast<CastleTower*>(parts[i]);
+			if (tower != nullptr) moved[tower] = movements[i];
+		}
+		auto movementOf = [&](CastleTower* tower)
+		{
+			auto found = moved.find(tower);
+			return found != moved.end() ? found->second : glm::vec3(0);
+		};
+
+		std::set<CastlePart*> affected;
+		for (auto& entry : moved)
+		{
+			entry.first->origin += entry.second;
+			affected.insert(entry.first);
+			for (auto& connector : entry.first->connectors)
+			{
+				affected.insert(connector.wall);
+				affected.insert(connector.tower);
+			}
+		}
+
+		const float epsilon = 1e-4f;
+		for (CastlePart* part : affected)
+		{
+			bool changed = false;
+			if (CastleTower* tower = dynamic_cast<CastleTower*>(part))
+			{
+				// Connector openings only depend on the directions to the neighbours
+				for (auto& connector : tower->connectors)
+				{
+					glm::vec3 direction = connector.tower->origin - tower->origin;
+					glm::vec3 oldDirection = direction - movementOf(connector.tower) + movementOf(tower);
+					changed |= glm::length(glm::normalize(direction) - glm::normalize(oldDirection)) > epsilon;
+				}
+			}
+			else
+			{
+				// Walls are built from their length and direction
+				ConnectingCastleWall* wall = static_cast<ConnectingCastleWall*>(part);
+				changed = glm::length(movementOf(wall->node2) - movementOf(wall->node1)) > epsilon;
+			}
+
+			if (changed) part->markDirty();
+			else part->markMoved();
+		}
+	}
+
+	Shape* makeTower(glm::vec3 origin, float height /*= 40*/, float radius /*= 20*/, uint64_t seed /*= 0*/)
+	{
+		float wallThickness = grammarParam("towerWallThickness", 3);
+		float baseHeight = grammarParam("towerBaseHeight", 5);
+		float ceilingThickness = grammarParam("towerCeilingThickness", 3);
 
 		// Create the tower structure
 		architecture::CoordSys cylinderCoordSys = { architecture::CoordSysType::cylindrical, origin, { glm::vec3(0,0,1), glm::vec3(1,0,0), glm::vec3(0,1,0) } };
@@ -28,6 +132,7 @@ namespace architecture
 									    glm::vec2(0, height) };
 
 		Shape* towerStructure = new architecture::Shape(cylinderCoordSys, cylinderBounds);
+		towerStructure->pathKey = seed;
 
 		// Create inner room and walls
 		std::string strucureNames[] = { "Room", "Wall" };
@@ -56,11 +161,11 @@ namespace architecture
 		return towerStructure;
 	}
 
-	Shape* makeTower(glm::vec3 origin, glm::vec3 connectorDirs[], float connectorWidths[], size_t numConnectors, float height /*= 40*/, float radius /*= 20*/)
+	Shape* makeTower(glm::vec3 origin, glm::vec3 connectorDirs[], float connectorWidths[], size_t numConnectors, float height /*= 40*/, float radius /*= 20*/, uint64_t seed /*= 0*/)
 	{
-		float wallThickness = 3;
-		float baseHeight = 5;
-		float ceilingThickness = 3;
+		float wallThickness = grammarParam("towerWallThickness", 3);
+		float baseHeight = grammarParam("towerBaseHeight", 5);
+		float ceilingThickness = grammarParam("towerCeilingThickness", 3);
 
 		glm::vec3 upDir(0, 1, 0);
 
@@ -132,6 +237,7 @@ namespace architecture
 										glm::vec2(0, height) };
 
 		Shape* towerStructure = new architecture::Shape(cylinderCoordSys, cylinderBounds);
+		towerStructure->pathKey = seed;
 
 		// Create inner room and walls
 		std::string strucureNames[] = { "Room", "Wall" };
@@ -168,12 +274,12 @@ namespace architecture
 		return towerStructure;
 	}
 
-	Shape* makeWall(glm::vec3 start, glm::vec3 end, float wallHeight /*= 40*/)
+	Shape* makeWall(glm::vec3 start, glm::vec3 end, float wallHeight /*= 40*/, uint64_t seed /*= 0*/)
 	{
-		float wallDepth = 10;
-		float wallThickness = 3;
-		float baseHeight = 5;
-		float ceilingThickness = 3;
+		float wallDepth = grammarParam("wallDepth", 10);
+		float wallThickness = grammarParam("wallThickness", 3);
+		float baseHeight = grammarParam("wallBaseHeight", 5);
+		float ceilingThickness = grammarParam("wallCeilingThickness", 3);
 
 		glm::vec3 upDir(0, 1, 0);
 
@@ -187,6 +293,7 @@ namespace architecture
 									 glm::vec2(0, wallHeight) };
 
 		Shape* wallStructure = new architecture::Shape(blockCoordSys, blockBounds);
+		wallStructure->pathKey = seed;
 
 		// Create inner room and walls
 		std::string structureNames[] = { "Reverse Wall", "Room", "Wall" };
@@ -270,6 +377,8 @@ namespace architecture
 
 	void castleWindows(Shape* wall)
 	{
+		if (applyGrammarRule("castleWindows", wall)) return;
+
 		wall->repeat(2, "Level", SizePolicy::absoluteOuter, 28, 1, PaddingType::high);
 		for (auto& level : *wall->children["Level"])
 		{
@@ -294,10 +403,7 @@ namespace architecture
 				throw std::invalid_argument("Invalid coordinate system type");
 			}
 
-			SizePolicy splitPolicies[] = { SizePolicy::relative,
-										   SizePolicy::absoluteTrue,
-										   SizePolicy::relative };
-
+			// Segments are always cartesian, so the splits use the compile time specialized operators
 			std::string splitOuterNames[] = { "EMPTY", "Window", "EMPTY" };
 			float splitSizesOuterWidth[] = { 1, 4, 1 };
 			float splitSizesOuterHeight[] = { 1.5, 10, 1 };
@@ -309,17 +415,17 @@ namespace architecture
 			int windowInnerMask[] = { 1, 0, 1 };
 			for (architecture::Shape* segment : segments)
 			{
-				segment->subdivide(1, splitOuterNames, splitPolicies, splitSizesOuterWidth, 3, windowOuterMask);
+				segment->subdivide<1, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(splitOuterNames, splitSizesOuterWidth, windowOuterMask);
 				for (auto& wWindow : *segment->children["Window"])
 				{
-					wWindow->subdivide(2, splitOuterNames, splitPolicies, splitSizesOuterHeight, 3, windowOuterMask);
+					wWindow->subdivide<2, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(splitOuterNames, splitSizesOuterHeight, windowOuterMask);
 					for (auto& window : *wWindow->children["Window"])
 					{
 						window->boundsExpand(frameExpansion);
-						window->subdivide(1, splitInnerNames, splitPolicies, splitSizesInnerWidth, 3);
+						window->subdivide<1, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(splitInnerNames, splitSizesInnerWidth);
 						for (auto& space : *window->children["Space"])
 						{
-							space->subdivide(2, splitInnerNames, splitPolicies, splitSizesInnerHeight, 3, windowInnerMask);
+							space->subdivide<2, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(splitInnerNames, splitSizesInnerHeight, windowInnerMask);
 						}
 					}
 				}
@@ -331,6 +437,8 @@ namespace architecture
 
 	void castleBattlement(Shape* wall)
 	{
+		if (applyGrammarRule("castleBattlement", wall)) return;
+
 		// Parameters for the two sides of the wall and the walkway between
 		float railingSize = 2.0f;
 		std::string overhangNames[] = { "Floor", "Railing" };
@@ -343,9 +451,6 @@ namespace architecture
 		float sectionLength = 12.0f;
 
 		std::string sectionProportionNames[] = { "Portion", "Embrasure", "Portion" };
-		SizePolicy sectionProportionPolicies[] = { SizePolicy::relative,
-									               SizePolicy::absoluteOuter,
-									               SizePolicy::relative };
 		float sectionProportions[] = { 1, 2, 1 };
 		glm::vec2 embrasureExpansion[] = { glm::vec2(0), glm::vec2(0), glm::vec2(0,-4) };
 
@@ -354,18 +459,35 @@ namespace architecture
 		{
 			railing->boundsExpand(railingExpansion);
 
-			railing->repeat(1, "Section", SizePolicy::absoluteOuter, sectionLength);
+			// Railings run along both tower and wall sides, pick the specialized operators once per railing
+			if (railing->coordSys.type == CoordSysType::cylindrical)
+			{
+				railing->repeat<1, CoordSysType::cylindrical, SizePolicy::absoluteOuter>("Section", sectionLength);
+				for (architecture::Shape* section : *railing->children["Section"])
+				{
+					section->subdivide<1, CoordSysType::cylindrical, SizePolicy::relative, SizePolicy::absoluteOuter, SizePolicy::relative>(sectionProportionNames, sectionProportions);
+				}
+			}
+			else
+			{
+				railing->repeat<1, CoordSysType::cartesian, SizePolicy::absoluteOuter>("Section", sectionLength);
+				for (architecture::Shape* section : *railing->children["Section"])
+				{
+					section->subdivide<1, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteOuter, SizePolicy::relative>(sectionProportionNames, sectionProportions);
+				}
+			}
 
 			for (architecture::Shape* section : *railing->children["Section"])
 			{
-				section->subdivide(1, sectionProportionNames, sectionProportionPolicies, sectionProportions, 3);
-				for (auto& embrasure : * section->children["Embrasure"]) embrasure->boundsExpand(embrasureExpansion);
+				for (auto& embrasure : *section->children["Embrasure"]) embrasure->boundsExpand(embrasureExpansion);
 			}
 		}
 	}
 
 	void castleOuterWall(Shape* wall)
 	{
+		if (applyGrammarRule("castleOuterWall", wall)) return;
+
 		std::string splitNames[] = { "Base", "Wall", "Battlement" };
 		SizePolicy splitPolicies[] = { SizePolicy::absoluteTrue,
 									   SizePolicy::relative,
@@ -385,48 +507,127 @@ namespace architecture
 		}
 	}
 	
+	CastlePart::~CastlePart()
+	{
+		if (activeRegenerator != nullptr) activeRegenerator->forget(this);
+		if (dirty) dirtyParts.erase(std::find(dirtyParts.begin(), dirtyParts.end(), this));
+		delete shape;
+	}
+
+	void CastlePart::generate()
+	{
+		replaceShape(shapeBuilder()());
+	}
+
+	void CastlePart::upload(bool compactVertices)
+	{
+		shape->upload(compactVertices);
+	}
+
+	void CastlePart::init()
+	{
+		// Results of earlier background requests are older than this
+		if (activeRegenerator != nullptr) activeRegenerator->forget(this);
+		generate();
+		upload();
+	}
+
+	void CastlePart::regenerate()
+	{
+		if (activeRegenerator != nullptr) activeRegenerator->request(this);
+		else init();
+	}
+
+	void CastlePart::markDirty()
+	{
+		if (dirty) return;
+		dirty = true;
+		dirtyParts.push_back(this);
+	}
+
+	void CastlePart::markMoved()
+	{
+		++version_;
+	}
+
+	glm::mat4 CastlePart::modelMatrix() const
+	{
+		return glm::translate(placement());
+	}
+
 	void CastlePart::render()
 	{
 		shape->render();
 	}
 
-	CastleTower::CastleTower(glm::vec3 origin) :
-		origin(origin)
+	size_t CastlePart::memoryUsage() const
 	{
+		return shape != nullptr ? shape->memoryUsage() : 0;
 	}
 
-	void CastleTower::init()
+	size_t CastlePart::numShapes() const
 	{
-		if (shape != nullptr) delete shape;
+		return shape != nullptr ? shape->numShapes() : 0;
+	}
 
-		if (connectors.size() == 0) shape = makeTower(origin, height(), radius());
-		else
+	void CastlePart::collectTriangles(std::vector<glm::vec3>& triangles) const
+	{
+		if (shape == nullptr) return;
+
+		size_t first = triangles.size();
+		shape->collectTriangles(triangles);
+		glm::vec3 offset = placement();
+		for (size_t i = first; i < triangles.size(); ++i)
 		{
-			std::vector<glm::vec3> connectorDirs(connectors.size());
-			std::vector<float> connectorWidths(connectors.size());
-			for (int i : indices(connectors))
-			{
-				connectorDirs[i] = connectors[i].tower->origin - origin;
-				connectorWidths[i] = connectors[i].wall->width();
-			}
+			triangles[i] += offset;
+		}
+	}
+
+	void CastlePart::replaceShape(Shape* newShape)
+	{
+		delete shape;
+		shape = newShape;
+		++version_;
+	}
 
+	CastleTower::CastleTower(glm::vec3 origin) :
+		origin(origin)
+	{
+	}
 
-			shape = makeTower(origin, connectorDirs.data(), connectorWidths.data(), connectors.size(), height(), radius());
+	std::function<Shape*()> CastleTower::shapeBuilder() const
+	{
+		std::vector<glm::vec3> connectorDirs(connectors.size());
+		std::vector<float> connectorWidths(connectors.size());
+		for (int i : indices(connectors))
+		{
+			connectorDirs[i] = connectors[i].tower->origin - origin;
+			connectorWidths[i] = connectors[i].wall->width();
 		}
 
-		shape->init();
+		float height = height_;
+		float radius = radius_;
+		uint64_t seed = this->seed;
+		return [=]() mutable
+		{
+			Shape* result;
+			if (connectorDirs.empty()) result = makeTower(glm::vec3(0), height, radius, seed);
+			else result = makeTower(glm::vec3(0), connectorDirs.data(), connectorWidths.data(), connectorDirs.size(), height, radius, seed);
+
+			result->build();
+			return result;
+		};
 	}
 
 	void CastleTower::set_height(float newHeight)
 	{
 		height_ = newHeight;
-		init();
+		markDirty();
 		for (auto& connector : connectors)
 		{
 			if (connector.wall->height() > newHeight)
 			{
 				connector.wall->set_height(newHeight);
-				connector.wall->init();
 			}
 		}
 	}
@@ -434,23 +635,17 @@ namespace architecture
 	void CastleTower::set_radius(float newRadius)
 	{
 		radius_ = newRadius;
-		init();
+		markDirty();
+		// Walls are trimmed to the tower radius
 		for (auto& connector : connectors)
 		{
-			connector.wall->init();
+			connector.wall->markDirty();
 		}
 	}
 
 	void CastleTower::move(glm::vec3 movement)
 	{
-		origin += movement;
-		init();
-
-		for (auto& connector : connectors)
-		{
-			connector.wall->init();
-			connector.tower->init();
-		}
+		moveParts({ this }, { movement });
 	}
 
 	ConnectingCastleWall::ConnectingCastleWall(CastleTower* node1, CastleTower* node2) :
@@ -462,31 +657,48 @@ namespace architecture
 	void ConnectingCastleWall::set_height(float newHeight)
 	{
 		height_ = newHeight;
-		init();
+		markDirty();
 		if (node1->height() < newHeight)
 		{
-			node1->set_height(std::max(node1->height(), newHeight));
-			node1->init();
+			node1->set_height(newHeight);
 		}
 		if (node2->height() < newHeight)
 		{
-			node2->set_height(std::max(node2->height(), newHeight));
-			node2->init();
+			node2->set_height(newHeight);
 		}
 	}
 
-	void ConnectingCastleWall::init()
+	void ConnectingCastleWall::span(glm::vec3& start, glm::vec3& end) const
 	{
-		if (shape != nullptr) delete shape;
-
 		float wallBuffer1 = sqrt(node1->radius() * node1->radius() - width() * width() / 4);
 		float wallBuffer2 = sqrt(node2->radius() * node2->radius() - width() * width() / 4);
-		shape = makeWall(node1->origin + wallBuffer1 * glm::normalize(node2->origin - node1->origin), node2->origin - wallBuffer2 * glm::normalize(node2->origin - node1->origin), height());
+		start = node1->origin + wallBuffer1 * glm::normalize(node2->origin - node1->origin);
+		end = node2->origin - wallBuffer2 * glm::normalize(node2->origin - node1->origin);
+	}
 
-		shape->init();
+	glm::vec3 ConnectingCastleWall::placement() const
+	{
+		glm::vec3 start, end;
+		span(start, end);
+		return start;
+	}
+
+	std::function<Shape*()> ConnectingCastleWall::shapeBuilder() const
+	{
+		glm::vec3 start, end;
+		span(start, end);
+		glm::vec3 extent = end - start;
+		float height = height_;
+		uint64_t seed = this->seed;
+		return [=]()
+		{
+			Shape* result = makeWall(glm::vec3(0), extent, height, seed);
+			result->build();
+			return result;
+		};
 	}
 
 	void ConnectingCastleWall::move(glm::vec3 movement)
 	{
 	}
-}
\ No newline at end of file
+}
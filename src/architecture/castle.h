@@ -1,19 +1,65 @@
 #pragma once
 
 #include <vector>
+#include <functional>
 
 #include <shape.h>
+#include <grammar.h>
 
 namespace architecture
 {
+	class Regenerator;
+
 	class CastlePart
 	{
 	protected:
 		Shape* shape = nullptr;
+
+		// Snapshot of the part's parameters as a function building a new shape tree around the
+		// local origin. The function makes no GL calls and does not read the part, so it may
+		// run on any thread.
+		virtual std::function<Shape*()> shapeBuilder() const = 0;
+		// Swap in a new shape tree, deleting the old one
+		void replaceShape(Shape* newShape);
+
+		friend class Regenerator;
+		friend void flushDirtyParts();
+	private:
+		bool dirty = false;
+		unsigned version_ = 0;
 	public:
+		// Seed for the stochastic rules, the same seed always regenerates the same part
+		uint64_t seed = 0;
+
+		virtual ~CastlePart();
+
 		virtual void move(glm::vec3 movement) = 0;
-		virtual void init() = 0;
+		// Where the shape's local origin is placed in the world
+		virtual glm::vec3 placement() const = 0;
+		glm::mat4 modelMatrix() const;
+		// Create the shape tree and its geometry without touching GL, safe to call off the main thread
+		void generate();
+		// Upload generated geometry, on the thread owning the GL context. See Shape::upload for the layouts.
+		void upload(bool compactVertices = true);
+		// Generate and upload
+		void init();
+		// Regenerate after an edit, in the background if a regenerator is set. The old
+		// geometry keeps rendering until the new one is swapped in.
+		void regenerate();
+		// Mark the part for rebuilding at the next flushDirtyParts
+		void markDirty();
+		// Note a new placement that left the shape unchanged
+		void markMoved();
+		// Draw the shape in local space, set modelMatrix first
 		void render();
+		// Approximate bytes held by the generated part
+		size_t memoryUsage() const;
+		// Shapes in the current shape tree
+		size_t numShapes() const;
+		// Append the triangles of the current shape in world space, three positions each
+		void collectTriangles(std::vector<glm::vec3>& triangles) const;
+		// Incremented whenever the shape is replaced or moved
+		unsigned version() const { return version_; }
 	};
 
 	class CastleHeightMixin
@@ -43,6 +89,8 @@ namespace architecture
 		float wallThickness = 3;
 		float baseHeight = 5;
 		float ceilingThickness = 3;
+	protected:
+		std::function<Shape*()> shapeBuilder() const;
 	public:
 		float height() const { return height_; }
 		void set_height(float newHeight);
@@ -60,9 +108,8 @@ namespace architecture
 
 		CastleTower(glm::vec3 origin);
 
-		void init();
-
 		void move(glm::vec3 movement);
+		glm::vec3 placement() const { return origin; }
 	};
 
 	class ConnectingCastleWall : public CastlePart, public CastleHeightMixin
@@ -70,6 +117,10 @@ namespace architecture
 	private:
 		float height_ = 40;
 		float width_ = 20;
+		// World space ends of the wall, trimmed to the tower radii
+		void span(glm::vec3& start, glm::vec3& end) const;
+	protected:
+		std::function<Shape*()> shapeBuilder() const;
 	public:
 		float height() const { return height_; }
 		void set_height(float newHeight);
@@ -80,15 +131,26 @@ namespace architecture
 
 		ConnectingCastleWall(CastleTower* node1, CastleTower* node2);
 
-		void init();
-
 		void move(glm::vec3 movement);
+		// The wall starts at the edge of node1
+		glm::vec3 placement() const;
 	};
 
+	// Use rules and parameters from grammar in place of the built-in ones, nullptr restores the built-in rules
+	void setGrammar(const Grammar* grammar);
+	// Let regenerator rebuild edited parts in the background, nullptr regenerates them immediately
+	void setRegenerator(Regenerator* regenerator);
+	// Regenerate every part marked dirty by edits since the last flush, each once. Call once per frame.
+	void flushDirtyParts();
+	// Move towers together, parts[i] by movements[i]. Only parts whose shape changes are rebuilt,
+	// the rest just follow their placement: towers whose connectors keep their directions and
+	// walls whose length and direction stay the same.
+	void moveParts(const std::vector<CastlePart*>& parts, const std::vector<glm::vec3>& movements);
+
 	// Rules on allignment elements
-	Shape* makeTower(glm::vec3 origin, float height = 40, float radius = 20);
-	Shape* makeTower(glm::vec3 origin, glm::vec3 connectorDirs[], float connectorWidths[], size_t numConnectors, float height = 40, float radius = 20);
-	Shape* makeWall(glm::vec3 start, glm::vec3 end, float height = 40);
+	Shape* makeTower(glm::vec3 origin, float height = 40, float radius = 20, uint64_t seed = 0);
+	Shape* makeTower(glm::vec3 origin, glm::vec3 connectorDirs[], float connectorWidths[], size_t numConnectors, float height = 40, float radius = 20, uint64_t seed = 0);
+	Shape* makeWall(glm::vec3 start, glm::vec3 end, float height = 40, uint64_t seed = 0);
 	std::vector<CastlePart*> makeWalls(glm::vec3 nodes[], size_t numNodes);
 
 	// Rules on shapes
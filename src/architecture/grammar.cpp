@@ -0,0 +1,570 @@
+#include "grammar.h"
+#include "rng.h"
+
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <cstdlib>
+#include <iterator>
+#include <stdexcept>
+
+namespace architecture
+{
+	namespace
+	{
+		// Limits that keep the evaluator free of heap allocations and runaway recursion
+		const size_t maxSplitElements = 32;
+		const int maxCallDepth = 256;
+
+		struct Block
+		{
+			enum class Type { rule, each, ifBranch, elseBranch } type;
+			uint32_t instruction;
+		};
+
+		struct PendingCall
+		{
+			bool isChoice;
+			uint32_t index; // Into code or choices
+			std::string rule;
+			int line;
+		};
+
+		[[noreturn]] void grammarError(int line, const std::string& message)
+		{
+			throw std::runtime_error("Grammar line " + std::to_string(line) + ": " + message);
+		}
+
+		// Split a line into whitespace separated tokens, keeping quoted names together
+		std::vector<std::string> tokenize(const std::string& line, int lineNumber)
+		{
+			std::vector<std::string> tokens;
+			size_t i = 0;
+			while (i < line.size())
+			{
+				char c = line[i];
+				if (c == '#') break;
+				if (isspace((unsigned char)c)) { ++i; continue; }
+
+				std::string token;
+				if (c == '!' && i + 1 < line.size() && line[i + 1] == '"')
+				{
+					token += '!';
+					c = line[++i];
+				}
+				if (c == '"')
+				{
+					size_t close = line.find('"', i + 1);
+					if (close == std::string::npos) grammarError(lineNumber, "Unterminated quote");
+					token += line.substr(i + 1, close - i - 1);
+					i = close + 1;
+				}
+				else
+				{
+					while (i < line.size() && !isspace((unsigned char)line[i]) && line[i] != '#') token += line[i++];
+				}
+				tokens.push_back(token);
+			}
+			return tokens;
+		}
+
+		int parseAxis(const std::string& token, int line)
+		{
+			if (token == "0" || token == "x" || token == "r") return 0;
+			if (token == "1" || token == "y" || token == "phi") return 1;
+			if (token == "2" || token == "z") return 2;
+			grammarError(line, "Unknown axis '" + token + "'");
+			return 0;
+		}
+
+		SizePolicy parsePolicy(const std::string& token, int line)
+		{
+			if (token == "abs") return SizePolicy::absoluteTrue;
+			if (token == "rel") return SizePolicy::relative;
+			if (token == "inner") return SizePolicy::absoluteInner;
+			if (token == "outer") return SizePolicy::absoluteOuter;
+			grammarError(line, "Unknown size policy '" + token + "'");
+			return SizePolicy::relative;
+		}
+
+		// The specialized operators of Shape, instantiated for every axis, coordinate system type,
+		// policy and padding type the grammar can express and picked with a few switches
+		typedef void (*SplitThreeOperator)(Shape* shape, const std::string* names, const float* sizes, const int* mask);
+		typedef void (*RepeatOperator)(Shape* shape, const std::string& name, float size, int paddingMask);
+
+		template <int axis, CoordSysType type, SizePolicy middle>
+		void splitThree(Shape* shape, const std::string* names, const float* sizes, const int* mask)
+		{
+			typedef const std::string Names[3];
+			typedef const float Sizes[3];
+			typedef const int Mask[3];
+			shape->subdivide<axis, type, SizePolicy::relative, middle, SizePolicy::relative>(*(Names*)names, *(Sizes*)sizes, *(Mask*)mask);
+		}
+
+		template <int axis, CoordSysType type, SizePolicy policy, PaddingType paddingType>
+		void repeat(Shape* shape, const std::string& name, float size, int paddingMask)
+		{
+			shape->repeat<axis, type, policy, paddingType>(name, size, paddingMask);
+		}
+
+		template <int axis, CoordSysType type>
+		SplitThreeOperator splitThreeOperator(SizePolicy middle)
+		{
+			switch (middle)
+			{
+				case SizePolicy::absoluteTrue: return &splitThree<axis, type, SizePolicy::absoluteTrue>;
+				case SizePolicy::relative: return &splitThree<axis, type, SizePolicy::relative>;
+				case SizePolicy::absoluteInner: return &splitThree<axis, type, SizePolicy::absoluteInner>;
+				default: return &splitThree<axis, type, SizePolicy::absoluteOuter>;
+			}
+		}
+
+		template <int axis>
+		SplitThreeOperator splitThreeOperator(CoordSysType type, SizePolicy middle)
+		{
+			if (type == CoordSysType::cartesian) return splitThreeOperator<axis, CoordSysType::cartesian>(middle);
+			return splitThreeOperator<axis, CoordSysType::cylindrical>(middle);
+		}
+
+		SplitThreeOperator splitThreeOperator(int axis, CoordSysType type, SizePolicy middle)
+		{
+			switch (axis)
+			{
+				case 0: return splitThreeOperator<0>(type, middle);
+				case 1: return splitThreeOperator<1>(type, middle);
+				default: return splitThreeOperator<2>(type, middle);
+			}
+		}
+
+		template <int axis, CoordSysType type, SizePolicy policy>
+		RepeatOperator repeatOperator(PaddingType paddingType)
+		{
+			switch (paddingType)
+			{
+				case PaddingType::low: return &repeat<axis, type, policy, PaddingType::low>;
+				case PaddingType::high: return &repeat<axis, type, policy, PaddingType::high>;
+				default: return &repeat<axis, type, policy, PaddingType::balance>;
+			}
+		}
+
+		template <int axis, CoordSysType type>
+		RepeatOperator repeatOperator(SizePolicy policy, PaddingType paddingType)
+		{
+			switch (policy)
+			{
+				case SizePolicy::absoluteTrue: return repeatOperator<axis, type, SizePolicy::absoluteTrue>(paddingType);
+				case SizePolicy::relative: return repeatOperator<axis, type, SizePolicy::relative>(paddingType);
+				case SizePolicy::absoluteInner: return repeatOperator<axis, type, SizePolicy::absoluteInner>(paddingType);
+				default: return repeatOperator<axis, type, SizePolicy::absoluteOuter>(paddingType);
+			}
+		}
+
+		template <int axis>
+		RepeatOperator repeatOperator(CoordSysType type, SizePolicy policy, PaddingType paddingType)
+		{
+			if (type == CoordSysType::cartesian) return repeatOperator<axis, CoordSysType::cartesian>(policy, paddingType);
+			return repeatOperator<axis, CoordSysType::cylindrical>(policy, paddingType);
+		}
+
+		RepeatOperator repeatOperator(int axis, CoordSysType type, SizePolicy policy, PaddingType paddingType)
+		{
+			switch (axis)
+			{
+				case 0: return repeatOperator<0>(type, policy, paddingType);
+				case 1: return repeatOperator<1>(type, policy, paddingType);
+				default: return repeatOperator<2>(type, policy, paddingType);
+			}
+		}
+
+		float parseNumber(const std::string& token, int line)
+		{
+			char* end = nullptr;
+			float value = strtof(token.c_str(), &end);
+			if (token.empty() || *end != '\0') grammarError(line, "Expected a number, got '" + token + "'");
+			return value;
+		}
+	}
+
+	Grammar Grammar::compile(const std::string& source)
+	{
+		Grammar grammar;
+		std::vector<Block> blocks;
+		std::vector<PendingCall> calls;
+		std::unordered_map<std::string, uint32_t> nameIndices;
+
+		auto nameIndex = [&](const std::string& name) -> uint32_t
+		{
+			auto found = nameIndices.find(name);
+			if (found != nameIndices.end()) return found->second;
+			uint32_t index = (uint32_t)grammar.names.size();
+			grammar.names.push_back(name);
+			nameIndices[name] = index;
+			return index;
+		};
+
+		auto sizeSlot = [&](const std::string& token, int line) -> uint32_t
+		{
+			if (!token.empty() && token[0] == '$')
+			{
+				auto found = grammar.params.find(token.substr(1));
+				if (found == grammar.params.end()) grammarError(line, "Undeclared parameter '" + token + "'");
+				return found->second;
+			}
+			grammar.slots.push_back(parseNumber(token, line));
+			return (uint32_t)grammar.slots.size() - 1;
+		};
+
+		auto emit = [&](OpCode op) -> Instruction&
+		{
+			Instruction instruction = { op, 0, 0, 0, 0, 0 };
+			grammar.code.push_back(instruction);
+			return grammar.code.back();
+		};
+
+		std::istringstream stream(source);
+		std::string lineText;
+		int line = 0;
+		while (std::getline(stream, lineText))
+		{
+			++line;
+			std::vector<std::string> tokens = tokenize(lineText, line);
+			if (tokens.empty()) continue;
+
+			const std::string& keyword = tokens[0];
+			size_t numArgs = tokens.size() - 1;
+
+			if (keyword == "param")
+			{
+				if (!blocks.empty()) grammarError(line, "Parameters must be declared outside of rules");
+				if (numArgs != 2) grammarError(line, "Expected 'param <name> <value>'");
+				if (grammar.params.count(tokens[1])) grammarError(line, "Parameter '" + tokens[1] + "' declared twice");
+				grammar.slots.push_back(parseNumber(tokens[2], line));
+				grammar.params[tokens[1]] = (uint32_t)grammar.slots.size() - 1;
+				continue;
+			}
+
+			if (keyword == "rule")
+			{
+				if (!blocks.empty()) grammarError(line, "Rules can not be nested");
+				if (numArgs != 1) grammarError(line, "Expected 'rule <name>'");
+				if (grammar.rules.count(tokens[1])) grammarError(line, "Rule '" + tokens[1] + "' defined twice");
+				grammar.rules[tokens[1]] = (uint32_t)grammar.code.size();
+				blocks.push_back({ Block::Type::rule, (uint32_t)grammar.code.size() });
+				continue;
+			}
+
+			if (blocks.empty()) grammarError(line, "'" + keyword + "' outside of rule");
+
+			if (keyword == "end")
+			{
+				Block block = blocks.back();
+				blocks.pop_back();
+				switch (block.type)
+				{
+					case Block::Type::rule:
+						emit(OpCode::ret);
+						break;
+					case Block::Type::each:
+						emit(OpCode::endEach);
+						grammar.code[block.instruction].b = (uint32_t)grammar.code.size();
+						break;
+					case Block::Type::ifBranch:
+						grammar.code[block.instruction].b = (uint32_t)grammar.code.size();
+						break;
+					case Block::Type::elseBranch:
+						grammar.code[block.instruction].a = (uint32_t)grammar.code.size();
+						break;
+				}
+			}
+			else if (keyword == "else")
+			{
+				if (blocks.back().type != Block::Type::ifBranch) grammarError(line, "'else' without 'if'");
+				uint32_t ifInstruction = blocks.back().instruction;
+				blocks.pop_back();
+				emit(OpCode::jump);
+				blocks.push_back({ Block::Type::elseBranch, (uint32_t)grammar.code.size() - 1 });
+				grammar.code[ifInstruction].b = (uint32_t)grammar.code.size();
+			}
+			else if (keyword == "subdivide")
+			{
+				if (numArgs < 4 || (numArgs - 1) % 3 != 0) grammarError(line, "Expected 'subdivide <axis> <name> <policy> <size> ...'");
+				size_t numElements = (numArgs - 1) / 3;
+				if (numElements > maxSplitElements) grammarError(line, "Too many split elements");
+
+				Instruction& instruction = emit(OpCode::subdivide);
+				instruction.axis = (uint8_t)parseAxis(tokens[1], line);
+				instruction.a = (uint32_t)grammar.splitNames.size();
+				instruction.b = (uint32_t)numElements;
+				for (size_t i = 0; i < numElements; ++i)
+				{
+					std::string name = tokens[2 + 3 * i];
+					bool masked = !name.empty() && name[0] == '!';
+					if (masked) name = name.substr(1);
+					grammar.splitNames.push_back(name);
+					grammar.splitPolicies.push_back(parsePolicy(tokens[3 + 3 * i], line));
+					grammar.splitMasks.push_back(masked ? 0 : 1);
+					grammar.splitSlots.push_back(sizeSlot(tokens[4 + 3 * i], line));
+				}
+
+				// Windows, frames and battlements are mostly split this way
+				const SizePolicy* policies = &grammar.splitPolicies[instruction.a];
+				if (numElements == 3 && policies[0] == SizePolicy::relative && policies[2] == SizePolicy::relative)
+				{
+					instruction.op = OpCode::splitThree;
+					instruction.arg = (uint8_t)policies[1];
+				}
+			}
+			else if (keyword == "repeat")
+			{
+				if (numArgs < 4 || numArgs > 6) grammarError(line, "Expected 'repeat <axis> <name> <policy> <size> [nopadding] [low|high|balance]'");
+				int axis = parseAxis(tokens[1], line);
+				uint32_t name = nameIndex(tokens[2]);
+				SizePolicy policy = parsePolicy(tokens[3], line);
+				uint32_t slot = sizeSlot(tokens[4], line);
+
+				uint8_t padding = (uint8_t)PaddingType::balance;
+				for (size_t i = 5; i < tokens.size(); ++i)
+				{
+					if (tokens[i] == "nopadding") padding |= skipPadding;
+					else if (tokens[i] == "low") padding = (padding & skipPadding) | (uint8_t)PaddingType::low;
+					else if (tokens[i] == "high") padding = (padding & skipPadding) | (uint8_t)PaddingType::high;
+					else if (tokens[i] == "balance") padding = (padding & skipPadding) | (uint8_t)PaddingType::balance;
+					else grammarError(line, "Unknown repeat option '" + tokens[i] + "'");
+				}
+
+				Instruction& instruction = emit(OpCode::repeat);
+				instruction.axis = (uint8_t)axis;
+				instruction.arg = (uint8_t)policy;
+				instruction.padding = padding;
+				instruction.a = name;
+				instruction.b = slot;
+			}
+			else if (keyword == "expand")
+			{
+				if (numArgs != 6) grammarError(line, "Expected 'expand <x-> <x+> <y-> <y+> <z-> <z+>'");
+				Instruction& instruction = emit(OpCode::boundsExpand);
+				instruction.a = (uint32_t)grammar.expansionSlots.size();
+				for (size_t i = 1; i <= 6; ++i) grammar.expansionSlots.push_back(sizeSlot(tokens[i], line));
+			}
+			else if (keyword == "wrap")
+			{
+				if (numArgs != 1) grammarError(line, "Expected 'wrap <name>'");
+				emit(OpCode::wrap).a = nameIndex(tokens[1]);
+			}
+			else if (keyword == "parent")
+			{
+				if (numArgs != 1) grammarError(line, "Expected 'parent <operator>'");
+				Shape::ParentChildOperator op;
+				if (tokens[1] == "none") op = Shape::ParentChildOperator::none;
+				else if (tokens[1] == "unite") op = Shape::ParentChildOperator::unite;
+				else if (tokens[1] == "intersect") op = Shape::ParentChildOperator::intersect;
+				else if (tokens[1] == "subtract") op = Shape::ParentChildOperator::subtract;
+				else grammarError(line, "Unknown operator '" + tokens[1] + "'");
+				emit(OpCode::parentOp).arg = (uint8_t)op;
+			}
+			else if (keyword == "call")
+			{
+				if (numArgs != 1) grammarError(line, "Expected 'call <rule>'");
+				emit(OpCode::call);
+				calls.push_back({ false, (uint32_t)grammar.code.size() - 1, tokens[1], line });
+			}
+			else if (keyword == "choose")
+			{
+				if (numArgs < 2 || numArgs % 2 != 0) grammarError(line, "Expected 'choose <rule> <weight> ...'");
+				Instruction& instruction = emit(OpCode::choose);
+				instruction.a = (uint32_t)grammar.choices.size();
+				instruction.b = (uint32_t)numArgs / 2;
+				for (size_t i = 1; i < tokens.size(); i += 2)
+				{
+					Choice choice = { noRule, sizeSlot(tokens[i + 1], line) };
+					if (tokens[i] != "-") calls.push_back({ true, (uint32_t)grammar.choices.size(), tokens[i], line });
+					grammar.choices.push_back(choice);
+				}
+			}
+			else if (keyword == "each")
+			{
+				if (numArgs != 1) grammarError(line, "Expected 'each <name>'");
+				emit(OpCode::forEach).a = nameIndex(tokens[1]);
+				blocks.push_back({ Block::Type::each, (uint32_t)grammar.code.size() - 1 });
+			}
+			else if (keyword == "if")
+			{
+				if (numArgs != 1) grammarError(line, "Expected 'if <cartesian|cylindrical>'");
+				CoordSysType type;
+				if (tokens[1] == "cartesian") type = CoordSysType::cartesian;
+				else if (tokens[1] == "cylindrical") type = CoordSysType::cylindrical;
+				else grammarError(line, "Unknown coordinate system '" + tokens[1] + "'");
+				emit(OpCode::ifCoordSys).arg = (uint8_t)type;
+				blocks.push_back({ Block::Type::ifBranch, (uint32_t)grammar.code.size() - 1 });
+			}
+			else
+			{
+				grammarError(line, "Unknown statement '" + keyword + "'");
+			}
+		}
+
+		if (!blocks.empty()) grammarError(line, "Missing 'end'");
+
+		// Resolve calls now that all rules are known
+		for (const PendingCall& call : calls)
+		{
+			auto found = grammar.rules.find(call.rule);
+			if (found == grammar.rules.end()) grammarError(call.line, "Unknown rule '" + call.rule + "'");
+			if (call.isChoice) grammar.choices[call.index].rule = found->second;
+			else grammar.code[call.index].a = found->second;
+		}
+
+		return grammar;
+	}
+
+	Grammar Grammar::loadFromFile(const std::string& filename)
+	{
+		std::ifstream file(filename);
+		if (!file.is_open()) throw std::runtime_error("Could not open grammar file " + filename);
+		std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		return compile(source);
+	}
+
+	bool Grammar::hasRule(const std::string& rule) const
+	{
+		return rules.find(rule) != rules.end();
+	}
+
+	void Grammar::apply(const std::string& rule, Shape* shape) const
+	{
+		auto found = rules.find(rule);
+		if (found == rules.end()) throw std::invalid_argument("Unknown grammar rule " + rule);
+
+		execute(found->second, shape, 0);
+	}
+
+	bool Grammar::hasParam(const std::string& param) const
+	{
+		return params.find(param) != params.end();
+	}
+
+	float Grammar::param(const std::string& param) const
+	{
+		auto found = params.find(param);
+		if (found == params.end()) throw std::invalid_argument("Unknown grammar parameter " + param);
+
+		return slots[found->second];
+	}
+
+	void Grammar::setParam(const std::string& param, float value)
+	{
+		auto found = params.find(param);
+		if (found == params.end()) throw std::invalid_argument("Unknown grammar parameter " + param);
+
+		slots[found->second] = value;
+	}
+
+	void Grammar::execute(uint32_t pc, Shape* shape, int depth) const
+	{
+		if (depth > maxCallDepth) throw std::runtime_error("Grammar rules recurse too deep");
+
+		for (;;)
+		{
+			const Instruction& instruction = code[pc];
+			switch (instruction.op)
+			{
+				case OpCode::subdivide:
+				{
+					float sizes[maxSplitElements];
+					for (uint32_t i = 0; i < instruction.b; ++i) sizes[i] = slots[splitSlots[instruction.a + i]];
+
+					shape->subdivide(instruction.axis, &splitNames[instruction.a], &splitPolicies[instruction.a], sizes, instruction.b, &splitMasks[instruction.a]);
+					++pc;
+					break;
+				}
+				case OpCode::splitThree:
+				{
+					const uint32_t* splitSlot = &splitSlots[instruction.a];
+					float sizes[3] = { slots[splitSlot[0]], slots[splitSlot[1]], slots[splitSlot[2]] };
+
+					SplitThreeOperator split = splitThreeOperator(instruction.axis, shape->coordSys.type, (SizePolicy)instruction.arg);
+					split(shape, &splitNames[instruction.a], sizes, &splitMasks[instruction.a]);
+					++pc;
+					break;
+				}
+				case OpCode::repeat:
+				{
+					PaddingType paddingType = (PaddingType)(instruction.padding & ~skipPadding);
+					int paddingMask = (instruction.padding & skipPadding) == 0;
+
+					RepeatOperator repeat = repeatOperator(instruction.axis, shape->coordSys.type, (SizePolicy)instruction.arg, paddingType);
+					repeat(shape, names[instruction.a], slots[instruction.b], paddingMask);
+					++pc;
+					break;
+				}
+				case OpCode::boundsExpand:
+				{
+					const uint32_t* expansion = &expansionSlots[instruction.a];
+					glm::vec2 boundExpansions[3] = { glm::vec2(slots[expansion[0]], slots[expansion[1]]),
+													 glm::vec2(slots[expansion[2]], slots[expansion[3]]),
+													 glm::vec2(slots[expansion[4]], slots[expansion[5]]) };
+
+					shape->boundsExpand(boundExpansions);
+					++pc;
+					break;
+				}
+				case OpCode::wrap:
+					shape->wrapCartesianOverCylindrical(names[instruction.a]);
+					++pc;
+					break;
+				case OpCode::parentOp:
+					shape->parentChildOp = (Shape::ParentChildOperator)instruction.arg;
+					++pc;
+					break;
+				case OpCode::forEach:
+				{
+					auto children = shape->children.find(names[instruction.a]);
+					if (children != shape->children.end())
+					{
+						for (Shape* child : *children->second) execute(pc + 1, child, depth + 1);
+					}
+					pc = instruction.b;
+					break;
+				}
+				case OpCode::ifCoordSys:
+					if (shape->coordSys.type == (CoordSysType)instruction.arg) ++pc;
+					else pc = instruction.b;
+					break;
+				case OpCode::jump:
+					pc = instruction.a;
+					break;
+				case OpCode::call:
+					execute(instruction.a, shape, depth + 1);
+					++pc;
+					break;
+				case OpCode::choose:
+				{
+					const Choice* options = &choices[instruction.a];
+					float totalWeight = 0;
+					for (uint32_t i = 0; i < instruction.b; ++i) totalWeight += slots[options[i].weight];
+
+					// The instruction index separates the streams of different choose statements on the same shape
+					float pick = rng::uniform(shape->pathKey, pc) * totalWeight;
+					uint32_t chosen = instruction.b - 1;
+					for (uint32_t i = 0; i < instruction.b; ++i)
+					{
+						pick -= slots[options[i].weight];
+						if (pick < 0)
+						{
+							chosen = i;
+							break;
+						}
+					}
+
+					if (options[chosen].rule != noRule) execute(options[chosen].rule, shape, depth + 1);
+					++pc;
+					break;
+				}
+				case OpCode::endEach:
+				case OpCode::ret:
+					return;
+			}
+		}
+	}
+}
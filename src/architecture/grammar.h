@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include <shape.h>
+
+namespace architecture
+{
+	// Instructions understood by the rule evaluator
+	enum class OpCode : uint8_t
+	{
+		subdivide,    // Split along axis into the b split elements starting at a
+		splitThree,   // Split along axis into the three split elements starting at a, sized relative, arg, relative
+		repeat,       // Repeat names[a] with size slot b along axis
+		boundsExpand, // Expand bounds with the six size slots starting at expansionSlots[a]
+		wrap,         // wrapCartesianOverCylindrical(names[a])
+		parentOp,     // Set parentChildOp to the operator stored in arg
+		forEach,      // Run the following block on every child in names[a], then continue at b
+		endEach,      // End of a forEach block
+		ifCoordSys,   // Continue at b unless the shape's coordinate system type is arg
+		jump,         // Continue at a
+		call,         // Run rule a on the current shape
+		choose,       // Run one of the b choices starting at a, picked by the shape's random stream
+		ret           // End of rule
+	};
+
+	struct Instruction
+	{
+		OpCode op;
+		uint8_t axis;
+		uint8_t arg;     // Size policy, coordinate system type or operator
+		uint8_t padding; // Padding type for repeat, possibly or:ed with skipPadding
+		uint32_t a;
+		uint32_t b;
+	};
+
+	const uint8_t skipPadding = 0x80;
+
+	struct Choice
+	{
+		uint32_t rule;   // Entry point, or noRule to do nothing
+		uint32_t weight; // Value slot
+	};
+
+	const uint32_t noRule = UINT32_MAX;
+
+	// A set of shape rules compiled from a textual grammar.
+	//
+	// The format is line based, '#' starts a comment and names containing
+	// spaces are written within double quotes. Sizes are either numbers or
+	// "$name" references to parameters declared with "param".
+	//
+	//   param <name> <value>
+	//   rule <name>
+	//       subdivide <axis> [!]<name> <policy> <size> ...   ('!' masks the element)
+	//       repeat <axis> <name> <policy> <size> [nopadding] [low|high|balance]
+	//       expand <x-> <x+> <y-> <y+> <z-> <z+>
+	//       wrap <name>
+	//       parent <none|unite|intersect|subtract>
+	//       call <rule>
+	//       choose <rule|-> <weight> ...   ('-' does nothing)
+	//       each <name> ... end
+	//       if <cartesian|cylindrical> ... [else ...] end
+	//   end
+	//
+	// Axes are given as 0-2 or x/y/z (r/phi/z) and policies as abs, rel,
+	// inner or outer. Grammar errors are reported as std::runtime_error.
+	//
+	// Repetitions and the common three element splits with relative outer
+	// elements run on the compile time specialized operators of Shape, picked
+	// by the shape's coordinate system when evaluated.
+	//
+	// "choose" draws from a counter-based generator keyed by the shape's path
+	// key, which starts at the part seed. A choice thereby only depends on the
+	// seed, the path to the shape and the grammar, never on evaluation order,
+	// so any subtree can be regenerated or evaluated in parallel and still
+	// come out the same.
+	class Grammar
+	{
+	public:
+		static Grammar compile(const std::string& source);
+		static Grammar loadFromFile(const std::string& filename);
+
+		bool hasRule(const std::string& rule) const;
+		// Evaluate rule on shape, adding to its children
+		void apply(const std::string& rule, Shape* shape) const;
+
+		bool hasParam(const std::string& param) const;
+		float param(const std::string& param) const;
+		void setParam(const std::string& param, float value);
+
+	private:
+		// Code for all rules, each ending with a ret
+		std::vector<Instruction> code;
+		// Rule name to entry point in code
+		std::unordered_map<std::string, uint32_t> rules;
+		// Child names referenced by repeat, wrap and each
+		std::vector<std::string> names;
+		// Split elements referenced by subdivide, laid out to be passed straight to Shape::subdivide
+		std::vector<std::string> splitNames;
+		std::vector<SizePolicy> splitPolicies;
+		std::vector<int> splitMasks;
+		std::vector<uint32_t> splitSlots;
+		std::vector<uint32_t> expansionSlots;
+		std::vector<Choice> choices;
+		// Value slots, constants and parameters alike
+		std::vector<float> slots;
+		std::unordered_map<std::string, uint32_t> params;
+
+		void execute(uint32_t pc, Shape* shape, int depth) const;
+	};
+}
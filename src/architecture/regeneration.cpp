@@ -0,0 +1,168 @@
+#include "regeneration.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace architecture
+{
+	Regenerator::Regenerator(int numWorkers)
+	{
+		for (int i = 0; i < std::max(1, numWorkers); ++i)
+		{
+			workers.push_back(std::thread(&Regenerator::work, this));
+		}
+	}
+
+	Regenerator::~Regenerator()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			order.clear();
+			jobs.clear();
+		}
+		workAvailable.notify_all();
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+
+		for (Result& result : finished)
+		{
+			delete result.shape;
+		}
+	}
+
+	void Regenerator::work()
+	{
+		while (true)
+		{
+			CastlePart* part;
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				workAvailable.wait(lock, [this] { return stopping || !order.empty(); });
+				if (stopping) return;
+				part = order.front();
+				order.pop_front();
+				auto queued = jobs.find(part);
+				job = queued->second;
+				jobs.erase(queued);
+				++busyWorkers;
+			}
+
+			Shape* shape = nullptr;
+			try
+			{
+				shape = job.build();
+			}
+			catch (const std::exception&)
+			{
+				// A null result keeps the old shape
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				Result result = { part, job.generation, shape };
+				finished.push_back(result);
+				--busyWorkers;
+			}
+			idle.notify_all();
+		}
+	}
+
+	void Regenerator::request(CastlePart* part)
+	{
+		uint64_t generation = nextGeneration++;
+		// Whatever is in flight for a part at a reused address is older than this
+		if (shown.count(part) == 0) shown[part] = generation - 1;
+		latest[part] = generation;
+
+		Job job = { generation, part->shapeBuilder() };
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto queued = jobs.find(part);
+			if (queued != jobs.end()) queued->second = job;
+			else
+			{
+				jobs[part] = job;
+				order.push_back(part);
+			}
+		}
+		workAvailable.notify_one();
+	}
+
+	void Regenerator::forget(CastlePart* part)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (jobs.erase(part) != 0) order.erase(std::find(order.begin(), order.end(), part));
+		}
+		shown.erase(part);
+		latest.erase(part);
+	}
+
+	void Regenerator::update()
+	{
+		std::vector<Result> done;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done.swap(finished);
+		}
+
+		for (Result& result : done)
+		{
+			auto current = shown.find(result.part);
+			if (current == shown.end() || result.generation <= current->second)
+			{
+				delete result.shape;
+				continue;
+			}
+
+			if (result.shape != nullptr)
+			{
+				result.shape->upload();
+				result.part->replaceShape(result.shape);
+			}
+			current->second = result.generation;
+			if (result.generation == latest[result.part])
+			{
+				shown.erase(current);
+				latest.erase(result.part);
+			}
+		}
+	}
+
+	void Regenerator::drain()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this] { return order.empty() && busyWorkers == 0; });
+		}
+		update();
+	}
+
+	void Regenerator::clear()
+	{
+		std::vector<Result> done;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			order.clear();
+			jobs.clear();
+			idle.wait(lock, [this] { return busyWorkers == 0; });
+			done.swap(finished);
+		}
+
+		for (Result& result : done)
+		{
+			delete result.shape;
+		}
+		shown.clear();
+		latest.clear();
+	}
+
+	size_t Regenerator::pendingParts() const
+	{
+		return latest.size();
+	}
+}
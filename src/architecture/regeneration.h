@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <castle.h>
+
+namespace architecture
+{
+	// Rebuilds edited castle parts on worker threads.
+	//
+	// A request snapshots the part's parameters, so the part may keep changing
+	// while it is built. Requests for a part that has not been started yet are
+	// coalesced into the latest one. Finished shapes are uploaded and swapped in
+	// during update, the old shape keeps rendering until then. A result is only
+	// swapped in if it is newer than the part's current shape.
+	//
+	// The active grammar is read by the workers, call drain or clear before changing it.
+	class Regenerator
+	{
+	public:
+		Regenerator(int numWorkers = 1);
+		~Regenerator();
+
+		// Main thread only
+		void request(CastlePart* part);
+		// Drop pending and unfinished work for part, must be called before the part is deleted
+		void forget(CastlePart* part);
+		// Swap in finished shapes
+		void update();
+		// Wait for all requested work and swap in its shapes
+		void drain();
+		// Drop all work and wait for the workers to go idle
+		void clear();
+
+		// Parts waiting for or being rebuilt
+		size_t pendingParts() const;
+
+	private:
+		struct Job
+		{
+			uint64_t generation;
+			std::function<Shape*()> build;
+		};
+
+		struct Result
+		{
+			CastlePart* part;
+			uint64_t generation;
+			Shape* shape;
+		};
+
+		// Main thread state, generation of the shape each part currently shows
+		std::map<CastlePart*, uint64_t> shown;
+		std::map<CastlePart*, uint64_t> latest;
+		uint64_t nextGeneration = 1;
+
+		// Shared with the workers
+		std::mutex mutex;
+		std::condition_variable workAvailable;
+		std::condition_variable idle;
+		std::deque<CastlePart*> order;
+		std::map<CastlePart*, Job> jobs;
+		std::vector<Result> finished;
+		int busyWorkers = 0;
+		bool stopping = false;
+		std::vector<std::thread> workers;
+
+		void work();
+	};
+}
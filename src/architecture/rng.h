@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace architecture
+{
+	// Stateless counter-based random numbers. A value only depends on a key and a counter,
+	// so results do not depend on the order in which shapes are evaluated.
+	namespace rng
+	{
+		// The SplitMix64 finalizer, a bijective 64 bit mix
+		inline uint64_t mix(uint64_t x)
+		{
+			x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+			return x ^ (x >> 31);
+		}
+
+		inline uint64_t combine(uint64_t key, uint64_t value)
+		{
+			return mix(key ^ mix(value + 0x9e3779b97f4a7c15ULL));
+		}
+
+		// 64 bit FNV-1a
+		inline uint64_t hash(const std::string& value)
+		{
+			uint64_t result = 0xcbf29ce484222325ULL;
+			for (char c : value)
+			{
+				result ^= (unsigned char)c;
+				result *= 0x100000001b3ULL;
+			}
+			return result;
+		}
+
+		// Uniform value in [0, 1) for the given stream and counter
+		inline float uniform(uint64_t key, uint64_t counter)
+		{
+			return (combine(key, counter) >> 40) * (1.0f / 16777216.0f);
+		}
+	}
+}
@@ -1,9 +1,23 @@
 #include "castle.h"
+#include "rng.h"
+
+#include <cstddef>
 
 #include <glm/gtc/constants.hpp>
+#include <glm/gtc/packing.hpp>
 
 namespace architecture
 {
+	namespace
+	{
+		// Vertex of compact uploads
+		struct CompactVertex
+		{
+			glm::vec3 position;
+			uint32_t normal;
+		};
+	}
+
 	Shape::Shape(CoordSys coordSys, glm::vec2 bounds_[3]) : 
 		coordSys(coordSys),
 		parentChildOp(ParentChildOperator::none),
@@ -26,28 +40,32 @@ namespace architecture
 			delete childVec.second;
 		}
 
+#ifndef ARCHITECTURE_NO_GL
 		if (vao != 0) glDeleteVertexArrays(1, &vao);
 		if (positionBuffer != 0) glDeleteBuffers(1, &positionBuffer);
 		if (normalBuffer != 0) glDeleteBuffers(1, &normalBuffer);
+		if (vertexBuffer != 0) glDeleteBuffers(1, &vertexBuffer);
 		if (indexBuffer != 0) glDeleteBuffers(1, &indexBuffer);
+#endif
 	}
 
 	void Shape::init()
+	{
+		build();
+		upload();
+	}
+
+	void Shape::build()
 	{
 		for (auto& childCollection : children)
 		{
 			for (Shape* child : *childCollection.second)
 			{
-				child->init();
+				child->build();
 			}
 		}
 		if ((children.size() == 0) | (parentChildOp != ParentChildOperator::none) | (childChildOp == ChildChildOperator::intersect))
 		{
-			// Create a handle for the vertex array object
-			if (vao == 0) glGenVertexArrays(1, &vao);
-			// Set it as current, i.e., related calls will affect this object
-			glBindVertexArray(vao);
-
 			if (childChildOp == ChildChildOperator::intersect)
 			{
 				bool firstMesh = true;
@@ -269,26 +287,78 @@ namespace architecture
 					soup.indices.push_back(4 + 8 * numCircNodes + glm::ivec3(2, 1, 0));
 				}
 			}
+		}
+	}
+
+	void Shape::upload(bool compact)
+	{
+		for (auto& childCollection : children)
+		{
+			for (Shape* child : *childCollection.second)
+			{
+				child->upload(compact);
+			}
+		}
+		compactVertices = compact;
+#ifndef ARCHITECTURE_NO_GL
+		if ((children.size() == 0) | (parentChildOp != ParentChildOperator::none) | (childChildOp == ChildChildOperator::intersect))
+		{
+			// Create a handle for the vertex array object
+			if (vao == 0) glGenVertexArrays(1, &vao);
+			// Set it as current, i.e., related calls will affect this object
+			glBindVertexArray(vao);
 
-			// Create a handle for the vertex position buffer
-			if(positionBuffer == 0) glGenBuffers(1, &positionBuffer);
-			// Set the newly created buffer as the current one
-			glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-			// Send the vetex position data to the current buffer
-			glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * soup.positions.size(), soup.positions.data(), GL_STATIC_DRAW);
-			glVertexAttribPointer(0, 3, GL_FLOAT, false /*normalized*/, 0 /*stride*/, 0 /*offset*/);
-			// Enable the attribute
-			glEnableVertexAttribArray(0);
-
-			// Create a handle for the vertex position buffer
-			if (normalBuffer == 0) glGenBuffers(1, &normalBuffer);
-			// Set the newly created buffer as the current one
-			glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
-			// Send the vetex position data to the current buffer
-			glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * soup.normals.size(), soup.normals.data(), GL_STATIC_DRAW);
-			glVertexAttribPointer(1, 3, GL_FLOAT, false /*normalized*/, 0 /*stride*/, 0 /*offset*/);
-			// Enable the attribute
-			glEnableVertexAttribArray(1);
+			if (compact)
+			{
+				// Buffers of an earlier upload with the other layout
+				if (positionBuffer != 0) glDeleteBuffers(1, &positionBuffer);
+				if (normalBuffer != 0) glDeleteBuffers(1, &normalBuffer);
+				positionBuffer = normalBuffer = 0;
+
+				std::vector<CompactVertex> vertices(soup.positions.size());
+				for (size_t i = 0; i < vertices.size(); ++i)
+				{
+					glm::vec3 normal = soup.normals[i];
+					float length = glm::length(normal);
+					vertices[i].position = soup.positions[i];
+					vertices[i].normal = glm::packSnorm3x10_1x2(glm::vec4(length > 0 ? normal / length : normal, 0));
+				}
+
+				if (vertexBuffer == 0) glGenBuffers(1, &vertexBuffer);
+				glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+				glBufferData(GL_ARRAY_BUFFER, sizeof(CompactVertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+				glVertexAttribPointer(0, 3, GL_FLOAT, false /*normalized*/, sizeof(CompactVertex) /*stride*/, 0 /*offset*/);
+				glEnableVertexAttribArray(0);
+				// Read as a vec4 in [-1, 1], the shaders' vec3 input drops w
+				glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, true /*normalized*/, sizeof(CompactVertex) /*stride*/,
+				                      (const void*)offsetof(CompactVertex, normal) /*offset*/);
+				glEnableVertexAttribArray(1);
+			}
+			else
+			{
+				if (vertexBuffer != 0) glDeleteBuffers(1, &vertexBuffer);
+				vertexBuffer = 0;
+
+				// Create a handle for the vertex position buffer
+				if(positionBuffer == 0) glGenBuffers(1, &positionBuffer);
+				// Set the newly created buffer as the current one
+				glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+				// Send the vetex position data to the current buffer
+				glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * soup.positions.size(), soup.positions.data(), GL_STATIC_DRAW);
+				glVertexAttribPointer(0, 3, GL_FLOAT, false /*normalized*/, 0 /*stride*/, 0 /*offset*/);
+				// Enable the attribute
+				glEnableVertexAttribArray(0);
+
+				// Create a handle for the vertex position buffer
+				if (normalBuffer == 0) glGenBuffers(1, &normalBuffer);
+				// Set the newly created buffer as the current one
+				glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
+				// Send the vetex position data to the current buffer
+				glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * soup.normals.size(), soup.normals.data(), GL_STATIC_DRAW);
+				glVertexAttribPointer(1, 3, GL_FLOAT, false /*normalized*/, 0 /*stride*/, 0 /*offset*/);
+				// Enable the attribute
+				glEnableVertexAttribArray(1);
+			}
 
 			if (indexBuffer == 0) glGenBuffers(1, &indexBuffer);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
@@ -296,6 +366,62 @@ namespace architecture
 
 			numNodes = soup.indices.size() * 3;
 		}
+#endif
+	}
+
+	void Shape::collectTriangles(std::vector<glm::vec3>& triangles) const
+	{
+		if (childChildOp != ChildChildOperator::intersect)
+		{
+			for (auto& childCollection : children)
+			{
+				for (Shape* child : *childCollection.second)
+				{
+					child->collectTriangles(triangles);
+				}
+			}
+		}
+		if ((children.size() == 0) | (parentChildOp != ParentChildOperator::none) | (childChildOp == ChildChildOperator::intersect))
+		{
+			for (const glm::ivec3& triangle : soup.indices)
+			{
+				triangles.push_back(soup.positions[triangle[0]]);
+				triangles.push_back(soup.positions[triangle[1]]);
+				triangles.push_back(soup.positions[triangle[2]]);
+			}
+		}
+	}
+
+	size_t Shape::numShapes() const
+	{
+		size_t count = 1;
+		for (auto& childCollection : children)
+		{
+			for (Shape* child : *childCollection.second)
+			{
+				count += child->numShapes();
+			}
+		}
+		return count;
+	}
+
+	size_t Shape::memoryUsage() const
+	{
+		size_t usage = sizeof(Shape)
+			+ soup.positions.capacity() * sizeof(glm::vec3)
+			+ soup.normals.capacity() * sizeof(glm::vec3)
+			+ soup.indices.capacity() * sizeof(glm::ivec3);
+		// The GPU copy of the soup, counted before upload too so that it can be budgeted for
+		usage += soup.positions.size() * (compactVertices ? sizeof(CompactVertex) : 2 * sizeof(glm::vec3))
+			+ soup.indices.size() * sizeof(glm::ivec3);
+		for (auto& childCollection : children)
+		{
+			for (Shape* child : *childCollection.second)
+			{
+				usage += child->memoryUsage();
+			}
+		}
+		return usage;
 	}
 
 	void Shape::render()
@@ -310,6 +436,7 @@ namespace architecture
 				}
 			}
 		}
+#ifndef ARCHITECTURE_NO_GL
 		if ((children.size() == 0) | (parentChildOp != ParentChildOperator::none) | (childChildOp == ChildChildOperator::intersect))
 		{
 			if (childChildOp == ChildChildOperator::intersect)
@@ -320,22 +447,30 @@ namespace architecture
 			GLint current_program = 0;
 
 			glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+			// Set every material uniform, models drawn earlier leave theirs behind
 			glm::vec3 m_color(0.61, 0.56, 0.52);
 			float m_fresnel = 0.5;
+			float m_zero = 0.0f;
+			glUniform1i(glGetUniformLocation(current_program, "has_color_texture"), 0);
 			glUniform3fv(glGetUniformLocation(current_program, "material_color"), 1, &m_color.x);
 			glUniform1fv(glGetUniformLocation(current_program, "material_fresnel"), 1, &m_fresnel);
+			glUniform1fv(glGetUniformLocation(current_program, "material_reflectivity"), 1, &m_zero);
+			glUniform1fv(glGetUniformLocation(current_program, "material_metalness"), 1, &m_zero);
+			glUniform1fv(glGetUniformLocation(current_program, "material_shininess"), 1, &m_zero);
+			glUniform1fv(glGetUniformLocation(current_program, "material_emission"), 1, &m_zero);
 			glDrawElements(GL_TRIANGLES, numNodes, GL_UNSIGNED_INT, 0);
 		}
+#endif
 	}
 
-	void Shape::subdivide(int axis, std::string names[], SizePolicy policies[], float sizeVals[], size_t numSubEl)
+	void Shape::subdivide(int axis, const std::string names[], const SizePolicy policies[], const float sizeVals[], size_t numSubEl)
 	{
 		std::vector<int> mask(numSubEl, 1);
 		subdivide(axis, names, policies, sizeVals, numSubEl, mask.data());
 	}
 
 	// Subdivision where subshapes can me masked away
-	void Shape::subdivide(int axis, std::string names[], SizePolicy policies[], float sizeVals[], size_t numSubEl, int mask[])
+	void Shape::subdivide(int axis, const std::string names[], const SizePolicy policies[], const float sizeVals[], size_t numSubEl, const int mask[])
 	{
 		glm::vec2 newBounds[3];
 		newBounds[0] = bounds[0];
@@ -383,7 +518,7 @@ namespace architecture
 				newBounds[axis] = glm::vec2(newBounds[axis][1], newBounds[axis][1] + sizeVals[i] * relScale);
 			}
 
-			if (mask[i]) children[names[i]]->push_back(new Shape(coordSys, newBounds));
+			if (mask[i]) addChild(children[names[i]], names[i], coordSys, newBounds);
 		}
 	}
 
@@ -432,7 +567,7 @@ namespace architecture
 			{
 				newBounds[axis] = glm::vec2(newBounds[axis][1], newBounds[axis][1] + (scale * sizeVal));
 
-				children[name]->push_back(new Shape(coordSys, newBounds));
+				addChild(children[name], name, coordSys, newBounds);
 			}
 
 			if (scale * nativePaddingVal > 0.0001 && paddingMask)
@@ -454,7 +589,7 @@ namespace architecture
 							break;
 					}
 
-					children["Padding"]->push_back(new Shape(coordSys, lowerPaddingBounds));
+					addChild(children["Padding"], "Padding", coordSys, lowerPaddingBounds);
 				}
 
 				if (paddingType == PaddingType::high || paddingType == PaddingType::balance)
@@ -474,7 +609,7 @@ namespace architecture
 							break;
 					}
 
-					children["Padding"]->push_back(new Shape(coordSys, upperPaddingBounds));
+					addChild(children["Padding"], "Padding", coordSys, upperPaddingBounds);
 				}
 			}
 		}
@@ -488,7 +623,7 @@ namespace architecture
 			{
 				newBounds[axis] = glm::vec2(newBounds[axis][1], newBounds[axis][1] + sizeVal * parentSize);
 
-				children[name]->push_back(new Shape(coordSys, newBounds));
+				addChild(children[name], name, coordSys, newBounds);
 			}
 
 			if (paddingVal * parentSize > 0.0001)
@@ -500,7 +635,7 @@ namespace architecture
 
 				lowerPaddingBounds[axis][1] = lowerPaddingBounds[axis][0] + paddingVal / 2.0f * parentSize;
 
-				children["Padding"]->push_back(new Shape(coordSys, lowerPaddingBounds));
+				addChild(children["Padding"], "Padding", coordSys, lowerPaddingBounds);
 
 				glm::vec2 upperPaddingBounds[3];
 				upperPaddingBounds[0] = bounds[0];
@@ -509,7 +644,7 @@ namespace architecture
 
 				upperPaddingBounds[axis][0] = upperPaddingBounds[axis][1] - paddingVal / 2.0f * parentSize;
 
-				children["Padding"]->push_back(new Shape(coordSys, upperPaddingBounds));
+				addChild(children["Padding"], "Padding", coordSys, upperPaddingBounds);
 			}
 		}
 	}
@@ -541,7 +676,16 @@ namespace architecture
 									glm::vec2(-oneSideYBounds, oneSideYBounds),
 									bounds[2] };
 
-		children[name]->push_back(new Shape(wrapSys, wrapBounds));
+		addChild(children[name], name, wrapSys, wrapBounds);
+	}
+
+	Shape* Shape::addChild(std::vector<Shape*>* list, const std::string& name, const CoordSys& childCoordSys, glm::vec2 childBounds[3])
+	{
+		Shape* child = new Shape(childCoordSys, childBounds);
+		// The key only depends on the path from the root, not on the order shapes are evaluated in
+		child->pathKey = rng::combine(rng::combine(pathKey, rng::hash(name)), list->size());
+		list->push_back(child);
+		return child;
 	}
 
 	void Shape::adjustPhiBounds()
@@ -563,7 +707,7 @@ namespace architecture
 			// Rescale inner arc size to radians
 			scale = 1.0 / bounds[0][0];
 		}
-		if (policy == SizePolicy::absoluteOuter &&
+		else if (policy == SizePolicy::absoluteOuter &&
 			coordSys.type == CoordSysType::cylindrical &&
 			axis == 1)
 		{
@@ -2,8 +2,17 @@
 
 #include <vector>
 #include <unordered_map>
+#include <string>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
 
+#ifndef ARCHITECTURE_NO_GL
 #include <GL/glew.h>
+#else
+// Built without GL, the handles stay 0 and upload and render do nothing
+typedef unsigned int GLuint;
+#endif
 #include <glm/glm.hpp>
 
 #include <boolean3d.h>
@@ -55,6 +64,10 @@ namespace architecture
 
 		boolean3d::PolygonSoup soup;
 
+		// Identifies the shape by its path of child names and indices from the root, whose key is
+		// the seed. Used as the random stream for stochastic rules on this shape.
+		uint64_t pathKey = 0;
+
 	private:
 		// The vertex array object
 		GLuint vao = 0;
@@ -63,26 +76,215 @@ namespace architecture
 		// Buffer locations
 		GLuint positionBuffer = 0;
 		GLuint normalBuffer = 0;
+		// Positions and packed normals of compact uploads
+		GLuint vertexBuffer = 0;
 		GLuint indexBuffer = 0;
+		// Layout of the last upload, or of the next one before that
+		bool compactVertices = true;
 
 	public:
 
 		Shape(CoordSys coordSys, glm::vec2 bounds[3]);
 		~Shape();
 
+		// Build geometry and upload it, same as build followed by upload
 		void init();
+		// Build the geometry of the shape tree. Makes no GL calls, so it may run on any thread
+		void build();
+		// Upload built geometry to the GPU, must run on the thread owning the GL context.
+		// Compact vertices interleave positions with normals packed as 10:10:10:2, 16 instead
+		// of 24 bytes per vertex, otherwise positions and normals get a float buffer each.
+		void upload(bool compact = true);
 		void render();
+		// Approximate bytes held by the shape tree once uploaded, on the CPU and on the GPU
+		size_t memoryUsage() const;
+		// Append the triangles that render draws, three positions each
+		void collectTriangles(std::vector<glm::vec3>& triangles) const;
+		// Number of shapes in the tree, this one included
+		size_t numShapes() const;
 
 		// Operators
-		void subdivide(int axis, std::string names[], SizePolicy policies[], float sizeVals[], size_t numSubEl);
-		void subdivide(int axis, std::string names[], SizePolicy policies[], float sizeVals[], size_t numSubEl, int mask[]);
+		void subdivide(int axis, const std::string names[], const SizePolicy policies[], const float sizeVals[], size_t numSubEl);
+		void subdivide(int axis, const std::string names[], const SizePolicy policies[], const float sizeVals[], size_t numSubEl, const int mask[]);
 		void repeat(int axis, std::string name, SizePolicy policy, float sizeVal, int paddingMask = true, PaddingType paddingType = PaddingType::balance);
 		void boundsExpand(glm::vec2 boundExpansions[3]);
 		void wrapCartesianOverCylindrical(std::string name);
 
+		// Operators with axis, coordinate system type and size policies fixed at compile time.
+		// They give the same result as the generic operators but compile to straight-line code,
+		// meant for hot rules where the split layout never changes.
+		template <int axis, CoordSysType type, SizePolicy... policies>
+		void subdivide(const std::string (&names)[sizeof...(policies)], const float (&sizeVals)[sizeof...(policies)]);
+		template <int axis, CoordSysType type, SizePolicy... policies>
+		void subdivide(const std::string (&names)[sizeof...(policies)], const float (&sizeVals)[sizeof...(policies)], const int (&mask)[sizeof...(policies)]);
+		template <int axis, CoordSysType type, SizePolicy policy, PaddingType paddingType = PaddingType::balance>
+		void repeat(const std::string& name, float sizeVal, int paddingMask = true);
+
 	private:
 		// Utility functions
+		Shape* addChild(std::vector<Shape*>* list, const std::string& name, const CoordSys& childCoordSys, glm::vec2 childBounds[3]);
 		void adjustPhiBounds();
 		float absoluteRescaling(int axis, SizePolicy policy);
 	};
-}
\ No newline at end of file
+
+	namespace detail
+	{
+		// Compile time version of Shape::absoluteRescaling
+		template <CoordSysType type, int axis, SizePolicy policy>
+		struct AbsoluteRescaling
+		{
+			static float scale(const glm::vec2 bounds[3]) { return 1.0f; }
+		};
+
+		// Rescale inner arc size to radians
+		template <>
+		struct AbsoluteRescaling<CoordSysType::cylindrical, 1, SizePolicy::absoluteInner>
+		{
+			static float scale(const glm::vec2 bounds[3]) { return 1.0f / bounds[0][0]; }
+		};
+
+		// Rescale outer arc size to radians
+		template <>
+		struct AbsoluteRescaling<CoordSysType::cylindrical, 1, SizePolicy::absoluteOuter>
+		{
+			static float scale(const glm::vec2 bounds[3]) { return 1.0f / bounds[0][1]; }
+		};
+
+		inline std::vector<Shape*>* childList(std::unordered_map<std::string, std::vector<Shape*>*>& children, const std::string& name)
+		{
+			std::vector<Shape*>*& list = children[name];
+			if (list == nullptr) list = new std::vector<Shape*>();
+			return list;
+		}
+	}
+
+	template <int axis, CoordSysType type, SizePolicy... policies>
+	void Shape::subdivide(const std::string (&names)[sizeof...(policies)], const float (&sizeVals)[sizeof...(policies)])
+	{
+		int mask[sizeof...(policies)];
+		for (int& m : mask) m = 1;
+		subdivide<axis, type, policies...>(names, sizeVals, mask);
+	}
+
+	template <int axis, CoordSysType type, SizePolicy... policies>
+	void Shape::subdivide(const std::string (&names)[sizeof...(policies)], const float (&sizeVals)[sizeof...(policies)], const int (&mask)[sizeof...(policies)])
+	{
+		static_assert(axis >= 0 && axis < 3, "Invalid split axis");
+		static_assert(sizeof...(policies) > 0, "Empty subdivision");
+		const size_t numSubEl = sizeof...(policies);
+
+		if (coordSys.type != type) throw std::invalid_argument("Coordinate system type does not match subdivision");
+
+		// Policies are known here, so the rescaling is done once per element and the policy tests fold away
+		const bool isRelative[numSubEl] = { (policies == SizePolicy::relative)... };
+		const float scales[numSubEl] = { detail::AbsoluteRescaling<type, axis, policies>::scale(bounds)... };
+
+		std::vector<Shape*>* childLists[numSubEl];
+		for (size_t i = 0; i < numSubEl; ++i) childLists[i] = detail::childList(children, names[i]);
+
+		float absSum = 0;
+		float relSum = 0;
+		for (size_t i = 0; i < numSubEl; ++i)
+		{
+			if (isRelative[i]) relSum += sizeVals[i];
+			else absSum += scales[i] * sizeVals[i];
+		}
+
+		float parentSize = bounds[axis][1] - bounds[axis][0];
+		float relScale = (parentSize - absSum) / relSum;
+
+		glm::vec2 newBounds[3] = { bounds[0], bounds[1], bounds[2] };
+		newBounds[axis][1] = newBounds[axis][0];
+		for (size_t i = 0; i < numSubEl; ++i)
+		{
+			float size = isRelative[i] ? sizeVals[i] * relScale : scales[i] * sizeVals[i];
+			newBounds[axis] = glm::vec2(newBounds[axis][1], newBounds[axis][1] + size);
+
+			if (mask[i]) addChild(childLists[i], names[i], coordSys, newBounds);
+		}
+	}
+
+	template <int axis, CoordSysType type, SizePolicy policy, PaddingType paddingType>
+	void Shape::repeat(const std::string& name, float sizeVal, int paddingMask /*= true*/)
+	{
+		static_assert(axis >= 0 && axis < 3, "Invalid repeat axis");
+
+		if (coordSys.type != type) throw std::invalid_argument("Coordinate system type does not match repetition");
+
+		std::vector<Shape*>* repeatList = detail::childList(children, name);
+		std::vector<Shape*>* paddingList = detail::childList(children, "Padding");
+
+		float parentSize = bounds[axis][1] - bounds[axis][0];
+		glm::vec2 newBounds[3] = { bounds[0], bounds[1], bounds[2] };
+
+		if (policy != SizePolicy::relative)
+		{
+			float scale = detail::AbsoluteRescaling<type, axis, policy>::scale(bounds);
+			float step = scale * sizeVal;
+
+			float nativePaddingVal;
+			if (step > parentSize) nativePaddingVal = parentSize / 2.0f;
+			else nativePaddingVal = fmod(parentSize, step) / 2.0f;
+
+			size_t numSubEl = (int)floor(parentSize / step);
+
+			float lowPadding = paddingType == PaddingType::low ? 2 * nativePaddingVal : nativePaddingVal;
+			float highPadding = paddingType == PaddingType::high ? 2 * nativePaddingVal : nativePaddingVal;
+
+			if (paddingType == PaddingType::high) newBounds[axis][1] = newBounds[axis][0];
+			else newBounds[axis][1] = newBounds[axis][0] + lowPadding;
+
+			for (size_t i = 0; i < numSubEl; i++)
+			{
+				newBounds[axis] = glm::vec2(newBounds[axis][1], newBounds[axis][1] + step);
+
+				addChild(repeatList, name, coordSys, newBounds);
+			}
+
+			if (scale * nativePaddingVal > 0.0001 && paddingMask)
+			{
+				if (paddingType != PaddingType::high)
+				{
+					glm::vec2 lowerPaddingBounds[3] = { bounds[0], bounds[1], bounds[2] };
+					lowerPaddingBounds[axis][1] = lowerPaddingBounds[axis][0] + lowPadding;
+
+					addChild(paddingList, "Padding", coordSys, lowerPaddingBounds);
+				}
+
+				if (paddingType != PaddingType::low)
+				{
+					glm::vec2 upperPaddingBounds[3] = { bounds[0], bounds[1], bounds[2] };
+					upperPaddingBounds[axis][0] = upperPaddingBounds[axis][1] - highPadding;
+
+					addChild(paddingList, "Padding", coordSys, upperPaddingBounds);
+				}
+			}
+		}
+		else
+		{
+			float paddingVal = fmod(1, sizeVal);
+
+			size_t numSubEl = (int)floor(1.0f / sizeVal);
+			newBounds[axis][1] = newBounds[axis][0];
+			for (size_t i = 0; i < numSubEl; i++)
+			{
+				newBounds[axis] = glm::vec2(newBounds[axis][1], newBounds[axis][1] + sizeVal * parentSize);
+
+				addChild(repeatList, name, coordSys, newBounds);
+			}
+
+			if (paddingVal * parentSize > 0.0001)
+			{
+				glm::vec2 lowerPaddingBounds[3] = { bounds[0], bounds[1], bounds[2] };
+				lowerPaddingBounds[axis][1] = lowerPaddingBounds[axis][0] + paddingVal / 2.0f * parentSize;
+
+				addChild(paddingList, "Padding", coordSys, lowerPaddingBounds);
+
+				glm::vec2 upperPaddingBounds[3] = { bounds[0], bounds[1], bounds[2] };
+				upperPaddingBounds[axis][0] = upperPaddingBounds[axis][1] - paddingVal / 2.0f * parentSize;
+
+				addChild(paddingList, "Padding", coordSys, upperPaddingBounds);
+			}
+		}
+	}
+}
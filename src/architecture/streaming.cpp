@@ -0,0 +1,315 @@
+#include "streaming.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <glm/gtc/constants.hpp>
+
+#include "rng.h"
+
+namespace architecture
+{
+	std::vector<std::vector<glm::vec3>> fortLayout(int tileX, int tileZ, float tileSize, uint64_t seed)
+	{
+		std::vector<std::vector<glm::vec3>> chains;
+
+		uint64_t key = rng::combine(rng::combine(rng::combine(seed, rng::hash("fortLayout")), (uint64_t)tileX), (uint64_t)tileZ);
+		if (rng::uniform(key, 0) > 0.6f) return chains;
+
+		// An open ring of towers around the tile centre, small enough to keep the towers inside the tile
+		glm::vec3 centre((tileX + 0.5f) * tileSize, 0, (tileZ + 0.5f) * tileSize);
+		float radius = tileSize * (0.2f + 0.12f * rng::uniform(key, 1));
+		int numTowers = 4 + int(3 * rng::uniform(key, 2));
+		float start = glm::two_pi<float>() * rng::uniform(key, 3);
+		float arc = glm::two_pi<float>() * (0.6f + 0.3f * rng::uniform(key, 4));
+
+		std::vector<glm::vec3> chain(numTowers);
+		for (int i = 0; i < numTowers; ++i)
+		{
+			float angle = start + arc * i / (numTowers - 1);
+			float nodeRadius = radius * (0.85f + 0.3f * rng::uniform(key, 5 + i));
+			chain[i] = centre + nodeRadius * glm::vec3(cos(angle), 0, sin(angle));
+		}
+		chains.push_back(chain);
+
+		return chains;
+	}
+
+	CastleStreamer::Tile::~Tile()
+	{
+		for (CastlePart* part : parts)
+		{
+			delete part;
+		}
+	}
+
+	CastleStreamer::CastleStreamer(TileLayout layout, float tileSize, uint64_t seed, int numWorkers) :
+		layout(layout),
+		tileSize(tileSize),
+		seed(seed),
+		cameraTile(0, 0)
+	{
+		if (numWorkers <= 0) numWorkers = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+		for (int i = 0; i < numWorkers; ++i)
+		{
+			workers.push_back(std::thread(&CastleStreamer::work, this));
+		}
+	}
+
+	CastleStreamer::~CastleStreamer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			pending.clear();
+		}
+		workAvailable.notify_all();
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+
+		for (Tile* tile : finished)
+		{
+			delete tile;
+		}
+		for (auto& tile : resident)
+		{
+			delete tile.second;
+		}
+	}
+
+	void CastleStreamer::work()
+	{
+		while (true)
+		{
+			TileKey key;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				workAvailable.wait(lock, [this] { return stopping || !pending.empty(); });
+				if (stopping) return;
+				key = pending.front();
+				pending.pop_front();
+				++busyWorkers;
+			}
+
+			Tile* tile = new Tile();
+			tile->key = key;
+			try
+			{
+				generateTile(*tile);
+			}
+			catch (const std::exception&)
+			{
+				tile->failed = true;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.push_back(tile);
+				--busyWorkers;
+			}
+			idle.notify_all();
+		}
+	}
+
+	void CastleStreamer::generateTile(Tile& tile) const
+	{
+		for (auto& chain : layout(tile.key.first, tile.key.second, tileSize, seed))
+		{
+			if (chain.empty()) continue;
+			std::vector<CastlePart*> parts = makeWalls(chain.data(), chain.size());
+			tile.parts.insert(tile.parts.end(), parts.begin(), parts.end());
+		}
+
+		uint64_t tileSeed = rng::combine(rng::combine(seed, (uint64_t)tile.key.first), (uint64_t)tile.key.second);
+		for (size_t i = 0; i < tile.parts.size(); ++i)
+		{
+			tile.parts[i]->seed = rng::combine(tileSeed, i);
+			tile.parts[i]->generate();
+			tile.memoryUsage += tile.parts[i]->memoryUsage();
+		}
+	}
+
+	int CastleStreamer::distance(TileKey key) const
+	{
+		return std::max(std::abs(key.first - cameraTile.first), std::abs(key.second - cameraTile.second));
+	}
+
+	void CastleStreamer::evict(std::map<TileKey, Tile*>::iterator tile)
+	{
+		residentMemory -= tile->second->memoryUsage;
+		delete tile->second;
+		resident.erase(tile);
+	}
+
+	void CastleStreamer::update(glm::vec3 cameraPosition)
+	{
+		cameraTile = TileKey((int)floor(cameraPosition.x / tileSize), (int)floor(cameraPosition.z / tileSize));
+
+		// Upload generated tiles that are still wanted
+		std::vector<Tile*> done;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done.swap(finished);
+		}
+		int uploads = 0;
+		for (Tile* tile : done)
+		{
+			if (tile->failed)
+			{
+				// Deleting parts touches the regenerator and dirty list, which belong to this thread.
+				// The empty tile stays resident so that it is not requested over and over.
+				for (CastlePart* part : tile->parts)
+				{
+					delete part;
+				}
+				tile->parts.clear();
+				tile->memoryUsage = 0;
+				tile->failed = false;
+			}
+			if (distance(tile->key) > loadRadius)
+			{
+				requested.erase(tile->key);
+				delete tile;
+				continue;
+			}
+			if (uploads == maxUploadsPerUpdate)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.push_back(tile);
+				continue;
+			}
+
+			// Make room by evicting tiles farther away than this one
+			while (residentMemory + tile->memoryUsage > memoryBudget)
+			{
+				auto farthest = std::max_element(resident.begin(), resident.end(),
+					[this](const std::pair<const TileKey, Tile*>& a, const std::pair<const TileKey, Tile*>& b) { return distance(a.first) < distance(b.first); });
+				if (farthest == resident.end() || distance(farthest->first) <= distance(tile->key)) break;
+				rejected[farthest->first] = farthest->second->memoryUsage;
+				evict(farthest);
+			}
+
+			requested.erase(tile->key);
+			if (residentMemory + tile->memoryUsage > memoryBudget)
+			{
+				rejected[tile->key] = tile->memoryUsage;
+				delete tile;
+				continue;
+			}
+
+			for (CastlePart* part : tile->parts)
+			{
+				part->upload();
+			}
+			resident[tile->key] = tile;
+			residentMemory += tile->memoryUsage;
+			++uploads;
+		}
+
+		// Evict distant tiles, and the farthest ones while over budget (the budget may have been lowered)
+		for (auto tile = resident.begin(); tile != resident.end();)
+		{
+			auto current = tile++;
+			if (distance(current->first) > unloadRadius) evict(current);
+		}
+		while (residentMemory > memoryBudget && !resident.empty())
+		{
+			auto farthest = std::max_element(resident.begin(), resident.end(),
+				[this](const std::pair<const TileKey, Tile*>& a, const std::pair<const TileKey, Tile*>& b) { return distance(a.first) < distance(b.first); });
+			rejected[farthest->first] = farthest->second->memoryUsage;
+			evict(farthest);
+		}
+		// Rejected tiles are tried again once they would fit
+		for (auto tile = rejected.begin(); tile != rejected.end();)
+		{
+			if (distance(tile->first) > loadRadius || residentMemory + tile->second <= memoryBudget) tile = rejected.erase(tile);
+			else ++tile;
+		}
+
+		// Request missing tiles, nearest first
+		std::vector<TileKey> wanted;
+		for (int dz = -loadRadius; dz <= loadRadius; ++dz)
+		{
+			for (int dx = -loadRadius; dx <= loadRadius; ++dx)
+			{
+				TileKey key(cameraTile.first + dx, cameraTile.second + dz);
+				if (resident.count(key) == 0 && requested.count(key) == 0 && rejected.count(key) == 0)
+				{
+					wanted.push_back(key);
+				}
+			}
+		}
+		TileKey centre = cameraTile;
+		auto nearer = [centre](const TileKey& a, const TileKey& b)
+		{
+			int da = (a.first - centre.first) * (a.first - centre.first) + (a.second - centre.second) * (a.second - centre.second);
+			int db = (b.first - centre.first) * (b.first - centre.first) + (b.second - centre.second) * (b.second - centre.second);
+			return da < db;
+		};
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			// Tiles that left the load radius before a worker got to them are dropped
+			for (auto key = pending.begin(); key != pending.end();)
+			{
+				if (distance(*key) > loadRadius)
+				{
+					requested.erase(*key);
+					key = pending.erase(key);
+				}
+				else ++key;
+			}
+			for (const TileKey& key : wanted)
+			{
+				pending.push_back(key);
+				requested.insert(key);
+			}
+			std::sort(pending.begin(), pending.end(), nearer);
+		}
+		if (!wanted.empty()) workAvailable.notify_all();
+	}
+
+	void CastleStreamer::render(const std::function<void(const glm::mat4&)>& setModelMatrix)
+	{
+		for (auto& tile : resident)
+		{
+			for (CastlePart* part : tile.second->parts)
+			{
+				setModelMatrix(part->modelMatrix());
+				part->render();
+			}
+		}
+	}
+
+	void CastleStreamer::clear()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			pending.clear();
+			idle.wait(lock, [this] { return busyWorkers == 0; });
+			for (Tile* tile : finished)
+			{
+				delete tile;
+			}
+			finished.clear();
+		}
+
+		for (auto& tile : resident)
+		{
+			delete tile.second;
+		}
+		resident.clear();
+		requested.clear();
+		rejected.clear();
+		residentMemory = 0;
+	}
+
+	CastleStreamer::Stats CastleStreamer::stats() const
+	{
+		Stats result = { resident.size(), requested.size(), residentMemory };
+		return result;
+	}
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <glm/glm.hpp>
+
+#include <castle.h>
+
+namespace architecture
+{
+	// Wall node chains of one tile, each chain becomes a row of towers and connecting walls
+	typedef std::function<std::vector<std::vector<glm::vec3>>(int tileX, int tileZ, float tileSize, uint64_t seed)> TileLayout;
+
+	// A scattered fort or nothing per tile, kept clear of the tile borders. The same seed always gives the same world.
+	std::vector<std::vector<glm::vec3>> fortLayout(int tileX, int tileZ, float tileSize, uint64_t seed);
+
+	// Generates castle parts tile by tile around the camera.
+	//
+	// Tiles within loadRadius are generated on worker threads and uploaded on
+	// the main thread during update, nearest first. Tiles beyond unloadRadius
+	// are evicted, and so are the farthest tiles whenever the resident parts
+	// exceed the memory budget. Tiles are regenerated from their seed when the
+	// camera returns.
+	//
+	// The active grammar is read by the workers, call clear before changing it.
+	class CastleStreamer
+	{
+	public:
+		struct Stats
+		{
+			size_t residentTiles;
+			size_t pendingTiles;
+			size_t memoryUsage;
+		};
+
+		// Tiles are squares of tileSize in the xz plane
+		CastleStreamer(TileLayout layout, float tileSize, uint64_t seed, int numWorkers = 0);
+		~CastleStreamer();
+
+		// Radii in tiles
+		int loadRadius = 2;
+		int unloadRadius = 3;
+		size_t memoryBudget = 512 * 1024 * 1024;
+		// Generated tiles uploaded per update, bounds the time spent on the main thread
+		int maxUploadsPerUpdate = 2;
+
+		// Request, upload and evict tiles for the camera position. Main thread only.
+		void update(glm::vec3 cameraPosition);
+		// Draw every resident part, calling setModelMatrix with its placement first
+		void render(const std::function<void(const glm::mat4&)>& setModelMatrix);
+		// Drop all tiles and wait for the workers to go idle
+		void clear();
+
+		Stats stats() const;
+
+	private:
+		typedef std::pair<int, int> TileKey;
+
+		struct Tile
+		{
+			TileKey key;
+			std::vector<CastlePart*> parts;
+			size_t memoryUsage = 0;
+			// Generating threw, the parts are freed on the main thread
+			bool failed = false;
+
+			~Tile();
+		};
+
+		TileLayout layout;
+		float tileSize;
+		uint64_t seed;
+
+		// Main thread state
+		std::map<TileKey, Tile*> resident;
+		// Tiles that did not fit in the budget and their memory usage, not requested again
+		// until they leave the load radius or that much memory is available
+		std::map<TileKey, size_t> rejected;
+		// Pending or being generated
+		std::set<TileKey> requested;
+		size_t residentMemory = 0;
+		TileKey cameraTile;
+
+		// Shared with the workers
+		std::mutex mutex;
+		std::condition_variable workAvailable;
+		std::condition_variable idle;
+		std::deque<TileKey> pending;
+		std::vector<Tile*> finished;
+		int busyWorkers = 0;
+		bool stopping = false;
+		std::vector<std::thread> workers;
+
+		void work();
+		void generateTile(Tile& tile) const;
+		void evict(std::map<TileKey, Tile*>::iterator tile);
+		int distance(TileKey key) const;
+	};
+}
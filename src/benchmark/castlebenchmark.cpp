@@ -0,0 +1,225 @@
+// Times the castle rules and CSG on castles of growing size, without a GL context.
+// Each case is run a number of times and the fastest run is reported, along with the
+// shapes, triangles and heap allocations of that run. The rule cases include building
+// the geometry of the generated shape trees.
+// Usage: castlebenchmark [max number of towers] [repetitions] [grammar file]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <castle.h>
+#include <grammar.h>
+#include <boolean3d.h>
+
+using architecture::Shape;
+using architecture::CastlePart;
+using architecture::CoordSys;
+using architecture::CoordSysType;
+
+namespace
+{
+	std::atomic<size_t> heapAllocations(0);
+}
+
+void* operator new(size_t size)
+{
+	++heapAllocations;
+	void* memory = malloc(size == 0 ? 1 : size);
+	if (memory == nullptr) throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+namespace
+{
+	const float towerRadius = 20;
+	const float towerHeight = 40;
+	const float wallThickness = 3;
+
+	// Time and allocations are only counted between start and stop, counting the
+	// results and deleting them happen outside
+	struct Run
+	{
+		size_t shapes = 0;
+		size_t triangles = 0;
+		size_t allocations = 0;
+		double milliseconds = 0;
+
+		void start()
+		{
+			allocationsAtStart = heapAllocations;
+			startTime = std::chrono::high_resolution_clock::now();
+		}
+
+		void stop()
+		{
+			milliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+			allocations += heapAllocations - allocationsAtStart;
+		}
+
+		void count(const Shape* shape)
+		{
+			std::vector<glm::vec3> shapeTriangles;
+			shape->collectTriangles(shapeTriangles);
+			shapes += shape->numShapes();
+			triangles += shapeTriangles.size() / 3;
+		}
+
+	private:
+		size_t allocationsAtStart = 0;
+		std::chrono::high_resolution_clock::time_point startTime;
+	};
+
+	// Towers on a circle, far enough apart for walls between them
+	std::vector<glm::vec3> castleNodes(int numTowers)
+	{
+		float circleRadius = glm::max(100.0f, numTowers * 6 * towerRadius / (2 * glm::pi<float>()));
+		std::vector<glm::vec3> nodes;
+		for (int i = 0; i < numTowers; ++i)
+		{
+			float angle = 2 * glm::pi<float>() * i / numTowers;
+			nodes.push_back(circleRadius * glm::vec3(cos(angle), 0, sin(angle)));
+		}
+		return nodes;
+	}
+
+	void towers(const std::vector<glm::vec3>& nodes, Run& run)
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			run.start();
+			Shape* tower = architecture::makeTower(nodes[i], towerHeight, towerRadius, i);
+			tower->build();
+			run.stop();
+			run.count(tower);
+			delete tower;
+		}
+	}
+
+	void walls(const std::vector<glm::vec3>& nodes, Run& run)
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			glm::vec3 next = nodes[(i + 1) % nodes.size()];
+			glm::vec3 direction = glm::normalize(next - nodes[i]);
+			run.start();
+			Shape* wall = architecture::makeWall(nodes[i] + towerRadius * direction, next - towerRadius * direction, towerHeight, i);
+			wall->build();
+			run.stop();
+			run.count(wall);
+			delete wall;
+		}
+	}
+
+	// A chain of towers joined by walls, with the towers cut open for their connectors
+	void castle(const std::vector<glm::vec3>& nodes, Run& run)
+	{
+		std::vector<glm::vec3> chain(nodes);
+		run.start();
+		std::vector<CastlePart*> parts = architecture::makeWalls(chain.data(), chain.size());
+		for (CastlePart* part : parts)
+		{
+			part->generate();
+		}
+		run.stop();
+		for (CastlePart* part : parts)
+		{
+			std::vector<glm::vec3> partTriangles;
+			part->collectTriangles(partTriangles);
+			run.shapes += part->numShapes();
+			run.triangles += partTriangles.size() / 3;
+		}
+		// Walls read their towers until deleted, so they go first
+		for (size_t i = parts.size(); i-- > 0;)
+		{
+			delete parts[i];
+		}
+	}
+
+	// Intersect each tower body with a slab of wall running through it, as where a wall meets a tower
+	void intersections(const std::vector<glm::vec3>& nodes, Run& run)
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			CoordSys towerCoordSys = { CoordSysType::cylindrical, nodes[i], { glm::vec3(0, 0, 1), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0) } };
+			glm::vec2 towerBounds[3] = { glm::vec2(0, towerRadius), glm::vec2(0, 2 * glm::pi<float>() - 0.0001f), glm::vec2(0, towerHeight) };
+			Shape tower(towerCoordSys, towerBounds);
+
+			glm::vec3 direction = glm::normalize(nodes[(i + 1) % nodes.size()] - nodes[i]);
+			CoordSys wallCoordSys = { CoordSysType::cartesian, nodes[i], { direction, glm::vec3(0, 1, 0), glm::cross(direction, glm::vec3(0, 1, 0)) } };
+			glm::vec2 wallBounds[3] = { glm::vec2(-2 * towerRadius, 2 * towerRadius), glm::vec2(0, towerHeight / 2), glm::vec2(-wallThickness, wallThickness) };
+			Shape wall(wallCoordSys, wallBounds);
+
+			tower.build();
+			wall.build();
+			run.start();
+			boolean3d::Mesh result = boolean3d::intersect(boolean3d::toMesh(tower.soup), boolean3d::toMesh(wall.soup));
+			run.stop();
+			run.shapes += 2;
+			run.triangles += result.size();
+		}
+	}
+
+	void benchmark(const char* name, void (*operation)(const std::vector<glm::vec3>&, Run&), int numTowers, int repetitions)
+	{
+		std::vector<glm::vec3> nodes = castleNodes(numTowers);
+		Run fastest;
+		for (int i = 0; i < repetitions; ++i)
+		{
+			Run run;
+			operation(nodes, run);
+			if (i == 0 || run.milliseconds < fastest.milliseconds) fastest = run;
+		}
+
+		printf("%6d  %-10s %9zu %10zu %12zu %10.2f\n", numTowers, name, fastest.shapes, fastest.triangles, fastest.allocations,
+		       fastest.milliseconds);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int maxTowers = argc > 1 ? atoi(argv[1]) : 16;
+	int repetitions = argc > 2 ? atoi(argv[2]) : 3;
+
+	architecture::Grammar grammar;
+	if (argc > 3)
+	{
+		try
+		{
+			grammar = architecture::Grammar::loadFromFile(argv[3]);
+		}
+		catch (const std::runtime_error& error)
+		{
+			std::cerr << error.what() << "\n";
+			return 1;
+		}
+		architecture::setGrammar(&grammar);
+	}
+
+	std::cout << "Castle rules and CSG, fastest of " << repetitions << " runs" << (argc > 3 ? ", grammar " : ", built-in rules")
+	          << (argc > 3 ? argv[3] : "") << "\n";
+	printf("%6s  %-10s %9s %10s %12s %10s\n", "towers", "case", "shapes", "triangles", "allocations", "ms");
+	for (int numTowers = 2; numTowers <= maxTowers; numTowers *= 2)
+	{
+		benchmark("makeTower", towers, numTowers, repetitions);
+		benchmark("makeWall", walls, numTowers, repetitions);
+		benchmark("makeWalls", castle, numTowers, repetitions);
+		benchmark("intersect", intersections, numTowers, repetitions);
+	}
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+// Compares the generic Shape::subdivide and Shape::repeat with the compile time
+// specialized versions on the window and battlement splits used by the castle rules.
+// Usage: splitbenchmark [number of iterations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <shape.h>
+
+using architecture::Shape;
+using architecture::CoordSys;
+using architecture::CoordSysType;
+using architecture::SizePolicy;
+
+namespace
+{
+	const int batchSize = 1000;
+
+	std::string outerNames[] = { "EMPTY", "Window", "EMPTY" };
+	std::string innerNames[] = { "Frame", "Space", "Frame" };
+	std::string sectionNames[] = { "Portion", "Embrasure", "Portion" };
+	SizePolicy windowPolicies[] = { SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative };
+	SizePolicy sectionPolicies[] = { SizePolicy::relative, SizePolicy::absoluteOuter, SizePolicy::relative };
+	float outerWidths[] = { 1, 4, 1 };
+	float outerHeights[] = { 1.5, 10, 1 };
+	float innerWidths[] = { 1, 2, 1 };
+	float innerHeights[] = { 1.5, 8, 1 };
+	float sectionProportions[] = { 1, 2, 1 };
+	int outerMask[] = { 0, 1, 0 };
+	int innerMask[] = { 1, 0, 1 };
+
+	Shape* makeSegment()
+	{
+		CoordSys coordSys = { CoordSysType::cartesian, glm::vec3(0), { glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, 0, 1) } };
+		glm::vec2 bounds[3] = { glm::vec2(0, 3), glm::vec2(-9, 9), glm::vec2(0, 28) };
+		return new Shape(coordSys, bounds);
+	}
+
+	Shape* makeRailing()
+	{
+		CoordSys coordSys = { CoordSysType::cylindrical, glm::vec3(0), { glm::vec3(1, 0, 0), glm::vec3(0, 0, 1), glm::vec3(0, 1, 0) } };
+		glm::vec2 bounds[3] = { glm::vec2(18, 20), glm::vec2(0, 2 * glm::pi<float>() - 0.0001f), glm::vec2(35, 48) };
+		return new Shape(coordSys, bounds);
+	}
+
+	void genericWindow(Shape* segment)
+	{
+		segment->subdivide(1, outerNames, windowPolicies, outerWidths, 3, outerMask);
+		for (Shape* wWindow : *segment->children["Window"])
+		{
+			wWindow->subdivide(2, outerNames, windowPolicies, outerHeights, 3, outerMask);
+			for (Shape* window : *wWindow->children["Window"])
+			{
+				window->subdivide(1, innerNames, windowPolicies, innerWidths, 3);
+				for (Shape* space : *window->children["Space"])
+				{
+					space->subdivide(2, innerNames, windowPolicies, innerHeights, 3, innerMask);
+				}
+			}
+		}
+	}
+
+	void specializedWindow(Shape* segment)
+	{
+		segment->subdivide<1, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(outerNames, outerWidths, outerMask);
+		for (Shape* wWindow : *segment->children["Window"])
+		{
+			wWindow->subdivide<2, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(outerNames, outerHeights, outerMask);
+			for (Shape* window : *wWindow->children["Window"])
+			{
+				window->subdivide<1, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(innerNames, innerWidths);
+				for (Shape* space : *window->children["Space"])
+				{
+					space->subdivide<2, CoordSysType::cartesian, SizePolicy::relative, SizePolicy::absoluteTrue, SizePolicy::relative>(innerNames, innerHeights, innerMask);
+				}
+			}
+		}
+	}
+
+	void genericBattlement(Shape* railing)
+	{
+		railing->repeat(1, "Section", SizePolicy::absoluteOuter, 12.0f);
+		for (Shape* section : *railing->children["Section"])
+		{
+			section->subdivide(1, sectionNames, sectionPolicies, sectionProportions, 3);
+		}
+	}
+
+	void specializedBattlement(Shape* railing)
+	{
+		railing->repeat<1, CoordSysType::cylindrical, SizePolicy::absoluteOuter>("Section", 12.0f);
+		for (Shape* section : *railing->children["Section"])
+		{
+			section->subdivide<1, CoordSysType::cylindrical, SizePolicy::relative, SizePolicy::absoluteOuter, SizePolicy::relative>(sectionNames, sectionProportions);
+		}
+	}
+
+	bool sameTree(Shape* a, Shape* b)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			if (a->bounds[i] != b->bounds[i]) return false;
+		}
+		if (a->children.size() != b->children.size()) return false;
+		for (auto& childCollection : a->children)
+		{
+			auto other = b->children.find(childCollection.first);
+			if (other == b->children.end() || other->second->size() != childCollection.second->size()) return false;
+			for (size_t i = 0; i < childCollection.second->size(); ++i)
+			{
+				if (!sameTree(childCollection.second->at(i), other->second->at(i))) return false;
+			}
+		}
+		return true;
+	}
+
+	// Time only the rule itself, shape allocation and deletion happen outside the clock
+	double timeRule(Shape* (*makeShape)(), void (*rule)(Shape*), int iterations)
+	{
+		std::chrono::duration<double, std::milli> total(0);
+		std::vector<Shape*> shapes(batchSize);
+		for (int done = 0; done < iterations; done += batchSize)
+		{
+			for (auto& shape : shapes) shape = makeShape();
+
+			auto start = std::chrono::high_resolution_clock::now();
+			for (auto& shape : shapes) rule(shape);
+			total += std::chrono::high_resolution_clock::now() - start;
+
+			for (auto& shape : shapes) delete shape;
+		}
+		return total.count();
+	}
+
+	bool compare(const char* name, Shape* (*makeShape)(), void (*generic)(Shape*), void (*specialized)(Shape*), int iterations)
+	{
+		Shape* genericShape = makeShape();
+		Shape* specializedShape = makeShape();
+		generic(genericShape);
+		specialized(specializedShape);
+		bool same = sameTree(genericShape, specializedShape);
+		delete genericShape;
+		delete specializedShape;
+
+		double genericTime = timeRule(makeShape, generic, iterations);
+		double specializedTime = timeRule(makeShape, specialized, iterations);
+
+		std::cout << name << ": generic " << genericTime << " ms, specialized " << specializedTime << " ms, speedup "
+		          << genericTime / specializedTime << "x" << (same ? "" : " (RESULTS DIFFER)") << "\n";
+		return same;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+	std::cout << "Split operators, " << iterations << " iterations\n";
+	bool same = compare("Window", makeSegment, genericWindow, specializedWindow, iterations);
+	same &= compare("Battlement", makeRailing, genericBattlement, specializedBattlement, iterations);
+
+	return same ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+// Compares the vertex layouts of models and castle shapes on an offscreen GL context.
+// Each model is uploaded in every layout and drawn a number of times into a small viewport,
+// so that fetching and transforming vertices dominates over shading. The fastest repetition
+// is reported along with the bytes of the vertex buffers, which for the castle are the
+// memory usage of its parts, CPU copy included.
+// Usage: vertexbenchmark [draws per repetition] [repetitions] [model.obj ...]
+
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <labhelper.h>
+#include <Model.h>
+#include <castle.h>
+
+using labhelper::Model;
+using labhelper::VertexFormat;
+using architecture::CastlePart;
+
+namespace
+{
+	const int viewportSize = 64;
+
+	// Reads every attribute, so that none of them can be skipped
+	const char* vertexShader =
+		"#version 410\n"
+		"layout(location = 0) in vec3 position;\n"
+		"layout(location = 1) in vec3 normalIn;\n"
+		"layout(location = 2) in vec2 texCoordIn;\n"
+		"uniform mat4 modelViewProjectionMatrix;\n"
+		"out vec3 color;\n"
+		"void main()\n"
+		"{\n"
+		"	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);\n"
+		"	color = normalIn * 0.5 + 0.5 + vec3(texCoordIn, 0.0);\n"
+		"}\n";
+	const char* fragmentShader =
+		"#version 410\n"
+		"in vec3 color;\n"
+		"out vec4 fragmentColor;\n"
+		"void main()\n"
+		"{\n"
+		"	fragmentColor = vec4(color, 1.0);\n"
+		"}\n";
+
+	GLuint compileShader(GLenum type, const char* source)
+	{
+		GLuint shader = glCreateShader(type);
+		glShaderSource(shader, 1, &source, nullptr);
+		glCompileShader(shader);
+		return shader;
+	}
+
+	// Fits the bounding box of positions into the view
+	glm::mat4 fitMatrix(const std::vector<glm::vec3>& positions)
+	{
+		glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+		for (const glm::vec3& position : positions)
+		{
+			low = glm::min(low, position);
+			high = glm::max(high, position);
+		}
+		glm::vec3 size = high - low;
+		float scale = 1.8f / glm::max(size.x, glm::max(size.y, size.z));
+		return glm::scale(glm::vec3(scale, scale, 0.5f * scale)) * glm::translate(-0.5f * (low + high));
+	}
+
+	// Milliseconds per draw of the fastest repetition
+	template <typename Draw>
+	double time(Draw draw, int draws, int repetitions)
+	{
+		draw();
+		glFinish();
+		double fastest = 0;
+		for (int i = 0; i < repetitions; ++i)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int j = 0; j < draws; ++j)
+			{
+				draw();
+			}
+			glFinish();
+			double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			if (i == 0 || milliseconds < fastest) fastest = milliseconds;
+		}
+		return fastest / draws;
+	}
+
+	const char* formatName(VertexFormat format)
+	{
+		switch (format)
+		{
+		case VertexFormat::separate: return "separate";
+		case VertexFormat::interleaved: return "interleaved";
+		default: return "compact";
+		}
+	}
+
+	void benchmarkModel(const std::string& filename, GLuint program, int draws, int repetitions)
+	{
+		for (VertexFormat format : { VertexFormat::separate, VertexFormat::interleaved, VertexFormat::compact })
+		{
+			Model* model = labhelper::loadModelFromOBJ(filename, format);
+			glm::mat4 matrix = fitMatrix(model->m_positions);
+			glUniformMatrix4fv(glGetUniformLocation(program, "modelViewProjectionMatrix"), 1, false, &matrix[0][0]);
+			double milliseconds = time([model] { labhelper::render(model, false); }, draws, repetitions);
+			printf("%-24s %-12s %10zu %10zu %12zu %10.3f\n", model->m_name.c_str(), formatName(format), model->m_positions.size(),
+			       model->m_indices.size() / 3, model->m_positions.size() * labhelper::bytesPerVertex(format), milliseconds);
+			labhelper::freeModel(model);
+		}
+	}
+
+	// A ring of towers and walls, as in castlebenchmark
+	void benchmarkCastle(int numTowers, GLuint program, int draws, int repetitions)
+	{
+		std::vector<glm::vec3> nodes;
+		float circleRadius = glm::max(100.0f, numTowers * 6 * 20 / (2 * glm::pi<float>()));
+		for (int i = 0; i < numTowers; ++i)
+		{
+			float angle = 2 * glm::pi<float>() * i / numTowers;
+			nodes.push_back(circleRadius * glm::vec3(cos(angle), 0, sin(angle)));
+		}
+		std::vector<CastlePart*> parts = architecture::makeWalls(nodes.data(), nodes.size());
+		std::vector<glm::vec3> triangles;
+		for (CastlePart* part : parts)
+		{
+			part->generate();
+			part->collectTriangles(triangles);
+		}
+		glm::mat4 fit = fitMatrix(triangles);
+
+		for (bool compact : { false, true })
+		{
+			size_t memory = 0;
+			for (CastlePart* part : parts)
+			{
+				part->upload(compact);
+				memory += part->memoryUsage();
+			}
+			auto draw = [&] {
+				for (CastlePart* part : parts)
+				{
+					glm::mat4 matrix = fit * part->modelMatrix();
+					glUniformMatrix4fv(glGetUniformLocation(program, "modelViewProjectionMatrix"), 1, false, &matrix[0][0]);
+					part->render();
+				}
+			};
+			double milliseconds = time(draw, draws, repetitions);
+			printf("%-24s %-12s %10s %10zu %12zu %10.3f\n", ("castle, " + std::to_string(numTowers) + " towers").c_str(),
+			       compact ? "compact" : "separate", "", triangles.size() / 3, memory, milliseconds);
+		}
+
+		// Walls read their towers until deleted, so they go first
+		for (size_t i = parts.size(); i-- > 0;)
+		{
+			delete parts[i];
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int draws = argc > 1 ? atoi(argv[1]) : 100;
+	int repetitions = argc > 2 ? atoi(argv[2]) : 5;
+	std::vector<std::string> models;
+	for (int i = 3; i < argc; ++i)
+	{
+		models.push_back(argv[i]);
+	}
+	if (models.empty()) models = { "../scenes/NewShip.obj", "../scenes/landingpad.obj", "../scenes/sphere.obj" };
+
+	if (!labhelper::init_offscreen_EGL(viewportSize, viewportSize)) return 1;
+
+	GLuint program = glCreateProgram();
+	glAttachShader(program, compileShader(GL_VERTEX_SHADER, vertexShader));
+	glAttachShader(program, compileShader(GL_FRAGMENT_SHADER, fragmentShader));
+	glLinkProgram(program);
+	glUseProgram(program);
+	glViewport(0, 0, viewportSize, viewportSize);
+	glEnable(GL_DEPTH_TEST);
+
+	printf("Vertex layouts on %s, %d draws, fastest of %d runs\n", glGetString(GL_RENDERER), draws, repetitions);
+	printf("%-24s %-12s %10s %10s %12s %10s\n", "model", "layout", "vertices", "triangles", "bytes", "ms/draw");
+	for (const std::string& model : models)
+	{
+		benchmarkModel(model, program, draws, repetitions);
+	}
+	benchmarkCastle(16, program, draws / 10 + 1, repetitions);
+
+	glDeleteProgram(program);
+	labhelper::shutDownOffscreen();
+	return 0;
+}
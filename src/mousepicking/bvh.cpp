@@ -0,0 +1,329 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+namespace mousepicking
+{
+	namespace
+	{
+		const int numBins = 12;
+		const uint32_t maxLeafSize = 4;
+
+		struct Bounds
+		{
+			glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+			glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+			void grow(glm::vec3 point)
+			{
+				min = glm::min(min, point);
+				max = glm::max(max, point);
+			}
+
+			void grow(const Bounds& other)
+			{
+				min = glm::min(min, other.min);
+				max = glm::max(max, other.max);
+			}
+
+			float area() const
+			{
+				glm::vec3 extent = max - min;
+				if (extent.x < 0) return 0;
+				return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+			}
+		};
+
+		struct BuildItem
+		{
+			Bounds bounds;
+			glm::vec3 centroid;
+			uint32_t triangle;
+		};
+	}
+
+	void Bvh::clear()
+	{
+		triangles.clear();
+		nodes.clear();
+		depth = 0;
+	}
+
+	void Bvh::addTriangles(const std::vector<glm::vec3>& positions, uint32_t objectId)
+	{
+		for (size_t i = 0; i + 2 < positions.size(); i += 3)
+		{
+			Triangle triangle = { positions[i], positions[i + 1] - positions[i], positions[i + 2] - positions[i], objectId };
+			triangles.push_back(triangle);
+		}
+	}
+
+	void Bvh::build()
+	{
+		nodes.clear();
+		depth = 0;
+		if (triangles.empty()) return;
+
+		std::vector<BuildItem> items(triangles.size());
+		for (uint32_t i = 0; i < triangles.size(); ++i)
+		{
+			const Triangle& triangle = triangles[i];
+			items[i].bounds.grow(triangle.v0);
+			items[i].bounds.grow(triangle.v0 + triangle.edge1);
+			items[i].bounds.grow(triangle.v0 + triangle.edge2);
+			items[i].centroid = 0.5f * (items[i].bounds.min + items[i].bounds.max);
+			items[i].triangle = i;
+		}
+
+		nodes.reserve(2 * triangles.size());
+		struct Task { uint32_t start, end, node, depth; };
+		std::vector<Task> stack;
+		nodes.push_back(Node());
+		stack.push_back({ 0, (uint32_t)items.size(), 0, 0 });
+		while (!stack.empty())
+		{
+			Task task = stack.back();
+			stack.pop_back();
+			depth = std::max(depth, task.depth);
+
+			Bounds bounds, centroidBounds;
+			for (uint32_t i = task.start; i < task.end; ++i)
+			{
+				bounds.grow(items[i].bounds);
+				centroidBounds.grow(items[i].centroid);
+			}
+			nodes[task.node].min = bounds.min;
+			nodes[task.node].max = bounds.max;
+
+			uint32_t count = task.end - task.start;
+			uint32_t mid = task.start;
+			if (count > maxLeafSize)
+			{
+				// Binned surface area heuristic
+				float bestCost = count * bounds.area();
+				int bestAxis = -1;
+				int bestBin = 0;
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+					if (extent <= 0) continue;
+
+					Bounds binBounds[numBins];
+					uint32_t binCounts[numBins] = {};
+					for (uint32_t i = task.start; i < task.end; ++i)
+					{
+						int bin = std::min(numBins - 1, int(numBins * (items[i].centroid[axis] - centroidBounds.min[axis]) / extent));
+						binBounds[bin].grow(items[i].bounds);
+						++binCounts[bin];
+					}
+
+					float rightCosts[numBins];
+					Bounds right;
+					uint32_t rightCount = 0;
+					for (int bin = numBins - 1; bin > 0; --bin)
+					{
+						right.grow(binBounds[bin]);
+						rightCount += binCounts[bin];
+						rightCosts[bin] = rightCount * right.area();
+					}
+					Bounds left;
+					uint32_t leftCount = 0;
+					for (int bin = 0; bin < numBins - 1; ++bin)
+					{
+						left.grow(binBounds[bin]);
+						leftCount += binCounts[bin];
+						float cost = leftCount * left.area() + rightCosts[bin + 1];
+						if (leftCount > 0 && leftCount < count && cost < bestCost)
+						{
+							bestCost = cost;
+							bestAxis = axis;
+							bestBin = bin;
+						}
+					}
+				}
+
+				if (bestAxis >= 0)
+				{
+					float extent = centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis];
+					float minCentroid = centroidBounds.min[bestAxis];
+					mid = uint32_t(std::partition(items.begin() + task.start, items.begin() + task.end, [&](const BuildItem& item)
+					{
+						return std::min(numBins - 1, int(numBins * (item.centroid[bestAxis] - minCentroid) / extent)) <= bestBin;
+					}) - items.begin());
+				}
+				else if (count > 4 * maxLeafSize)
+				{
+					// No split pays off, but keep leaves small anyway
+					mid = task.start + count / 2;
+				}
+			}
+
+			if (mid == task.start)
+			{
+				nodes[task.node].first = task.start;
+				nodes[task.node].count = count;
+			}
+			else
+			{
+				uint32_t leftChild = (uint32_t)nodes.size();
+				uint32_t rightChild = leftChild + 1;
+				nodes.push_back(Node());
+				nodes.push_back(Node());
+				nodes[task.node].first = leftChild;
+				nodes[task.node].count = 0;
+				stack.push_back({ mid, task.end, rightChild, task.depth + 1 });
+				stack.push_back({ task.start, mid, leftChild, task.depth + 1 });
+			}
+		}
+
+		std::vector<Triangle> ordered(triangles.size());
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			ordered[i] = triangles[items[i].triangle];
+		}
+		triangles.swap(ordered);
+	}
+
+	bool Bvh::intersect(glm::vec3 origin, glm::vec3 direction, RayHit& hit, float maxDistance) const
+	{
+		if (nodes.empty()) return false;
+
+		glm::vec3 inverseDirection = 1.0f / direction;
+		float closest = maxDistance;
+		const Triangle* closestTriangle = nullptr;
+
+		// At most one pending sibling per level, degenerate trees deeper than the local stack go to the heap
+		uint32_t localStack[64];
+		std::vector<uint32_t> heapStack;
+		uint32_t* stack = localStack;
+		if (depth > 64)
+		{
+			heapStack.resize(depth);
+			stack = heapStack.data();
+		}
+		int stackSize = 0;
+		uint32_t current = 0;
+		while (true)
+		{
+			const Node& node = nodes[current];
+
+			// Slab test
+			glm::vec3 t0 = (node.min - origin) * inverseDirection;
+			glm::vec3 t1 = (node.max - origin) * inverseDirection;
+			glm::vec3 tNear = glm::min(t0, t1);
+			glm::vec3 tFar = glm::max(t0, t1);
+			float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+			float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, closest));
+
+			if (enter <= exit)
+			{
+				if (node.count > 0)
+				{
+					// Möller-Trumbore
+					for (uint32_t i = node.first; i < node.first + node.count; ++i)
+					{
+						const Triangle& triangle = triangles[i];
+						glm::vec3 p = glm::cross(direction, triangle.edge2);
+						float determinant = glm::dot(triangle.edge1, p);
+						if (std::abs(determinant) < 1e-12f) continue;
+						float inverseDeterminant = 1.0f / determinant;
+						glm::vec3 s = origin - triangle.v0;
+						float u = glm::dot(s, p) * inverseDeterminant;
+						if (u < 0 || u > 1) continue;
+						glm::vec3 q = glm::cross(s, triangle.edge1);
+						float v = glm::dot(direction, q) * inverseDeterminant;
+						if (v < 0 || u + v > 1) continue;
+						float t = glm::dot(triangle.edge2, q) * inverseDeterminant;
+						if (t >= 0 && t < closest)
+						{
+							closest = t;
+							closestTriangle = &triangle;
+						}
+					}
+				}
+				else
+				{
+					stack[stackSize++] = node.first + 1;
+					current = node.first;
+					continue;
+				}
+			}
+
+			if (stackSize == 0) break;
+			current = stack[--stackSize];
+		}
+
+		if (closestTriangle == nullptr) return false;
+		hit.objectId = closestTriangle->objectId;
+		hit.distance = closest;
+		hit.position = origin + closest * direction;
+		return true;
+	}
+
+	BvhBuilder::BvhBuilder()
+	{
+		worker = std::thread(&BvhBuilder::work, this);
+	}
+
+	BvhBuilder::~BvhBuilder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		workAvailable.notify_all();
+		worker.join();
+	}
+
+	void BvhBuilder::request(Bvh bvh)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			waiting = std::move(bvh);
+			hasWaiting = true;
+		}
+		workAvailable.notify_one();
+	}
+
+	bool BvhBuilder::poll(Bvh& bvh)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!hasFinished) return false;
+		bvh = std::move(finished);
+		hasFinished = false;
+		return true;
+	}
+
+	void BvhBuilder::work()
+	{
+		while (true)
+		{
+			Bvh bvh;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				workAvailable.wait(lock, [this] { return stopping || hasWaiting; });
+				if (stopping) return;
+				bvh = std::move(waiting);
+				hasWaiting = false;
+			}
+
+			bvh.build();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finished = std::move(bvh);
+				hasFinished = true;
+			}
+		}
+	}
+
+	void windowRay(glm::vec2 winCoord, glm::mat4 modelViewMatrix, glm::mat4 projMatrix, glm::vec4 viewport, glm::vec3& origin, glm::vec3& direction)
+	{
+		origin = glm::unProject(glm::vec3(winCoord, 0), modelViewMatrix, projMatrix, viewport);
+		direction = glm::unProject(glm::vec3(winCoord, 1), modelViewMatrix, projMatrix, viewport) - origin;
+	}
+}
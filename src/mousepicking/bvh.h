@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <glm/glm.hpp>
+
+namespace mousepicking
+{
+	struct RayHit
+	{
+		uint32_t objectId;
+		float distance; // Along the ray direction, in units of its length
+		glm::vec3 position;
+	};
+
+	// Bounding volume hierarchy over triangles tagged with object ids, for picking
+	// by casting rays on the CPU instead of reading back an id buffer.
+	class Bvh
+	{
+	public:
+		void clear();
+		// Add a triangle list, three positions per triangle
+		void addTriangles(const std::vector<glm::vec3>& positions, uint32_t objectId);
+		// Build the hierarchy over everything added since the last clear
+		void build();
+
+		// Closest hit along origin + t * direction for t in [0, maxDistance]
+		bool intersect(glm::vec3 origin, glm::vec3 direction, RayHit& hit, float maxDistance = std::numeric_limits<float>::max()) const;
+
+		size_t numTriangles() const { return triangles.size(); }
+
+	private:
+		struct Triangle
+		{
+			glm::vec3 v0, edge1, edge2;
+			uint32_t objectId;
+		};
+
+		struct Node
+		{
+			glm::vec3 min;
+			uint32_t first; // First triangle for leaves, first of the two adjacent children for inner nodes
+			glm::vec3 max;
+			uint32_t count; // Triangles in a leaf, 0 for inner nodes
+		};
+
+		std::vector<Triangle> triangles;
+		std::vector<Node> nodes;
+		// Longest path from the root, bounds the traversal stack
+		uint32_t depth = 0;
+	};
+
+	// Builds hierarchies on a worker thread, so that rebuilding does not stall the caller.
+	// A request made while another is waiting replaces it.
+	class BvhBuilder
+	{
+	public:
+		BvhBuilder();
+		~BvhBuilder();
+
+		// Build bvh, with its triangles added, in the background
+		void request(Bvh bvh);
+		// Take the newest finished hierarchy, returns false if none finished since the last poll
+		bool poll(Bvh& bvh);
+
+	private:
+		std::mutex mutex;
+		std::condition_variable workAvailable;
+		Bvh waiting;
+		Bvh finished;
+		bool hasWaiting = false;
+		bool hasFinished = false;
+		bool stopping = false;
+		std::thread worker;
+
+		void work();
+	};
+
+	// The ray from the near plane through window coordinate winCoord, in the space that modelViewMatrix maps from
+	void windowRay(glm::vec2 winCoord, glm::mat4 modelViewMatrix, glm::mat4 projMatrix, glm::vec4 viewport, glm::vec3& origin, glm::vec3& direction);
+}
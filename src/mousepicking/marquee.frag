@@ -0,0 +1,28 @@
+#version 420
+
+// Collects the unique object ids of the fragments within the scissor rectangle
+// into a compact list. Draw a full screen quad with the rectangle as scissor.
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+layout(binding = 0) uniform usampler2D idTexture;
+// Per id the stamp of the last query that listed it, so it never has to be cleared
+layout(binding = 0, r32ui) uniform coherent uimageBuffer seen;
+layout(binding = 1, r32ui) uniform writeonly uimageBuffer list;
+layout(binding = 0, offset = 0) uniform atomic_uint listSize;
+
+uniform uint stamp;
+uniform uint capacity;
+
+void main()
+{
+	uint id = texelFetch(idTexture, ivec2(gl_FragCoord.xy), 0).r;
+	if (id == 0u || id >= capacity) return;
+
+	if (imageAtomicExchange(seen, int(id), stamp) != stamp)
+	{
+		uint index = atomicCounterIncrement(listSize);
+		imageStore(list, int(index), uvec4(id));
+	}
+}
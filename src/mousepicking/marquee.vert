@@ -0,0 +1,7 @@
+#version 420
+// A triangle covering the screen, drawn without vertex buffers
+void main()
+{
+	vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(2.0 * position - 1.0, 0.0, 1.0);
+}
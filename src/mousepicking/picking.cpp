@@ -1,19 +1,279 @@
 #include "picking.h"
 
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+
 #include <glm/gtc/matrix_transform.hpp>
 
 // Returns a movement vector in model space
 glm::vec3 mousepicking::moveAlongPlane(glm::vec3 oldModelCoord, glm::vec2 newWinCoord, glm::mat4 modelViewMatrix, glm::mat4 projMatrix, glm::vec4 viewport, glm::vec3 modelSpacePlaneNormal)
 {
-	float oldRelativePlaneHeight = glm::dot(oldModelCoord, glm::normalize(modelSpacePlaneNormal));
+	glm::vec3 modelSpaceNewPoint;
+	if (!PlaneDrag(modelViewMatrix, projMatrix, viewport).intersect(newWinCoord, oldModelCoord, modelSpacePlaneNormal, modelSpaceNewPoint)) return glm::vec3(0);
+	return modelSpaceNewPoint - oldModelCoord;
+}
+
+mousepicking::PlaneDrag::PlaneDrag(glm::mat4 modelViewMatrix, glm::mat4 projMatrix, glm::vec4 viewport) :
+	inverseViewProjection(glm::inverse(projMatrix * modelViewMatrix)),
+	viewport(viewport)
+{
+}
 
-	glm::vec3 modelSpaceNewMin = glm::unProject(glm::vec3(newWinCoord, 0), modelViewMatrix, projMatrix, viewport);
-	glm::vec3 modelSpaceNewMax = glm::unProject(glm::vec3(newWinCoord, 1), modelViewMatrix, projMatrix, viewport);
+bool mousepicking::PlaneDrag::intersect(glm::vec2 winCoord, glm::vec3 planePoint, glm::vec3 planeNormal, glm::vec3& result) const
+{
+	// The cursor ray from the near to the far plane, as unProject would give
+	glm::vec2 ndc = 2.0f * (winCoord - glm::vec2(viewport.x, viewport.y)) / glm::vec2(viewport.z, viewport.w) - 1.0f;
+	glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndc, -1, 1);
+	glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndc, 1, 1);
+	glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+	glm::vec3 direction = glm::vec3(farPoint) / farPoint.w - origin;
 
-	float newMinRelativePlaneHeight = glm::dot(modelSpaceNewMin, glm::normalize(modelSpacePlaneNormal));
-	float newMaxRelativePlaneHeight = glm::dot(modelSpaceNewMax, glm::normalize(modelSpacePlaneNormal));
-	float newMixVal = (oldRelativePlaneHeight - newMinRelativePlaneHeight) / (newMaxRelativePlaneHeight - newMinRelativePlaneHeight);
+	float denominator = glm::dot(direction, planeNormal);
+	if (std::abs(denominator) < 1e-8f) return false;
 
-	glm::vec3 modelSpaceNewPoint = (1 - newMixVal) * modelSpaceNewMin + newMixVal * modelSpaceNewMax;
-	return modelSpaceNewPoint - oldModelCoord;
+	result = origin + glm::dot(planePoint - origin, planeNormal) / denominator * direction;
+	return true;
+}
+
+glm::vec3 mousepicking::PlaneDrag::move(glm::vec3 grabbedPoint, glm::vec2 winCoord, glm::vec3 planeNormal, glm::vec3 reference, const Snapping& snapping) const
+{
+	glm::vec3 movement(0);
+	glm::vec3 newPoint;
+	if (intersect(winCoord, grabbedPoint, planeNormal, newPoint)) movement = newPoint - grabbedPoint;
+
+	glm::vec3 normal = glm::normalize(planeNormal);
+	// Grid axes spanning the plane
+	glm::vec3 axis1 = glm::normalize(std::abs(normal.x) < 0.9f ? glm::cross(normal, glm::vec3(1, 0, 0)) : glm::cross(normal, glm::vec3(0, 1, 0)));
+	glm::vec3 axis2 = glm::cross(normal, axis1);
+
+	glm::vec3 moved = reference + movement;
+
+	if (snapping.gridSize > 0)
+	{
+		float height = glm::dot(moved, normal);
+		float u = glm::round(glm::dot(moved, axis1) / snapping.gridSize) * snapping.gridSize;
+		float v = glm::round(glm::dot(moved, axis2) / snapping.gridSize) * snapping.gridSize;
+		moved = height * normal + u * axis1 + v * axis2;
+	}
+
+	// Line up with the nearest target along each axis
+	float u = glm::dot(moved, axis1);
+	float v = glm::dot(moved, axis2);
+	float closestU = snapping.targetRadius;
+	float closestV = snapping.targetRadius;
+	float snappedU = u;
+	float snappedV = v;
+	for (const glm::vec3& target : snapping.targets)
+	{
+		float targetU = glm::dot(target, axis1);
+		float targetV = glm::dot(target, axis2);
+		if (std::abs(targetU - u) < closestU)
+		{
+			closestU = std::abs(targetU - u);
+			snappedU = targetU;
+		}
+		if (std::abs(targetV - v) < closestV)
+		{
+			closestV = std::abs(targetV - v);
+			snappedV = targetV;
+		}
+	}
+	moved += (snappedU - u) * axis1 + (snappedV - v) * axis2;
+
+	return moved - reference;
+}
+
+void mousepicking::PickReadback::init()
+{
+	for (Slot& slot : slots)
+	{
+		glGenBuffers(1, &slot.buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		// The id followed by the depth
+		glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(uint32_t) + sizeof(float), nullptr, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void mousepicking::PickReadback::destroy()
+{
+	for (Slot& slot : slots)
+	{
+		if (slot.fence != 0) glDeleteSync(slot.fence);
+		if (slot.buffer != 0) glDeleteBuffers(1, &slot.buffer);
+		slot = Slot();
+	}
+	writeIndex = readIndex = inFlight = 0;
+}
+
+void mousepicking::PickReadback::request(GLuint framebuffer, GLenum idAttachment, int x, int y)
+{
+	if (inFlight == ringSize) return;
+
+	Slot& slot = slots[writeIndex];
+	slot.sample.x = x;
+	slot.sample.y = y;
+	slot.requestTime = std::chrono::steady_clock::now();
+	slot.requestFrame = frame;
+
+	// With a pack buffer bound the pointer arguments are offsets into it
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	glReadBuffer(idAttachment);
+	glReadPixels(x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, (void*)0);
+	glReadPixels(x, y, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, (void*)sizeof(uint32_t));
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	// Reset stuff
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	writeIndex = (writeIndex + 1) % ringSize;
+	++inFlight;
+}
+
+bool mousepicking::PickReadback::poll(Sample& sample)
+{
+	++frame;
+	bool found = false;
+	// Fences signal in order, stop at the first one still pending
+	while (inFlight > 0)
+	{
+		Slot& slot = slots[readIndex];
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		const char* data = (const char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(uint32_t) + sizeof(float), GL_MAP_READ_BIT);
+		if (data != nullptr)
+		{
+			memcpy(&slot.sample.id, data, sizeof(uint32_t));
+			memcpy(&slot.sample.depth, data + sizeof(uint32_t), sizeof(float));
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+			sample = slot.sample;
+			found = true;
+			latencyMs_ = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - slot.requestTime).count();
+			latencyFrames_ = frame - slot.requestFrame;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		readIndex = (readIndex + 1) % ringSize;
+		--inFlight;
+	}
+	return found;
+}
+
+const uint32_t mousepicking::MarqueeSelection::capacity;
+
+void mousepicking::MarqueeSelection::init()
+{
+	std::vector<uint32_t> zeros(capacity, 0);
+
+	glGenBuffers(1, &seenBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, seenBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, capacity * sizeof(uint32_t), zeros.data(), GL_DYNAMIC_COPY);
+	glGenTextures(1, &seenTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, seenTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, seenBuffer);
+
+	glGenBuffers(1, &listBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, listBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, capacity * sizeof(uint32_t), nullptr, GL_DYNAMIC_READ);
+	glGenTextures(1, &listTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, listTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, listBuffer);
+
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glGenBuffers(1, &counterBuffer);
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counterBuffer);
+	glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(uint32_t), nullptr, GL_DYNAMIC_READ);
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+
+	glGenVertexArrays(1, &vertexArray);
+}
+
+void mousepicking::MarqueeSelection::destroy()
+{
+	if (fence != 0) glDeleteSync(fence);
+	glDeleteTextures(1, &seenTexture);
+	glDeleteTextures(1, &listTexture);
+	glDeleteBuffers(1, &seenBuffer);
+	glDeleteBuffers(1, &listBuffer);
+	glDeleteBuffers(1, &counterBuffer);
+	glDeleteVertexArrays(1, &vertexArray);
+	*this = MarqueeSelection();
+}
+
+void mousepicking::MarqueeSelection::request(GLuint program, GLuint idTexture, glm::ivec2 a, glm::ivec2 b)
+{
+	if (fence != 0) glDeleteSync(fence);
+
+	glm::ivec2 low = glm::min(a, b);
+	glm::ivec2 size = glm::max(a, b) - low + 1;
+
+	++stamp;
+	uint32_t zero = 0;
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counterBuffer);
+	glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(uint32_t), &zero);
+	glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, counterBuffer);
+
+	glUseProgram(program);
+	glUniform1ui(glGetUniformLocation(program, "stamp"), stamp);
+	glUniform1ui(glGetUniformLocation(program, "capacity"), capacity);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, idTexture);
+	glBindImageTexture(0, seenTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+	glBindImageTexture(1, listTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32UI);
+
+	// Only the side effects of the pass are wanted
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(low.x, low.y, size.x, size.y);
+
+	glBindVertexArray(vertexArray);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	// Reset stuff
+	glDisable(GL_SCISSOR_TEST);
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, 0);
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+
+	glMemoryBarrier(GL_ATOMIC_COUNTER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool mousepicking::MarqueeSelection::poll(std::vector<uint32_t>& ids)
+{
+	if (fence == 0) return false;
+	GLenum status = glClientWaitSync(fence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return false;
+	glDeleteSync(fence);
+	fence = 0;
+
+	uint32_t count = 0;
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counterBuffer);
+	glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(uint32_t), &count);
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+
+	ids.resize(std::min(count, capacity));
+	if (!ids.empty())
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, listBuffer);
+		glGetBufferSubData(GL_TEXTURE_BUFFER, 0, ids.size() * sizeof(uint32_t), ids.data());
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+	return true;
 }
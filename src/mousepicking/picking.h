@@ -1,6 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
 #include <glm/glm.hpp>
 
 namespace mousepicking
 {
 	glm::vec3 moveAlongPlane(glm::vec3 oldModelCoord, glm::vec2 newWinCoord, glm::mat4 modelViewMatrix, glm::mat4 projMatrix, glm::vec4 viewport, glm::vec3 modelSpacePlaneNormal);
-}
\ No newline at end of file
+
+	struct Snapping
+	{
+		// Grid spacing in the drag plane, 0 disables
+		float gridSize = 0;
+		// Points to line up with, such as other towers. Each grid axis snaps to the
+		// nearest target coordinate within targetRadius, both together land on the target.
+		std::vector<glm::vec3> targets;
+		float targetRadius = 0;
+	};
+
+	// Drags points along planes after the cursor. Built once per mouse event with the
+	// inverse of the view projection precomputed, so any number of points can be moved
+	// with a ray-plane intersection each.
+	class PlaneDrag
+	{
+	public:
+		PlaneDrag(glm::mat4 modelViewMatrix, glm::mat4 projMatrix, glm::vec4 viewport);
+
+		// Where the cursor ray at winCoord meets the plane through planePoint, returns false if it is parallel
+		bool intersect(glm::vec2 winCoord, glm::vec3 planePoint, glm::vec3 planeNormal, glm::vec3& result) const;
+
+		// The grabbed point follows the cursor in its plane and reference, the point of the grabbed
+		// object to snap by, moves along and is snapped. Returns the movement of reference, which
+		// applied to every dragged object moves a selection as a rigid group.
+		glm::vec3 move(glm::vec3 grabbedPoint, glm::vec2 winCoord, glm::vec3 planeNormal, glm::vec3 reference, const Snapping& snapping) const;
+
+	private:
+		glm::mat4 inverseViewProjection;
+		glm::vec4 viewport;
+	};
+
+	// Reads the object id and depth under the cursor through a ring of pixel buffer
+	// objects. A result arrives a frame or two after it was requested, once its fence
+	// has signalled, so the CPU never waits for the GPU. Call poll and then request
+	// once per frame.
+	class PickReadback
+	{
+	public:
+		static const int ringSize = 3;
+
+		struct Sample
+		{
+			uint32_t id;
+			float depth;
+			int x, y;
+		};
+
+		// Create the buffers, needs a current GL context
+		void init();
+		void destroy();
+
+		// Queue a read of the pixel at (x, y), in window coordinates with the origin at the
+		// bottom left, from the id attachment and depth buffer of framebuffer. Skipped when
+		// the whole ring is still in flight.
+		void request(GLuint framebuffer, GLenum idAttachment, int x, int y);
+		// Take the newest finished sample, returns false if none finished since the last poll
+		bool poll(Sample& sample);
+
+		// Age of the last sample when it arrived
+		float latencyMs() const { return latencyMs_; }
+		int latencyFrames() const { return latencyFrames_; }
+
+	private:
+		struct Slot
+		{
+			GLuint buffer = 0;
+			GLsync fence = 0;
+			Sample sample;
+			std::chrono::steady_clock::time_point requestTime;
+			int requestFrame = 0;
+		};
+
+		Slot slots[ringSize];
+		// Next slot to write and oldest slot in flight
+		int writeIndex = 0;
+		int readIndex = 0;
+		int inFlight = 0;
+		int frame = 0;
+
+		float latencyMs_ = 0;
+		int latencyFrames_ = 0;
+	};
+
+	// Finds the unique object ids within a rectangle of an id texture on the GPU.
+	// A fragment pass over the rectangle appends each id once to a compact list,
+	// and only that list is read back, a frame later like PickReadback.
+	class MarqueeSelection
+	{
+	public:
+		// Ids at or above this are ignored
+		static const uint32_t capacity = 1 << 16;
+
+		void init();
+		void destroy();
+
+		// Select within the rectangle spanned by corners a and b, in window coordinates with
+		// the origin at the bottom left. program is marquee.vert with marquee.frag.
+		void request(GLuint program, GLuint idTexture, glm::ivec2 a, glm::ivec2 b);
+		// Take the ids of the last request once it has finished
+		bool poll(std::vector<uint32_t>& ids);
+
+	private:
+		GLuint seenBuffer = 0;
+		GLuint seenTexture = 0;
+		GLuint listBuffer = 0;
+		GLuint listTexture = 0;
+		GLuint counterBuffer = 0;
+		GLuint vertexArray = 0;
+		GLsync fence = 0;
+		uint32_t stamp = 0;
+	};
+}